@@ -0,0 +1,49 @@
+"""
+Micro-benchmark of the per-call overhead of the Python bindings: the latency of t[i],
+t + t2 and len(t) on small tensors, with the compiled cffi extension (API mode, see
+build_tensor1d.py) against the ABI mode fallback that goes through libffi. Our Python
+side loops are bound by exactly this overhead, so it also times reading 1000 random
+elements one t[i] at a time, one t.item(i) at a time, and with a single t.take(), and
+adding 1000 small gradients to their parameters one tensor at a time and with a single
+foreach_add_().
+
+Run like:
+python build_tensor1d.py && make libtensor1d.so && python bench_calls.py
+"""
+
+import os
+import subprocess
+import sys
+import timeit
+
+def measure():
+    import tensor1d
+    t = tensor1d.arange(16)
+    t2 = tensor1d.arange(16)
+    mode = "API" if type(tensor1d.lib).__name__ == "Lib" else "ABI"
+    for name, stmt in [("t[i]", lambda: t[3]), ("t + t2", lambda: t + t2), ("len(t)", lambda: len(t))]:
+        number = 200000
+        best = min(timeit.repeat(stmt, number=number, repeat=7)) / number
+        print(f"{mode:>4} {name:>8} {best * 1e9:>8.0f}ns")
+    big = tensor1d.arange(100000)
+    index = [(i * 7919) % len(big) for i in range(1000)]
+    for name, stmt in [("t[i]", lambda: [big[i].item() for i in index]),
+                       ("item(i)", lambda: [big.item(i) for i in index]),
+                       ("take", lambda: big.take(index).tolist())]:
+        best = min(timeit.repeat(stmt, number=100, repeat=7)) / 100
+        print(f"{mode:>4} {name:>8} {best * 1e6:>8.0f}us per 1000 reads")
+    params = [tensor1d.arange(100) for _ in range(1000)]
+    grads = [tensor1d.arange(100) for _ in range(1000)]
+    for name, stmt in [("loop", lambda: [p.copy_(p + g) for p, g in zip(params, grads)]),
+                       ("foreach", lambda: tensor1d.foreach_add_(params, grads))]:
+        best = min(timeit.repeat(stmt, number=10, repeat=7)) / 10
+        print(f"{mode:>4} {name:>8} {best * 1e6:>8.0f}us per 1000 tensors")
+
+if __name__ == "__main__":
+    if len(sys.argv) > 1:
+        measure()
+    else:
+        print(f"{'mode':>4} {'call':>8} {'latency':>10}")
+        # each binding in a fresh process, since tensor1d picks one at import
+        for env in [{"TENSOR1D_ABI": "1"}, {}]:
+            subprocess.run([sys.executable, __file__, "measure"], env={**os.environ, **env}, check=True)
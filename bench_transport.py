@@ -0,0 +1,79 @@
+"""
+Producer/consumer benchmark of the Unix-socket tensor transport: messages/sec and
+round-trip latency of tensor1d.send/recv (only the fd and the view's geometry travel)
+against the copy-based baseline of pickling the floats through the same socket.
+
+Run like:
+python bench_transport.py
+"""
+
+import os
+import pickle
+import socket
+import struct
+import time
+
+import tensor1d
+
+def recv_exactly(sock, n):
+    data = bytearray()
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            raise EOFError
+        data += chunk
+    return bytes(data)
+
+def consume(sock, zero_copy):
+    # receive until the producer hangs up, touching one element and acking each message
+    while True:
+        try:
+            if zero_copy:
+                t = tensor1d.recv(sock)
+                t[len(t) - 1].item()
+            else:
+                (n,) = struct.unpack("Q", recv_exactly(sock, 8))
+                values = pickle.loads(recv_exactly(sock, n))
+                values[-1]
+        except EOFError:
+            return
+        sock.sendall(b"k")
+
+def produce(sock, t, messages, zero_copy):
+    latencies = []
+    start = time.perf_counter()
+    for _ in range(messages):
+        sent = time.perf_counter()
+        if zero_copy:
+            tensor1d.send(sock, t)
+        else:
+            payload = pickle.dumps(t.tolist(), protocol=pickle.HIGHEST_PROTOCOL)
+            sock.sendall(struct.pack("Q", len(payload)) + payload)
+        recv_exactly(sock, 1)
+        latencies.append(time.perf_counter() - sent)
+    elapsed = time.perf_counter() - start
+    latencies.sort()
+    return messages / elapsed, latencies[len(latencies) // 2]
+
+def run(size, messages, zero_copy):
+    kind = socket.SOCK_SEQPACKET if zero_copy else socket.SOCK_STREAM
+    producer, consumer = socket.socketpair(socket.AF_UNIX, kind)
+    pid = os.fork()
+    if pid == 0:
+        producer.close()
+        consume(consumer, zero_copy)
+        os._exit(0)
+    consumer.close()
+    t = tensor1d.arange(size)
+    result = produce(producer, t, messages, zero_copy)
+    producer.close()
+    os.waitpid(pid, 0)
+    return result
+
+if __name__ == "__main__":
+    print(f"{'elements':>10} {'transport':>10} {'msgs/sec':>10} {'p50 latency':>12}")
+    for size, messages in [(1000, 2000), (100000, 500), (1000000, 50)]:
+        for zero_copy in [True, False]:
+            rate, p50 = run(size, messages, zero_copy)
+            name = "fd" if zero_copy else "pickle"
+            print(f"{size:>10} {name:>10} {rate:>10.0f} {p50 * 1e6:>10.1f}us")
@@ -8,11 +8,31 @@ Or create .so for use with cffi:
 gcc -O3 -shared -fPIC -o libtensor1d.so tensor1d.c
 */
 
+#define _GNU_SOURCE // memfd_create and fallocate, for copy-on-write Storages
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <math.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 #include "tensor1d.h"
 
 // ----------------------------------------------------------------------------
@@ -45,57 +65,827 @@ int max(int a, int b) {
 }
 
 // ----------------------------------------------------------------------------
-// Storage: simple array of floats, defensive on index access, reference-counted
+// Storage: simple array of elements, defensive on index access, reference-counted
 // The reference counting allows multiple Tensors sharing the same Storage.
 // similar to torch.Storage
 
-Storage* storage_new(int size) {
+size_t dtype_itemsize(DType dtype) {
+    // bytes per element; DTYPE_BOOL is packed so it has no whole-byte itemsize
+    switch (dtype) {
+        case DTYPE_FLOAT32: return sizeof(float);
+        case DTYPE_INT32: return sizeof(int32_t);
+        case DTYPE_INT64: return sizeof(int64_t);
+        case DTYPE_BOOL: return 0;
+    }
+    return 0;
+}
+
+size_t storage_nbytes(int size, DType dtype) {
+    // bools are packed 64 to a word, so that counting can use popcount
+    if (dtype == DTYPE_BOOL) { return (size_t) ceil_div(size, 64) * sizeof(uint64_t); }
+    return (size_t) size * dtype_itemsize(dtype);
+}
+
+// the first byte of the Storage that holds element idx
+size_t storage_byte_offset(Storage* s, int idx) {
+    return s->dtype == DTYPE_BOOL ? (size_t) idx / 8 : (size_t) idx * dtype_itemsize(s->dtype);
+}
+
+// one past the last byte of the Storage that holds element idx
+size_t storage_byte_end(Storage* s, int idx) {
+    return storage_byte_offset(s, idx) + (s->dtype == DTYPE_BOOL ? 1 : dtype_itemsize(s->dtype));
+}
+
+// all live Storages, so that we can report on the memory they hold. Python calls into
+// us without the GIL, so the list is only touched under all_storages_lock, and the lists
+// of views of each Storage (and everything that walks them) only under storages_lock.
+// When both are needed, storages_lock is taken first: compaction holds it while it
+// makes new Storages.
+Storage* all_storages = NULL;
+pthread_mutex_t all_storages_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t storages_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void storage_init(Storage* storage, void* data, int size, DType dtype) {
     assert(size >= 0);
-    Storage* storage = mallocCheck(sizeof(Storage));
-    storage->data = mallocCheck(size * sizeof(float));
+    storage->data = data;
     storage->data_size = size;
     storage->ref_count = 1;
+    storage->dtype = dtype;
+    storage->readonly = false;
+    storage->mapping = NULL;
+    storage->mapping_size = 0;
+    storage->released_bytes = 0;
+    storage->cow = NULL;
+    storage->fd = -1;
+    storage->version = 0;
+    storage->release = NULL;
+    storage->release_ctx = NULL;
+    storage->inline_scalar = false;
+    storage->pins = 0;
+    storage->views = NULL;
+    storage->prev = NULL;
+    pthread_mutex_lock(&all_storages_lock);
+    storage->next = all_storages;
+    if (all_storages != NULL) { all_storages->prev = storage; }
+    all_storages = storage;
+    pthread_mutex_unlock(&all_storages_lock);
+}
+
+// a Storage of size elements around the memory at data
+Storage* storage_wrap(void* data, int size, DType dtype) {
+    Storage* storage = mallocCheck(sizeof(Storage));
+    storage_init(storage, data, size, dtype);
+    return storage;
+}
+
+// for external memory that its owner frees on its own
+void release_nothing(void* ctx) {
+    (void) ctx;
+}
+
+// gives the memory under s back to wherever it came from
+void storage_free_data(Storage* s) {
+    if (s->release != NULL) {
+        s->release(s->release_ctx);
+        s->release = NULL;
+    } else if (s->mapping != NULL) {
+        munmap(s->mapping, s->mapping_size);
+    } else {
+        free(s->data);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// inline scalars: a one-element Tensor (like what t[i] gives) is allocated in one block
+// together with its Storage and its element, instead of as three. Freed blocks are kept
+// around for reuse, so scalar-heavy code mostly doesn't reach the allocator at all.
+
+typedef struct {
+    Tensor tensor;
+    Storage storage;
+    uint64_t data; // the element, of any dtype (a bool is the low bit of the word)
+} ScalarBlock;
+
+// Python calls into us without the GIL, so each thread keeps a cache of its own: a
+// block can be freed on another thread than the one that made it, and that's fine. The
+// blocks cached by a thread are freed when it exits, by a pthread key destructor.
+#define SCALAR_CACHE_SIZE 64
+_Thread_local ScalarBlock* scalar_cache[SCALAR_CACHE_SIZE];
+_Thread_local int scalar_cache_count = 0;
+_Thread_local bool scalar_cache_armed = false; // whether the destructor runs for this thread
+pthread_key_t scalar_cache_key;
+pthread_once_t scalar_cache_once = PTHREAD_ONCE_INIT;
+
+void scalar_cache_drain(void* cache) {
+    (void) cache;
+    while (scalar_cache_count > 0) { free(scalar_cache[--scalar_cache_count]); }
+    scalar_cache_armed = false;
+}
+
+void scalar_cache_key_create(void) {
+    pthread_key_create(&scalar_cache_key, scalar_cache_drain);
+}
+
+ScalarBlock* scalar_block_of(Storage* s) {
+    return (ScalarBlock*) ((char*) s - offsetof(ScalarBlock, storage));
+}
+
+// the block goes once its Storage does, which can be after its Tensor if views remain
+void scalar_block_free(ScalarBlock* b) {
+    if (scalar_cache_count < SCALAR_CACHE_SIZE) {
+        if (!scalar_cache_armed) {
+            // the destructor only runs for threads with a value set for the key
+            pthread_once(&scalar_cache_once, scalar_cache_key_create);
+            pthread_setspecific(scalar_cache_key, scalar_cache);
+            scalar_cache_armed = true;
+        }
+        scalar_cache[scalar_cache_count++] = b;
+    } else {
+        free(b);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// copy-on-write Storages: opt-in, and Linux only. A big Storage lives in an anonymous
+// in-memory file (a memfd) cut into chunks, and a clone is just a second private mapping
+// of the same chunks, so nothing is copied up front: the OS copies a page the first
+// time either side writes to it. Each chunk of the file has a refcount, and its pages
+// are given back once no Storage maps it. The write barrier (storage_prepare_write)
+// marks the chunks a Storage writes to, because a private mapping no longer matches
+// the file there: the next clone copies out just those chunks, so its cost follows
+// what changed since the last one.
+
+#define COW_CHUNK_BYTES ((size_t) 1 << 18)
+
+// the memfd that the chunks of a family of clones live in
+typedef struct CowArena {
+    int fd;
+    int ref_count;  // Storages that map chunks of it
+    int num_slots;  // chunk-sized slots in the file
+    int* slot_refs; // per slot, how many Storages map it; 0 means free
+    int* free_slots;
+    int num_free;
+} CowArena;
+
+// which slots of the arena a copy-on-write Storage maps, chunk by chunk
+struct CowMapping {
+    CowArena* arena;
+    int num_chunks;
+    int* slots;
+    bool* dirty;  // written since it was mapped privately, so it differs from its slot
+    bool shared;  // mapped shared: no clones yet, writes go straight to the file
+};
+
+bool cow_enabled = false;
+size_t cow_min_bytes = 0;
+
+// Opts in to copy-on-write for Storages of at least min_bytes (and never less than a chunk):
+// new ones are allocated in a memfd, and tensor_clone shares their pages instead of copying.
+void tensor_set_copy_on_write(bool enabled, size_t min_bytes) {
+    cow_enabled = enabled;
+    cow_min_bytes = min_bytes;
+}
+
+bool cow_wanted(size_t nbytes) {
+    return cow_enabled && nbytes >= cow_min_bytes && nbytes >= COW_CHUNK_BYTES;
+}
+
+bool pwrite_full(int fd, const void* buf, size_t nbytes, size_t byte_offset) {
+    const char* p = buf;
+    while (nbytes > 0) {
+        ssize_t n = pwrite(fd, p, nbytes, (off_t) byte_offset);
+        if (n <= 0) { return false; }
+        p += n;
+        nbytes -= (size_t) n;
+        byte_offset += (size_t) n;
+    }
+    return true;
+}
+
+#ifdef __linux__
+
+CowArena* cow_arena_new(void) {
+    int fd = memfd_create("tensor1d", MFD_CLOEXEC);
+    if (fd < 0) { return NULL; }
+    CowArena* arena = mallocCheck(sizeof(CowArena));
+    arena->fd = fd;
+    arena->ref_count = 0;
+    arena->num_slots = 0;
+    arena->slot_refs = NULL;
+    arena->free_slots = NULL;
+    arena->num_free = 0;
+    return arena;
+}
+
+// a free slot of the arena with a refcount of 1, growing the file if there is none; -1 on error
+int cow_arena_alloc_slot(CowArena* a) {
+    if (a->num_free > 0) {
+        int slot = a->free_slots[--a->num_free];
+        a->slot_refs[slot] = 1;
+        return slot;
+    }
+    if (ftruncate(a->fd, (off_t) ((a->num_slots + 1) * COW_CHUNK_BYTES)) != 0) { return -1; }
+    int* slot_refs = realloc(a->slot_refs, (a->num_slots + 1) * sizeof(int));
+    int* free_slots = realloc(a->free_slots, (a->num_slots + 1) * sizeof(int));
+    if (slot_refs == NULL || free_slots == NULL) { fprintf(stderr, "Error: Memory allocation failed\n"); exit(EXIT_FAILURE); }
+    a->slot_refs = slot_refs;
+    a->free_slots = free_slots;
+    a->slot_refs[a->num_slots] = 1;
+    return a->num_slots++;
+}
+
+void cow_arena_release_slot(CowArena* a, int slot) {
+    if (--a->slot_refs[slot] > 0) { return; }
+    // nobody maps it anymore: give its pages back right away, and reuse the slot later
+    fallocate(a->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t) (slot * COW_CHUNK_BYTES), (off_t) COW_CHUNK_BYTES);
+    a->free_slots[a->num_free++] = slot;
+}
+
+void cow_arena_decref(CowArena* a) {
+    if (--a->ref_count > 0) { return; }
+    close(a->fd);
+    free(a->slot_refs);
+    free(a->free_slots);
+    free(a);
+}
+
+// maps chunks [first, last) of m at base + first * COW_CHUNK_BYTES, one mmap per run of
+// consecutive slots. With base NULL, reserves room for all the chunks first. Returns the base.
+void* cow_map_chunks(CowMapping* m, void* base, int first, int last) {
+    bool reserved = base == NULL;
+    if (reserved) {
+        base = mmap(NULL, m->num_chunks * COW_CHUNK_BYTES, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) { return NULL; }
+    }
+    int flags = (m->shared ? MAP_SHARED : MAP_PRIVATE) | MAP_FIXED;
+    for (int c = first; c < last; ) {
+        int run = 1;
+        while (c + run < last && m->slots[c + run] == m->slots[c] + run) { run++; }
+        void* at = (char*) base + c * COW_CHUNK_BYTES;
+        void* p = mmap(at, run * COW_CHUNK_BYTES, PROT_READ | PROT_WRITE, flags, m->arena->fd, (off_t) (m->slots[c] * COW_CHUNK_BYTES));
+        if (p == MAP_FAILED) {
+            if (reserved) { munmap(base, m->num_chunks * COW_CHUNK_BYTES); }
+            return NULL;
+        }
+        c += run;
+    }
+    return base;
+}
+
+CowMapping* cow_mapping_new(CowArena* arena, int num_chunks) {
+    CowMapping* m = mallocCheck(sizeof(CowMapping));
+    m->arena = arena;
+    m->num_chunks = num_chunks;
+    m->slots = mallocCheck((num_chunks + 1) * sizeof(int));
+    m->dirty = mallocCheck(num_chunks + 1);
+    memset(m->dirty, 0, num_chunks + 1);
+    m->shared = false;
+    arena->ref_count++;
+    return m;
+}
+
+void cow_mapping_free(CowMapping* m) {
+    for (int c = 0; c < m->num_chunks; c++) { cow_arena_release_slot(m->arena, m->slots[c]); }
+    cow_arena_decref(m->arena);
+    free(m->slots);
+    free(m->dirty);
+    free(m);
+}
+
+// memory for nbytes in a fresh memfd, NULL if we can't have it
+void* cow_alloc(size_t nbytes, CowMapping** mapping) {
+    CowArena* arena = cow_arena_new();
+    if (arena == NULL) { return NULL; }
+    int num_chunks = (int) ((nbytes + COW_CHUNK_BYTES - 1) / COW_CHUNK_BYTES);
+    CowMapping* m = cow_mapping_new(arena, num_chunks);
+    bool ok = true;
+    for (int c = 0; c < num_chunks; c++) {
+        m->slots[c] = cow_arena_alloc_slot(arena);
+        ok = ok && m->slots[c] >= 0;
+    }
+    // until it is first cloned, the Storage is the only user of its chunks: map them
+    // shared, so writes land in the file and never need copying out
+    m->shared = true;
+    void* data = ok ? cow_map_chunks(m, NULL, 0, num_chunks) : NULL;
+    if (data == NULL) {
+        m->num_chunks = 0; // the slots only matter while the arena lives, and it won't
+        cow_mapping_free(m);
+        return NULL;
+    }
+    *mapping = m;
+    return data;
+}
+
+// a copy-on-write Storage for size elements, NULL if we can't have one
+Storage* storage_new_cow(int size, DType dtype) {
+    CowMapping* m;
+    void* data = cow_alloc(storage_nbytes(size, dtype), &m);
+    if (data == NULL) { return NULL; }
+    Storage* storage = storage_wrap(data, size, dtype);
+    storage->mapping = data;
+    storage->mapping_size = m->num_chunks * COW_CHUNK_BYTES;
+    storage->cow = m;
+    return storage;
+}
+
+// moves a malloc-ed Storage into a memfd, so that it can be cloned copy-on-write.
+// Every view of s follows along, since they only know the Storage.
+bool storage_make_cow(Storage* s) {
+    if (s->pins > 0) { return false; }
+    size_t nbytes = storage_nbytes(s->data_size, s->dtype);
+    CowMapping* m;
+    void* data = cow_alloc(nbytes, &m);
+    if (data == NULL) { return false; }
+    memcpy(data, s->data, nbytes);
+    storage_free_data(s);
+    s->data = data;
+    s->mapping = data;
+    s->mapping_size = m->num_chunks * COW_CHUNK_BYTES;
+    s->cow = m;
+    return true;
+}
+
+// A Storage of size elements sharing the chunks of s from element offset on, which must
+// start a chunk. Only chunks that s wrote since it was last cloned are copied. A Storage
+// over a file or over someone else's memory can't move into a memfd, so it gets NULL.
+// So does a pinned one: it is written behind the write barrier's back, so which of its
+// chunks are dirty is anyone's guess.
+Storage* storage_cow_clone(Storage* s, int offset, int size) {
+    if (s->pins > 0) { return NULL; }
+    if (s->cow == NULL && (s->mapping != NULL || s->release != NULL || !storage_make_cow(s))) { return NULL; }
+    CowMapping* m = s->cow;
+    int first = (int) (storage_byte_offset(s, offset) / COW_CHUNK_BYTES);
+    int num_chunks = (int) ((storage_nbytes(size, s->dtype) + COW_CHUNK_BYTES - 1) / COW_CHUNK_BYTES);
+    if (m->shared) {
+        // from now on the chunks are shared with a clone: remap them private
+        m->shared = false;
+        if (cow_map_chunks(m, s->mapping, 0, m->num_chunks) == NULL) { return NULL; }
+    }
+    for (int c = first; c < first + num_chunks; c++) {
+        if (!m->dirty[c]) { continue; }
+        // the chunk was written since it was mapped: copy it out into a slot of its own,
+        // and map that back in its place (same contents, but now in the file)
+        int slot = cow_arena_alloc_slot(m->arena);
+        void* at = (char*) s->mapping + c * COW_CHUNK_BYTES;
+        if (slot < 0) { return NULL; }
+        if (!pwrite_full(m->arena->fd, at, COW_CHUNK_BYTES, slot * COW_CHUNK_BYTES)) {
+            cow_arena_release_slot(m->arena, slot);
+            return NULL;
+        }
+        int old = m->slots[c];
+        m->slots[c] = slot;
+        if (cow_map_chunks(m, s->mapping, c, c + 1) == NULL) { return NULL; }
+        cow_arena_release_slot(m->arena, old);
+        m->dirty[c] = false;
+    }
+    CowMapping* clone = cow_mapping_new(m->arena, num_chunks);
+    for (int c = 0; c < num_chunks; c++) {
+        clone->slots[c] = m->slots[first + c];
+        m->arena->slot_refs[clone->slots[c]]++;
+    }
+    void* data = cow_map_chunks(clone, NULL, 0, num_chunks);
+    if (data == NULL) {
+        cow_mapping_free(clone);
+        return NULL;
+    }
+    Storage* storage = storage_wrap(data, size, s->dtype);
+    storage->mapping = data;
+    storage->mapping_size = num_chunks * COW_CHUNK_BYTES;
+    storage->cow = clone;
+    return storage;
+}
+
+#else
+
+Storage* storage_new_cow(int size, DType dtype) { return NULL; }
+Storage* storage_cow_clone(Storage* s, int offset, int size) { return NULL; }
+void cow_mapping_free(CowMapping* m) {}
+
+#endif
+
+// The write barrier: every write path calls this before writing to the elements
+// [lo, hi] of s. Writing to a read-only (memory-mapped) Storage is an error. It also
+// bumps the version of s, so anything derived from its elements knows to recompute.
+bool storage_prepare_write(Storage* s, int lo, int hi) {
+    if (s->readonly) {
+        fprintf(stderr, "RuntimeError: cannot write to a read-only tensor\n");
+        return false;
+    }
+    s->version++;
+    CowMapping* m = s->cow;
+    if (m != NULL && !m->shared && hi >= lo) {
+        size_t first = storage_byte_offset(s, lo) / COW_CHUNK_BYTES;
+        size_t last = (storage_byte_end(s, hi) - 1) / COW_CHUNK_BYTES;
+        for (size_t c = first; c <= last; c++) { m->dirty[c] = true; }
+    }
+    return true;
+}
+
+Storage* storage_new(int size, DType dtype) {
+    size_t nbytes = storage_nbytes(size, dtype);
+    if (cow_wanted(nbytes)) {
+        Storage* storage = storage_new_cow(size, dtype);
+        if (storage != NULL) { return storage; }
+    }
+    return storage_wrap(mallocCheck(nbytes), size, dtype);
+}
+
+// ----------------------------------------------------------------------------
+// shared memory: Storages that other processes can map too. They live in a memfd, an
+// anonymous in-memory file that the kernel refcounts like any other: it goes away once
+// the last process holding an fd or a mapping of it exits or lets go, so a worker dying
+// can't leak it (unlike a named shm_open segment, which needs an unlink).
+
+// a new memfd of nbytes, -1 if we can't have one
+int shared_fd_new(size_t nbytes) {
+#ifdef __linux__
+    int fd = memfd_create("tensor1d-shared", MFD_CLOEXEC);
+    if (fd >= 0 && ftruncate(fd, (off_t) (nbytes > 0 ? nbytes : 1)) == 0) { return fd; }
+    if (fd >= 0) { close(fd); }
+#endif
+    fprintf(stderr, "OSError: cannot create shared memory segment\n");
+    return -1;
+}
+
+// maps nbytes of fd shared, NULL on error. mmap can't map 0 bytes, so for an empty
+// Storage this maps (but never touches) one
+void* shared_mmap(int fd, size_t nbytes, size_t* map_size) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < nbytes) {
+        fprintf(stderr, "ValueError: shared memory segment is smaller than %zu bytes\n", nbytes);
+        return NULL;
+    }
+    *map_size = nbytes > 0 ? nbytes : 1;
+    void* mapping = mmap(NULL, *map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "OSError: cannot map shared memory segment\n");
+        return NULL;
+    }
+    return mapping;
+}
+
+// a Storage for size elements mapped shared from fd, which it takes ownership of
+Storage* storage_map_shared(int fd, int size, DType dtype) {
+    size_t map_size;
+    void* mapping = shared_mmap(fd, storage_nbytes(size, dtype), &map_size);
+    if (mapping == NULL) {
+        close(fd);
+        return NULL;
+    }
+    Storage* storage = storage_wrap(mapping, size, dtype);
+    storage->mapping = mapping;
+    storage->mapping_size = map_size;
+    storage->fd = fd;
+    return storage;
+}
+
+// a new, zeroed Storage in shared memory, NULL if we can't have one
+Storage* storage_new_shared(int size, DType dtype) {
+    int fd = shared_fd_new(storage_nbytes(size, dtype));
+    return fd < 0 ? NULL : storage_map_shared(fd, size, dtype);
+}
+
+// whether storage_share_memory can move the elements of s. Storages that map a file
+// (shareable through that file already) or someone else's memory have to stay where
+// they are, and so do pinned ones (see tensor_pin). An inline scalar's element is ours,
+// it just isn't malloc-ed on its own.
+bool storage_movable(Storage* s) {
+    return (s->mapping == NULL || s->cow != NULL) && (s->release == NULL || s->inline_scalar) && s->pins == 0;
+}
+
+// moves the elements of s into shared memory, in place, so that every view of s
+// follows along
+bool storage_share_memory(Storage* s) {
+    if (s->fd >= 0) { return true; }
+    if (s->pins > 0) {
+        fprintf(stderr, "ValueError: cannot move a tensor into shared memory while its memory is exported (to numpy, a buffer or DLPack)\n");
+        return false;
+    }
+    if (!storage_movable(s)) {
+        fprintf(stderr, "ValueError: cannot move a memory-mapped file or external memory into shared memory\n");
+        return false;
+    }
+    size_t nbytes = storage_nbytes(s->data_size, s->dtype);
+    int fd = shared_fd_new(nbytes);
+    if (fd < 0) { return false; }
+    size_t map_size;
+    void* mapping = shared_mmap(fd, nbytes, &map_size);
+    if (mapping == NULL) {
+        close(fd);
+        return false;
+    }
+    memcpy(mapping, s->data, nbytes);
+    storage_free_data(s);
+    if (s->cow != NULL) { cow_mapping_free(s->cow); }
+    s->data = mapping;
+    s->mapping = mapping;
+    s->mapping_size = map_size;
+    s->fd = fd;
+    s->cow = NULL;
+    return true;
+}
+
+// A Storage backed by the file at path, mapped from byte_offset on, instead of malloc-ed
+// memory. Nothing is read up front: the pages are faulted in lazily as they are touched,
+// and processes mapping the same file share the page cache. A size of -1 takes the rest
+// of the file. Returns NULL (after printing why) if the file can't be mapped.
+Storage* storage_mmap(const char* path, size_t byte_offset, int size, DType dtype, MmapMode mode) {
+    size_t itemsize = dtype == DTYPE_BOOL ? sizeof(uint64_t) : dtype_itemsize(dtype);
+    if (byte_offset % itemsize != 0) {
+        fprintf(stderr, "ValueError: byte offset %zu is not aligned to %zu bytes\n", byte_offset, itemsize);
+        return NULL;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "OSError: cannot open %s\n", path);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < byte_offset) {
+        fprintf(stderr, "ValueError: byte offset %zu is past the end of %s\n", byte_offset, path);
+        close(fd);
+        return NULL;
+    }
+    if (size < 0) {
+        size_t available = ((size_t) st.st_size - byte_offset) / itemsize;
+        size = (int) (dtype == DTYPE_BOOL ? available * 64 : available);
+    }
+    size_t nbytes = storage_nbytes(size, dtype);
+    if (byte_offset + nbytes > (size_t) st.st_size) {
+        fprintf(stderr, "ValueError: %s is too small for %d elements at byte offset %zu\n", path, size, byte_offset);
+        close(fd);
+        return NULL;
+    }
+    if (nbytes == 0) {
+        // mmap can't map 0 bytes, and there's nothing to map anyway
+        close(fd);
+        Storage* storage = storage_new(0, dtype);
+        storage->readonly = mode == MMAP_READONLY;
+        return storage;
+    }
+    // mmap wants a page-aligned file offset, so map from the page holding byte_offset
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t map_offset = byte_offset / page * page;
+    size_t map_size = byte_offset - map_offset + nbytes;
+    int prot = mode == MMAP_READONLY ? PROT_READ : PROT_READ | PROT_WRITE;
+    void* mapping = mmap(NULL, map_size, prot, MAP_PRIVATE, fd, (off_t) map_offset);
+    close(fd); // the mapping keeps its own reference to the file
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "OSError: cannot mmap %s\n", path);
+        return NULL;
+    }
+    Storage* storage = storage_wrap((char*) mapping + (byte_offset - map_offset), size, dtype);
+    storage->readonly = mode == MMAP_READONLY;
+    storage->mapping = mapping;
+    storage->mapping_size = map_size;
     return storage;
 }
 
+bool storage_getbit(Storage* s, int idx) {
+    uint64_t* words = s->data;
+    return (words[idx >> 6] >> (idx & 63)) & 1;
+}
+
+void storage_setbit(Storage* s, int idx, bool val) {
+    uint64_t* words = s->data;
+    uint64_t mask = (uint64_t) 1 << (idx & 63);
+    if (val) { words[idx >> 6] |= mask; } else { words[idx >> 6] &= ~mask; }
+}
+
+// The load/store functions access the storage without any bounds check. They are
+// meant for kernels, whose views were already validated when they were created
+// (see storage_view_in_bounds). The getitem/setitem versions are the defensive ones.
+
+float storage_load(Storage* s, int idx) {
+    switch (s->dtype) {
+        case DTYPE_FLOAT32: return ((float*) s->data)[idx];
+        case DTYPE_INT32: return (float) ((int32_t*) s->data)[idx];
+        case DTYPE_INT64: return (float) ((int64_t*) s->data)[idx];
+        case DTYPE_BOOL: return storage_getbit(s, idx) ? 1.0f : 0.0f;
+    }
+    return NAN;
+}
+
+int64_t storage_load_int(Storage* s, int idx) {
+    switch (s->dtype) {
+        case DTYPE_FLOAT32: return (int64_t) ((float*) s->data)[idx];
+        case DTYPE_INT32: return ((int32_t*) s->data)[idx];
+        case DTYPE_INT64: return ((int64_t*) s->data)[idx];
+        case DTYPE_BOOL: return storage_getbit(s, idx);
+    }
+    return 0;
+}
+
+void storage_store(Storage* s, int idx, float val) {
+    switch (s->dtype) {
+        case DTYPE_FLOAT32: ((float*) s->data)[idx] = val; break;
+        case DTYPE_INT32: ((int32_t*) s->data)[idx] = (int32_t) val; break;
+        case DTYPE_INT64: ((int64_t*) s->data)[idx] = (int64_t) val; break;
+        case DTYPE_BOOL: storage_setbit(s, idx, val != 0.0f); break;
+    }
+}
+
+void storage_store_int(Storage* s, int idx, int64_t val) {
+    switch (s->dtype) {
+        case DTYPE_FLOAT32: ((float*) s->data)[idx] = (float) val; break;
+        case DTYPE_INT32: ((int32_t*) s->data)[idx] = (int32_t) val; break;
+        case DTYPE_INT64: ((int64_t*) s->data)[idx] = val; break;
+        case DTYPE_BOOL: storage_setbit(s, idx, val != 0); break;
+    }
+}
+
+// dst[di] = src[si], exactly, for two storages of the same dtype
+void storage_copy_item(Storage* dst, int di, Storage* src, int si) {
+    switch (src->dtype) {
+        case DTYPE_FLOAT32: ((float*) dst->data)[di] = ((float*) src->data)[si]; break;
+        case DTYPE_INT32: ((int32_t*) dst->data)[di] = ((int32_t*) src->data)[si]; break;
+        case DTYPE_INT64: ((int64_t*) dst->data)[di] = ((int64_t*) src->data)[si]; break;
+        case DTYPE_BOOL: storage_setbit(dst, di, storage_getbit(src, si)); break;
+    }
+}
+
 float storage_getitem(Storage* s, int idx) {
     assert(idx >= 0 && idx < s->data_size);
-    return s->data[idx];
+    return storage_load(s, idx);
+}
+
+int64_t storage_getitem_int(Storage* s, int idx) {
+    assert(idx >= 0 && idx < s->data_size);
+    return storage_load_int(s, idx);
 }
 
 void storage_setitem(Storage* s, int idx, float val) {
     assert(idx >= 0 && idx < s->data_size);
-    s->data[idx] = val;
+    storage_store(s, idx, val);
+}
+
+void storage_setitem_int(Storage* s, int idx, int64_t val) {
+    assert(idx >= 0 && idx < s->data_size);
+    storage_store_int(s, idx, val);
 }
 
+// checks that every element offset + i * stride, for i in [0, size), lies inside
+// the storage. The first and last element are the extremes, whatever the sign of stride.
+bool storage_view_in_bounds(Storage* s, int offset, int size, int stride) {
+    if (size < 0) { return false; }
+    if (size == 0) { return true; }
+    int64_t last = (int64_t) offset + (int64_t) (size - 1) * stride;
+    return offset >= 0 && offset < s->data_size && last >= 0 && last < s->data_size;
+}
+
+// Tensors of one Storage may be made and freed on different threads at once
 void storage_incref(Storage* s) {
-    s->ref_count++;
+    __atomic_add_fetch(&s->ref_count, 1, __ATOMIC_RELAXED);
 }
 
 void storage_decref(Storage* s) {
-    s->ref_count--;
-    if (s->ref_count == 0) {
-        free(s->data);
-        free(s);
+    if (__atomic_sub_fetch(&s->ref_count, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_lock(&all_storages_lock);
+        if (s->prev != NULL) { s->prev->next = s->next; } else { all_storages = s->next; }
+        if (s->next != NULL) { s->next->prev = s->prev; }
+        pthread_mutex_unlock(&all_storages_lock);
+        storage_free_data(s);
+        if (s->cow != NULL) { cow_mapping_free(s->cow); }
+        if (s->fd >= 0) { close(s->fd); }
+        if (s->inline_scalar) { scalar_block_free(scalar_block_of(s)); } else { free(s); }
+    }
+}
+
+// every Tensor registers itself with the Storage it views, so the Storage knows
+// which of its elements are still reachable. The _locked variants are for callers
+// that already hold storages_lock.
+void storage_attach_locked(Storage* s, Tensor* t) {
+    t->prev_view = NULL;
+    t->next_view = s->views;
+    if (s->views != NULL) { s->views->prev_view = t; }
+    s->views = t;
+}
+
+void storage_detach_locked(Storage* s, Tensor* t) {
+    if (t->prev_view != NULL) { t->prev_view->next_view = t->next_view; } else { s->views = t->next_view; }
+    if (t->next_view != NULL) { t->next_view->prev_view = t->prev_view; }
+}
+
+void storage_attach(Storage* s, Tensor* t) {
+    pthread_mutex_lock(&storages_lock);
+    storage_attach_locked(s, t);
+    pthread_mutex_unlock(&storages_lock);
+}
+
+void storage_detach(Storage* s, Tensor* t) {
+    pthread_mutex_lock(&storages_lock);
+    storage_detach_locked(s, t);
+    pthread_mutex_unlock(&storages_lock);
+}
+
+// the views of a Storage that cover at least one element, with their extent
+typedef struct {
+    Tensor* view;
+    int lo;
+    int hi;
+} ViewExtent;
+
+int compare_extents(const void* a, const void* b) {
+    return ((const ViewExtent*) a)->lo - ((const ViewExtent*) b)->lo;
+}
+
+// fills in the non-empty views of s sorted by their lowest element, returns how many.
+// extents must be freed by the caller. Like everything below that walks the views of a
+// Storage, this is called with storages_lock held.
+int storage_view_extents(Storage* s, ViewExtent** extents) {
+    int count = 0;
+    for (Tensor* v = s->views; v != NULL; v = v->next_view) { count++; }
+    *extents = mallocCheck((count + 1) * sizeof(ViewExtent));
+    int n = 0;
+    for (Tensor* v = s->views; v != NULL; v = v->next_view) {
+        if (v->size == 0) { continue; }
+        // the first and last element are the extremes, whatever the sign of stride
+        int first = v->offset;
+        int last = logical_to_physical(v, v->size - 1);
+        (*extents)[n].view = v;
+        (*extents)[n].lo = min(first, last);
+        (*extents)[n].hi = max(first, last);
+        n++;
+    }
+    qsort(*extents, n, sizeof(ViewExtent), compare_extents);
+    return n;
+}
+
+// whether the elements [lo, hi] all lie within the extent of some live view of s
+bool storage_range_reachable(Storage* s, int lo, int hi) {
+    ViewExtent* extents;
+    int n = storage_view_extents(s, &extents);
+    int end = lo; // first element of [lo, hi] not yet covered
+    for (int i = 0; i < n && end <= hi; i++) {
+        if (extents[i].lo <= end && extents[i].hi >= end) { end = extents[i].hi + 1; }
     }
+    free(extents);
+    return end > hi;
+}
+
+// the number of elements in the union of the (sorted) extents
+int extents_union_size(ViewExtent* extents, int n) {
+    int total = 0;
+    int end = -1; // one past the highest element counted so far
+    for (int i = 0; i < n; i++) {
+        int lo = max(extents[i].lo, end);
+        if (extents[i].hi + 1 > lo) { total += extents[i].hi + 1 - lo; }
+        end = max(end, extents[i].hi + 1);
+    }
+    return total;
 }
 
 // ----------------------------------------------------------------------------
 // Tensor class functions
 
-// torch.empty(size)
-Tensor* tensor_empty(int size) {
-    Tensor* t = mallocCheck(sizeof(Tensor));
-    t->storage = storage_new(size);
+void tensor_init(Tensor* t, Storage* storage) {
+    t->storage = storage;
+    storage_attach(storage, t);
     // at init we cover the whole storage, i.e. range(start=0, stop=size, step=1)
     t->offset = 0;
-    t->size = size;
+    t->size = storage->data_size;
     t->stride = 1;
     // holds the text representation of the tensor
     t->repr = NULL;
+    t->repr_version = 0;
+    t->repr_generation = 0;
+}
+
+// a Tensor over the whole of a Storage (taking over the caller's reference to it)
+Tensor* tensor_from_storage(Storage* storage) {
+    Tensor* t = mallocCheck(sizeof(Tensor));
+    tensor_init(t, storage);
     return t;
 }
 
+// An uninitialized one-element Tensor, holding the element inline (see ScalarBlock).
+// To everything else it's an ordinary Tensor with a Storage of its own.
+Tensor* tensor_new_scalar(DType dtype) {
+    ScalarBlock* b = scalar_cache_count > 0 ? scalar_cache[--scalar_cache_count] : mallocCheck(sizeof(ScalarBlock));
+    b->data = 0;
+    storage_init(&b->storage, &b->data, 1, dtype);
+    // the element isn't ours to free() when the data moves, e.g. into shared memory
+    b->storage.release = release_nothing;
+    b->storage.inline_scalar = true;
+    tensor_init(&b->tensor, &b->storage);
+    return &b->tensor;
+}
+
+// torch.empty(size, dtype=dtype)
+Tensor* tensor_empty_dtype(int size, DType dtype) {
+    if (size == 1) { return tensor_new_scalar(dtype); }
+    return tensor_from_storage(storage_new(size, dtype));
+}
+
+// torch.empty(size)
+Tensor* tensor_empty(int size) {
+    return tensor_empty_dtype(size, DTYPE_FLOAT32);
+}
+
+DType tensor_dtype(Tensor* t) {
+    return t->storage->dtype;
+}
+
 // torch.arange(size)
 Tensor* tensor_arange(int size) {
     Tensor* t = tensor_empty(size);
@@ -105,6 +895,129 @@ Tensor* tensor_arange(int size) {
     return t;
 }
 
+// like numpy.memmap: a Tensor over a memory-mapped file, see storage_mmap.
+// Loading costs the same no matter how big the tensor is, it's only a mapping.
+Tensor* tensor_mmap(const char* path, size_t byte_offset, int size, DType dtype, MmapMode mode) {
+    Storage* storage = storage_mmap(path, byte_offset, size, dtype, mode);
+    if (storage == NULL) { return NULL; }
+    return tensor_from_storage(storage);
+}
+
+// Tells the OS how the pages under t will be accessed, e.g. ADVICE_WILLNEED to start
+// reading them in ahead of time. Only meaningful for memory-mapped tensors.
+bool tensor_advise(Tensor* t, Advice advice) {
+    if (t->size == 0) { return true; }
+    int advices[] = { MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED };
+    int first = t->offset;
+    int last = logical_to_physical(t, t->size - 1);
+    size_t lo = storage_byte_offset(t->storage, min(first, last));
+    size_t hi = storage_byte_end(t->storage, max(first, last));
+    // madvise wants page-aligned addresses: widen to the pages holding [lo, hi)
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t) t->storage->data + lo) / page * page;
+    uintptr_t end = (uintptr_t) t->storage->data + hi;
+    if (madvise((void*) start, end - start, advices[advice]) != 0) {
+        fprintf(stderr, "OSError: madvise failed\n");
+        return false;
+    }
+    return true;
+}
+
+// A Tensor over size elements of memory that belongs to someone else, like
+// torch.frombuffer: nothing is copied. data must stay valid until the Storage goes away,
+// which is when release(ctx) is called (release can be NULL if the caller knows better).
+Tensor* tensor_from_external(void* data, int size, DType dtype, void (*release)(void* ctx), void* ctx) {
+    if (size < 0) {
+        fprintf(stderr, "ValueError: size must be non-negative, got %d\n", size);
+        return NULL;
+    }
+    Storage* storage = storage_wrap(data, size, dtype);
+    storage->release = release != NULL ? release : release_nothing;
+    storage->release_ctx = ctx;
+    return tensor_from_storage(storage);
+}
+
+// torch.empty(size, dtype=dtype).share_memory_(): a tensor other processes can map too
+Tensor* tensor_empty_shared(int size, DType dtype) {
+    Storage* storage = storage_new_shared(size, dtype);
+    if (storage == NULL) { return NULL; }
+    return tensor_from_storage(storage);
+}
+
+// t.share_memory_(): moves the Storage under t (and so all its views) into shared memory
+bool tensor_share_memory_(Tensor* t) {
+    return storage_share_memory(t->storage);
+}
+
+bool tensor_is_shared(Tensor* t) {
+    return t->storage->fd >= 0;
+}
+
+// whether t is in shared memory, or tensor_share_memory_ can move it there
+bool tensor_can_share_memory(Tensor* t) {
+    return t->storage->fd >= 0 || storage_movable(t->storage);
+}
+
+// Fills in what another process needs to map the view t: the fd of its Storage plus the
+// view's geometry. The fd stays owned by t's Storage; it has to reach the other process
+// some way that passes fds (fork, SCM_RIGHTS, pidfd_getfd, /proc/<pid>/fd/<fd>).
+bool tensor_export(Tensor* t, TensorHandle* handle) {
+    if (t->storage->fd < 0) {
+        fprintf(stderr, "ValueError: only tensors in shared memory can be exported, see tensor_share_memory_\n");
+        return false;
+    }
+    handle->fd = t->storage->fd;
+    handle->dtype = tensor_dtype(t);
+    handle->storage_size = t->storage->data_size;
+    handle->offset = t->offset;
+    handle->size = t->size;
+    handle->stride = t->stride;
+    return true;
+}
+
+// The view described by handle, mapped zero-copy: writes on either side are seen by the
+// other. The fd is duplicated, so the caller still owns (and should close) handle->fd.
+Tensor* tensor_import(const TensorHandle* handle) {
+    if (handle->dtype > DTYPE_BOOL || handle->storage_size < 0 || handle->size < 0) {
+        fprintf(stderr, "ValueError: invalid tensor handle\n");
+        return NULL;
+    }
+    int fd = dup(handle->fd);
+    if (fd < 0) {
+        fprintf(stderr, "OSError: bad file descriptor %d in tensor handle\n", handle->fd);
+        return NULL;
+    }
+    Storage* storage = storage_map_shared(fd, handle->storage_size, handle->dtype);
+    if (storage == NULL) { return NULL; }
+    if (!storage_view_in_bounds(storage, handle->offset, handle->size, handle->stride)) {
+        fprintf(stderr, "ValueError: tensor handle reaches outside its Storage\n");
+        storage_decref(storage);
+        return NULL;
+    }
+    Tensor* t = tensor_from_storage(storage);
+    t->offset = handle->offset;
+    t->size = handle->size;
+    t->stride = handle->stride;
+    return t;
+}
+
+// the write barrier for writes anywhere in the view t, see storage_prepare_write
+bool tensor_check_writable(Tensor* t) {
+    if (t->size == 0) { return storage_prepare_write(t->storage, 0, -1); }
+    int first = t->offset;
+    int last = logical_to_physical(t, t->size - 1);
+    return storage_prepare_write(t->storage, min(first, last), max(first, last));
+}
+
+// in-place ops need each element of t to be its own, which an expanded view's are not
+bool tensor_check_no_overlap(Tensor* t, const char* name) {
+    if (t->stride == 0 && t->size > 1) {
+        fprintf(stderr, "ValueError: %s cannot write in place to a tensor whose elements overlap\n", name);
+        return false;
+    }
+    return true;
+}
+
 int logical_to_physical(Tensor *t, int ix) {
     int idx = t->offset + ix * t->stride;
     return idx;
@@ -119,7 +1032,7 @@ float tensor_getitem(Tensor* t, int ix) {
     // handle negative indices by wrapping around
     if (ix < 0) { ix = t->size + ix; }
     // oob indices raise IndexError (and we return NaN)
-    if (ix >= t->size) {
+    if (ix < 0 || ix >= t->size) {
         fprintf(stderr, "IndexError: index %d is out of bounds of %d\n", ix, t->size);
         return NAN;
     }
@@ -129,29 +1042,64 @@ float tensor_getitem(Tensor* t, int ix) {
     return val;
 }
 
+// Same as tensor_getitem but exact for the integer dtypes,
+// which a float can only represent up to 2^24
+int64_t tensor_getitem_int(Tensor* t, int ix) {
+    if (ix < 0) { ix = t->size + ix; }
+    if (ix < 0 || ix >= t->size) {
+        fprintf(stderr, "IndexError: index %d is out of bounds of %d\n", ix, t->size);
+        return 0;
+    }
+    return storage_getitem_int(t->storage, logical_to_physical(t, ix));
+}
+
 // The _astensor version of getitem:
 // val = t[ix]
 // i.e. consistent with PyTorch/numpy create a 1-element Tensor and return it
 Tensor* tensor_getitem_astensor(Tensor* t, int ix) {
-    // wrap around negative indices so we can do +1 below with confidence
+    // wrap around negative indices
     if (ix < 0) { ix = t->size + ix; }
-    // effectively: t[ix:ix+1:1] <=> t[ix:ix+1] <=> t[ix]
-    Tensor* slice = tensor_slice(t, ix, ix + 1, 1);
-    return slice;
+    if (ix < 0 || ix >= t->size) {
+        fprintf(stderr, "IndexError: index %d is out of bounds of %d\n", ix, t->size);
+        return NULL;
+    }
+    // t[ix] holds a copy of the element inline, so unlike a view t[ix:ix+1] it doesn't
+    // touch (or keep alive) the Storage of t
+    Tensor* scalar = tensor_new_scalar(t->storage->dtype);
+    storage_copy_item(scalar->storage, 0, t->storage, logical_to_physical(t, ix));
+    return scalar;
+}
+
+// like torch's t._version: how many writes the Storage under t has seen
+uint64_t tensor_version(Tensor* t) {
+    return t->storage->version;
 }
 
 // t[ix] = val
 void tensor_setitem(Tensor* t, int ix, float val) {
     // handle negative indices by wrapping around
     if (ix < 0) { ix = t->size + ix; }
-    if (ix >= t->size) {
+    if (ix < 0 || ix >= t->size) {
         fprintf(stderr, "IndexError: index %d is out of bounds of %d\n", ix, t->size);
         return;
     }
     int idx = logical_to_physical(t, ix);
+    if (!storage_prepare_write(t->storage, idx, idx)) { return; }
     storage_setitem(t->storage, idx, val);
 }
 
+// t[ix] = val, exact for the integer dtypes
+void tensor_setitem_int(Tensor* t, int ix, int64_t val) {
+    if (ix < 0) { ix = t->size + ix; }
+    if (ix < 0 || ix >= t->size) {
+        fprintf(stderr, "IndexError: index %d is out of bounds of %d\n", ix, t->size);
+        return;
+    }
+    int idx = logical_to_physical(t, ix);
+    if (!storage_prepare_write(t->storage, idx, idx)) { return; }
+    storage_setitem_int(t->storage, idx, val);
+}
+
 // same as .item() on a torch.Tensor: strips 1-element Tensor to simple scalar
 float tensor_item(Tensor* t) {
     if (t->size != 1) {
@@ -161,45 +1109,177 @@ float tensor_item(Tensor* t) {
     return tensor_getitem(t, 0);
 }
 
-// return a new Tensor with a new view, but same Storage, i.e.:
-// t[start:end:step]
-Tensor* tensor_slice(Tensor* t, int start, int end, int step) {
-    // 1) handle negative indices by wrapping around
-    if (start < 0) { start = t->size + start; }
-    if (end < 0) { end = t->size + end; }
-    // 2) handle out-of-bounds indices: clip to [0, t->size] range
-    start = min(max(start, 0), t->size);
-    end = min(max(end, 0), t->size);
-    // 3) handle step
-    if (step == 0) {
-        fprintf(stderr, "ValueError: slice step cannot be zero\n");
-        return tensor_empty(0);
-    }
-    if (step < 0) {
-        // TODO possibly support negative step
-        // PyTorch does not support negative step (numpy does)
-        fprintf(stderr, "ValueError: slice step cannot be negative\n");
-        return tensor_empty(0);
+// t.to(dtype): returns a new Tensor (with its own Storage) holding the converted elements
+Tensor* tensor_to_dtype(Tensor* t, DType dtype) {
+    Tensor* result = tensor_empty_dtype(t->size, dtype);
+    bool via_float = dtype == DTYPE_FLOAT32 || tensor_dtype(t) == DTYPE_FLOAT32;
+    for (int i = 0; i < t->size; i++) {
+        int idx = logical_to_physical(t, i);
+        if (via_float) {
+            storage_store(result->storage, i, storage_load(t->storage, idx));
+        } else {
+            storage_store_int(result->storage, i, storage_load_int(t->storage, idx));
+        }
     }
-    // create the new Tensor: same Storage but new View
+    return result;
+}
+
+// return a new Tensor that is a view over the same Storage as t. This is the one place
+// views get created, and they are bounds-checked here, once, so the kernels can then
+// index the Storage directly without any per-element checks.
+Tensor* tensor_view(Tensor* t, int offset, int size, int stride) {
+    assert(storage_view_in_bounds(t->storage, offset, size, stride));
     Tensor* s = mallocCheck(sizeof(Tensor));
     s->storage = t->storage; // inherit the underlying storage!
-    s->size = ceil_div(end - start, step);
-    s->offset = t->offset + start * t->stride;
-    s->stride = t->stride * step;
+    s->offset = offset;
+    s->size = size;
+    s->stride = stride;
     s->repr = NULL;
+    s->repr_version = 0;
+    s->repr_generation = 0;
     storage_incref(s->storage); // increment the reference count
+    storage_attach(s->storage, s);
     return s;
 }
 
-Tensor* tensor_addf(Tensor* t, float val) {
-    // adds a float to each element of the tensor, returns a new tensor
-    Tensor* result = tensor_empty(t->size);
-    for (int i = 0; i < t->size; i++) {
-        float old_val = tensor_getitem(t, i);
-        float new_val = old_val + val;
-        tensor_setitem(result, i, new_val);
-    }
+// the lowest and highest physical index of the Storage that the view touches
+void tensor_physical_range(Tensor* t, int* lo, int* hi) {
+    int first = t->offset;
+    int last = logical_to_physical(t, t->size - 1);
+    *lo = min(first, last);
+    *hi = max(first, last);
+}
+
+// return a new Tensor with a new view, but same Storage, i.e.:
+// t[start:end:step]
+// A negative step walks backwards from start down to end (exclusive), like numpy.
+// Just like in Python, a negative end counts from the back, so a slice that runs all
+// the way to the front, i.e. t[start::-1], needs end <= -size-1 (which clips to -1).
+Tensor* tensor_slice(Tensor* t, int start, int end, int step) {
+    // 1) handle step
+    if (step == 0) {
+        fprintf(stderr, "ValueError: slice step cannot be zero\n");
+        return tensor_empty_dtype(0, tensor_dtype(t));
+    }
+    // 2) handle negative indices by wrapping around
+    if (start < 0) { start = t->size + start; }
+    if (end < 0) { end = t->size + end; }
+    // 3) handle out-of-bounds indices: clip to [0, t->size] range for a positive step,
+    // or to [-1, t->size - 1] for a negative step, where -1 is "before the first element"
+    int lo = step > 0 ? 0 : -1;
+    int hi = step > 0 ? t->size : t->size - 1;
+    start = min(max(start, lo), hi);
+    end = min(max(end, lo), hi);
+    int size = step > 0 ? ceil_div(max(end - start, 0), step) : ceil_div(max(start - end, 0), -step);
+    // for a negative step the offset lands on the last element and the stride is negative
+    int offset = size > 0 ? t->offset + start * t->stride : t->offset;
+    return tensor_view(t, offset, size, t->stride * step);
+}
+
+// torch.as_strided(t, size, stride, storage_offset): an arbitrary view over t's
+// Storage, where the offset is an absolute index into the Storage (like torch)
+Tensor* tensor_as_strided(Tensor* t, int size, int stride, int offset) {
+    if (!storage_view_in_bounds(t->storage, offset, size, stride)) {
+        fprintf(stderr, "ValueError: as_strided view (offset=%d, size=%d, stride=%d) is out of bounds of storage of size %d\n",
+                offset, size, stride, t->storage->data_size);
+        return NULL;
+    }
+    // once unreachable pages were released, a new view may only cover what is still reachable
+    int last = offset + (size - 1) * stride;
+    if (t->storage->released_bytes > 0 && size > 0) {
+        pthread_mutex_lock(&storages_lock);
+        bool reachable = storage_range_reachable(t->storage, min(offset, last), max(offset, last));
+        pthread_mutex_unlock(&storages_lock);
+        if (!reachable) {
+            fprintf(stderr, "ValueError: as_strided view reaches pages of the storage that were released\n");
+            return NULL;
+        }
+    }
+    return tensor_view(t, offset, size, stride);
+}
+
+// t.expand(size): broadcasts a 1-element tensor to size elements with a stride of 0,
+// i.e. every element of the view is the same element of the Storage
+Tensor* tensor_expand(Tensor* t, int size) {
+    if (t->size == size) { return tensor_view(t, t->offset, t->size, t->stride); }
+    if (t->size != 1 || size < 0) {
+        fprintf(stderr, "ValueError: cannot expand a tensor of size %d to size %d\n", t->size, size);
+        return NULL;
+    }
+    return tensor_view(t, t->offset, size, 0);
+}
+
+// t.unfold(0, size, step): the sliding windows t[i*step : i*step+size], which overlap
+// when step < size. Each window is its own view over the same Storage. The views are
+// written into windows, which must have room for all of them, and the number of
+// windows is returned (-1 on error). Pass windows = NULL to only get the count.
+int tensor_unfold(Tensor* t, int size, int step, Tensor** windows) {
+    if (size < 0 || size > t->size || step <= 0) {
+        fprintf(stderr, "ValueError: unfold needs 0 <= size <= %d and step > 0, got size=%d, step=%d\n", t->size, size, step);
+        return -1;
+    }
+    int count = (t->size - size) / step + 1;
+    if (windows != NULL) {
+        for (int i = 0; i < count; i++) {
+            windows[i] = tensor_view(t, logical_to_physical(t, i * step), size, t->stride);
+        }
+    }
+    return count;
+}
+
+// Kernels walk their inputs in blocks of BLOCK_SIZE elements, loaded as floats
+// through tensor_load_floats, which has the fast path for each kind of stride.
+#define BLOCK_SIZE 256
+
+// random reads over a large tensor are bound by memory latency, so beyond this many
+// bytes we prefetch the element PREFETCH_DISTANCE indices ahead
+#define PREFETCH_MIN_BYTES (1 << 20)
+#define PREFETCH_DISTANCE 16
+
+// Load elements [ix, ix + n) of t as floats. A unit-stride float32 view is returned
+// in place, straight from the storage, everything else is gathered into buf.
+const float* tensor_load_floats(Tensor* t, int ix, int n, float* buf) {
+    if (tensor_dtype(t) != DTYPE_FLOAT32) {
+        for (int i = 0; i < n; i++) {
+            buf[i] = storage_load(t->storage, logical_to_physical(t, ix + i));
+        }
+        return buf;
+    }
+    const float* in = (float*) t->storage->data + logical_to_physical(t, ix);
+    if (t->stride == 1) { return in; }
+    if (t->stride == 0) {
+        // expanded (broadcast) view: one element repeated
+        float val = in[0];
+        for (int i = 0; i < n; i++) { buf[i] = val; }
+    } else if (t->stride == -1) {
+        // reversed view: compiles to contiguous vector loads plus a reverse shuffle
+        for (int i = 0; i < n; i++) { buf[i] = in[-i]; }
+    } else {
+        int i = 0;
+#ifdef __AVX2__
+        // other strides: hardware gathers of 8 lanes, offsets 0, stride, ..., 7 * stride
+        __m256i vindex = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(t->stride));
+        for (; i + 8 <= n; i += 8) {
+            _mm256_storeu_ps(&buf[i], _mm256_i32gather_ps(in + i * t->stride, vindex, sizeof(float)));
+        }
+#endif
+        for (; i < n; i++) { buf[i] = in[i * t->stride]; }
+    }
+    return buf;
+}
+
+Tensor* tensor_addf(Tensor* t, float val) {
+    // adds a float to each element of the tensor, returns a new float tensor
+    Tensor* result = tensor_empty(t->size);
+    float* out = result->storage->data;
+    float buf[BLOCK_SIZE];
+    for (int start = 0; start < t->size; start += BLOCK_SIZE) {
+        int n = min(BLOCK_SIZE, t->size - start);
+        const float* in = tensor_load_floats(t, start, n, buf);
+        for (int i = 0; i < n; i++) {
+            out[start + i] = in[i] + val;
+        }
+    }
     return result;
 }
 
@@ -209,56 +1289,2827 @@ bool broadcastable(Tensor* t1, Tensor* t2) {
     return t1->size == t2->size || t1->size == 1 || t2->size == 1;
 }
 
+int broadcast_size(Tensor* t1, Tensor* t2) {
+    // the size-1 side takes the size of the other side (which can also be 0)
+    return t1->size == 1 ? t2->size : t1->size;
+}
+
+DType promote_types(DType a, DType b) {
+    // the result dtype of a binary op, same ordering as torch: bool < int32 < int64 < float32
+    if (a == DTYPE_FLOAT32 || b == DTYPE_FLOAT32) { return DTYPE_FLOAT32; }
+    if (a == DTYPE_INT64 || b == DTYPE_INT64) { return DTYPE_INT64; }
+    if (a == DTYPE_INT32 || b == DTYPE_INT32) { return DTYPE_INT32; }
+    return DTYPE_BOOL;
+}
+
 Tensor* tensor_add(Tensor* t1, Tensor* t2) {
     if (!broadcastable(t1, t2)) { return NULL; }
-    int result_size = max(t1->size, t2->size);
-    Tensor* result = tensor_empty(result_size);
-    int t1_index = 0;
-    int t2_index = 0;
-    int t1_stride = t1->size > 1 ? 1 : 0; // either we walk this tensor or not
-    int t2_stride = t2->size > 1 ? 1 : 0; // either we walk this tensor or not
-    // walk the output tensor and add the values
-    for (int result_index = 0; result_index < result_size; result_index++) {
-        float val1 = tensor_getitem(t1, t1_index);
-        float val2 = tensor_getitem(t2, t2_index);
-        float val = val1 + val2;
-        tensor_setitem(result, result_index, val);
-        t1_index += t1_stride;
-        t2_index += t2_stride;
+    int result_size = broadcast_size(t1, t2);
+    DType dtype = promote_types(tensor_dtype(t1), tensor_dtype(t2));
+    // a float scalar operand (like t[i]) is read once and added as a plain float
+    if (dtype == DTYPE_FLOAT32 && result_size > 1 && (t1->size == 1 || t2->size == 1)) {
+        Tensor* scalar = t1->size == 1 ? t1 : t2;
+        return tensor_addf(scalar == t1 ? t2 : t1, storage_getitem(scalar->storage, scalar->offset));
+    }
+    Tensor* result = tensor_empty_dtype(result_size, dtype);
+    // broadcasting is just a stride 0 view over the 1-element operand
+    Tensor* e1 = tensor_expand(t1, result_size);
+    Tensor* e2 = tensor_expand(t2, result_size);
+    if (dtype == DTYPE_FLOAT32) {
+        float buf1[BLOCK_SIZE], buf2[BLOCK_SIZE];
+        float* out = result->storage->data;
+        for (int start = 0; start < result_size; start += BLOCK_SIZE) {
+            int n = min(BLOCK_SIZE, result_size - start);
+            const float* in1 = tensor_load_floats(e1, start, n, buf1);
+            const float* in2 = tensor_load_floats(e2, start, n, buf2);
+            for (int i = 0; i < n; i++) {
+                out[start + i] = in1[i] + in2[i];
+            }
+        }
+    } else {
+        for (int i = 0; i < result_size; i++) {
+            // integers add exactly, and bool + bool is a logical or (as in torch)
+            int64_t val = storage_load_int(e1->storage, logical_to_physical(e1, i))
+                        + storage_load_int(e2->storage, logical_to_physical(e2, i));
+            storage_store_int(result->storage, i, val);
+        }
     }
+    tensor_free(e1);
+    tensor_free(e2);
     return result;
 }
 
-char* tensor_to_string(Tensor* t) {
-    // if we already have a string representation, return it
-    if (t->repr != NULL) { return t->repr; }
-    // otherwise create a new string representation
-    int max_size = t->size * 20 + 3; // 20 chars/number, brackets and commas
-    t->repr = mallocCheck(max_size);
-    char* current = t->repr;
-    current += sprintf(current, "[");
+// ----------------------------------------------------------------------------
+// Storage introspection and compaction
+// A small view keeps its whole (possibly huge) Storage alive. The live views of a
+// Storage tell us how much of it is still reachable, and with the opt-in compaction
+// policy, once that is a small enough fraction, the views are moved into compact
+// Storages of their own so that the big one can be freed.
+
+// compaction is off by default (a fraction of 0 never triggers)
+double compaction_max_fraction = 0.0;
+size_t compaction_min_bytes = 0;
+
+void storage_stats(Storage* s, StorageStats* stats) {
+    ViewExtent* extents;
+    int n = storage_view_extents(s, &extents);
+    stats->nbytes = storage_nbytes(s->data_size, s->dtype);
+    stats->reachable_bytes = storage_nbytes(extents_union_size(extents, n), s->dtype);
+    stats->released_bytes = s->released_bytes;
+    stats->num_views = 0;
+    for (Tensor* v = s->views; v != NULL; v = v->next_view) { stats->num_views++; }
+    free(extents);
+}
+
+// the stats of the Storage under t
+void tensor_storage_stats(Tensor* t, StorageStats* stats) {
+    pthread_mutex_lock(&storages_lock);
+    storage_stats(t->storage, stats);
+    pthread_mutex_unlock(&storages_lock);
+}
+
+// the stats of every live Storage: fills in up to capacity of them and returns how
+// many there are in total (so stats = NULL just counts them)
+int tensor_all_storage_stats(StorageStats* stats, int capacity) {
+    int count = 0;
+    pthread_mutex_lock(&storages_lock);
+    pthread_mutex_lock(&all_storages_lock);
+    for (Storage* s = all_storages; s != NULL; s = s->next) {
+        if (stats != NULL && count < capacity) { storage_stats(s, &stats[count]); }
+        count++;
+    }
+    pthread_mutex_unlock(&all_storages_lock);
+    pthread_mutex_unlock(&storages_lock);
+    return count;
+}
+
+// Opt in to automatic compaction: whenever a view is freed and the rest of its Storage
+// (of at least min_bytes) has at most max_reachable_fraction of its bytes reachable,
+// the remaining views are moved into compact Storages. Note that views which don't
+// overlap then no longer share a Storage. A fraction of 0 turns compaction off.
+void tensor_set_compaction_policy(double max_reachable_fraction, size_t min_bytes) {
+    compaction_max_fraction = max_reachable_fraction;
+    compaction_min_bytes = min_bytes;
+}
+
+// point view t at offset/stride in Storage s instead of its current Storage, with
+// storages_lock held. The caller keeps the old Storage alive.
+void tensor_retarget(Tensor* t, Storage* s, int offset, int stride) {
+    Storage* old = t->storage;
+    storage_detach_locked(old, t);
+    t->storage = s;
+    t->offset = offset;
+    t->stride = stride;
+    storage_incref(s);
+    storage_attach_locked(s, t);
+    storage_decref(old);
+}
+
+// Moves all the views of s into new compact Storages. Views that overlap (transitively)
+// are kept together, in one Storage covering just their combined extent, so writes
+// through one are still seen by the others. A view on its own is packed contiguously.
+// Shared memory Storages are left alone: their views have to stay on the memory that
+// other processes see. So are pinned ones, whose memory others hold pointers into, and
+// inline scalars, whose Tensor can't move off its block.
+void storage_compact(Storage* s) {
+    if (s->fd >= 0 || s->pins > 0 || s->inline_scalar) { return; }
+    ViewExtent* extents;
+    int n = storage_view_extents(s, &extents);
+    // empty views reach nothing, they can have an empty Storage each
+    for (Tensor* v = s->views; v != NULL;) {
+        Tensor* next = v->next_view;
+        if (v->size == 0) {
+            Storage* empty = storage_new(0, s->dtype);
+            empty->readonly = s->readonly;
+            empty->version = s->version;
+            tensor_retarget(v, empty, 0, 1);
+            storage_decref(empty);
+        }
+        v = next;
+    }
+    for (int i = 0; i < n;) {
+        // the group of views i..j-1 overlap, spanning the elements [lo, hi]
+        int lo = extents[i].lo;
+        int hi = extents[i].hi;
+        int j = i + 1;
+        while (j < n && extents[j].lo <= hi) { hi = max(hi, extents[j].hi); j++; }
+        if (j - i == 1) {
+            Tensor* v = extents[i].view;
+            Storage* packed = storage_new(v->size, s->dtype);
+            packed->readonly = s->readonly;
+            packed->version = s->version;
+            for (int k = 0; k < v->size; k++) { storage_copy_item(packed, k, s, logical_to_physical(v, k)); }
+            tensor_retarget(v, packed, 0, 1);
+            storage_decref(packed);
+        } else {
+            Storage* compact = storage_new(hi - lo + 1, s->dtype);
+            compact->readonly = s->readonly;
+            compact->version = s->version;
+            for (int k = lo; k <= hi; k++) { storage_copy_item(compact, k - lo, s, k); }
+            for (int k = i; k < j; k++) {
+                Tensor* v = extents[k].view;
+                tensor_retarget(v, compact, v->offset - lo, v->stride);
+            }
+            storage_decref(compact);
+        }
+        i = j;
+    }
+    free(extents);
+}
+
+// applies the compaction policy to s
+void storage_maybe_compact(Storage* s) {
+    if (compaction_max_fraction <= 0.0 || s->views == NULL) { return; }
+    size_t nbytes = storage_nbytes(s->data_size, s->dtype);
+    if (nbytes < compaction_min_bytes) { return; }
+    StorageStats stats;
+    storage_stats(s, &stats);
+    if ((double) stats.reachable_bytes <= compaction_max_fraction * (double) nbytes) {
+        storage_compact(s);
+    }
+}
+
+// compacts the Storage under t right away, regardless of the policy
+void tensor_compact_storage(Tensor* t) {
+    pthread_mutex_lock(&storages_lock);
+    // t itself moves off s, our reference keeps it alive until we're done
+    Storage* s = t->storage;
+    storage_incref(s);
+    storage_compact(s);
+    pthread_mutex_unlock(&storages_lock);
+    storage_decref(s);
+}
+
+// The alternative to compaction: keep the Storage (and so all pointers into it) but
+// give the whole pages that no live view can reach back to the OS with madvise, so
+// they stop counting towards RSS. This is also opt-in, and off by default.
+bool page_release_enabled = false;
+size_t page_release_min_bytes = 0;
+
+void tensor_set_page_release(bool enabled, size_t min_bytes) {
+    page_release_enabled = enabled;
+    page_release_min_bytes = min_bytes;
+}
+
+// releases the whole pages inside the bytes [start, end) of the Storage, returns how many bytes
+size_t storage_release_bytes(Storage* s, size_t start, size_t end) {
+    // the pages of a copy-on-write or shared Storage belong to its memfd, and those of an
+    // external one to its owner, not to us
+    if (s->cow != NULL || s->fd >= 0 || s->release != NULL) { return 0; }
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    uintptr_t base = (uintptr_t) s->data;
+    // only pages that lie entirely inside the gap, so reachable bytes are never touched
+    uintptr_t lo = (base + start + page - 1) / page * page;
+    uintptr_t hi = (base + end) / page * page;
+    if (hi <= lo) { return 0; }
+#ifdef __linux__
+    // the pages stay mapped, and would read back as zeros
+    if (madvise((void*) lo, hi - lo, MADV_DONTNEED) != 0) { return 0; }
+    return hi - lo;
+#else
+    return 0;
+#endif
+}
+
+// releases the pages of s in the gaps between the extents of its live views
+void storage_release_unreachable(Storage* s) {
+    ViewExtent* extents;
+    int n = storage_view_extents(s, &extents);
+    size_t released = 0;
+    size_t start = 0; // first byte after the reachable bytes seen so far
+    for (int i = 0; i < n; i++) {
+        released += storage_release_bytes(s, start, storage_byte_offset(s, extents[i].lo));
+        size_t end = storage_byte_end(s, extents[i].hi);
+        if (end > start) { start = end; }
+    }
+    released += storage_release_bytes(s, start, storage_nbytes(s->data_size, s->dtype));
+    // the reachable part of a Storage only ever shrinks, so this covers all earlier releases
+    s->released_bytes = released;
+    free(extents);
+}
+
+// applies the page release policy to s
+void storage_maybe_release(Storage* s) {
+    if (!page_release_enabled || s->views == NULL) { return; }
+    if (storage_nbytes(s->data_size, s->dtype) < page_release_min_bytes) { return; }
+    storage_release_unreachable(s);
+}
+
+// releases the unreachable pages of the Storage under t right away, regardless of the policy
+void tensor_release_unreachable(Tensor* t) {
+    pthread_mutex_lock(&storages_lock);
+    storage_release_unreachable(t->storage);
+    pthread_mutex_unlock(&storages_lock);
+}
+
+// Pins the memory under t, for a pointer into it handed out to someone else (a numpy
+// array, a buffer, a DLPack consumer): until tensor_unpin, the Storage stays where it is.
+// It isn't moved into shared memory or a memfd, nor compacted away, and the pinned view
+// keeps it (and the pages it reaches) alive. Returns that view, for tensor_unpin. Writes
+// through the pointer go around the write barrier, so it's run once here, in their place.
+Tensor* tensor_pin(Tensor* t) {
+    Tensor* pinned = tensor_view(t, t->offset, t->size, t->stride);
+    __atomic_add_fetch(&pinned->storage->pins, 1, __ATOMIC_RELAXED);
+    if (!pinned->storage->readonly) { tensor_check_writable(pinned); }
+    return pinned;
+}
+
+void tensor_unpin(Tensor* pinned) {
+    __atomic_sub_fetch(&pinned->storage->pins, 1, __ATOMIC_RELAXED);
+    tensor_free(pinned);
+}
+
+// ----------------------------------------------------------------------------
+// printing
+
+// Shortest round-trip formatting of float32, after Ryu (Ulf Adams, 2018): the fewest
+// decimal digits that still parse back to exactly the same float, found with integer
+// arithmetic alone. This is what lets the default repr be both short and lossless.
+
+#define FLOAT_MANTISSA_BITS 23
+#define FLOAT_EXPONENT_BITS 8
+#define FLOAT_BIAS 127
+#define FLOAT_POW5_INV_BITCOUNT 59
+#define FLOAT_POW5_BITCOUNT 61
+
+// floor(2^(pow5bits(i) - 1 + 59) / 5^i) + 1
+const uint64_t FLOAT_POW5_INV_SPLIT[31] = {
+    576460752303423489u, 461168601842738791u, 368934881474191033u,
+    295147905179352826u, 472236648286964522u, 377789318629571618u,
+    302231454903657294u, 483570327845851670u, 386856262276681336u,
+    309485009821345069u, 495176015714152110u, 396140812571321688u,
+    316912650057057351u, 507060240091291761u, 405648192073033409u,
+    324518553658426727u, 519229685853482763u, 415383748682786211u,
+    332306998946228969u, 531691198313966350u, 425352958651173080u,
+    340282366920938464u, 544451787073501542u, 435561429658801234u,
+    348449143727040987u, 557518629963265579u, 446014903970612463u,
+    356811923176489971u, 570899077082383953u, 456719261665907162u,
+    365375409332725730u,
+};
+
+// the top 61 bits of 5^i
+const uint64_t FLOAT_POW5_SPLIT[47] = {
+    1152921504606846976u, 1441151880758558720u, 1801439850948198400u,
+    2251799813685248000u, 1407374883553280000u, 1759218604441600000u,
+    2199023255552000000u, 1374389534720000000u, 1717986918400000000u,
+    2147483648000000000u, 1342177280000000000u, 1677721600000000000u,
+    2097152000000000000u, 1310720000000000000u, 1638400000000000000u,
+    2048000000000000000u, 1280000000000000000u, 1600000000000000000u,
+    2000000000000000000u, 1250000000000000000u, 1562500000000000000u,
+    1953125000000000000u, 1220703125000000000u, 1525878906250000000u,
+    1907348632812500000u, 1192092895507812500u, 1490116119384765625u,
+    1862645149230957031u, 1164153218269348144u, 1455191522836685180u,
+    1818989403545856475u, 2273736754432320594u, 1421085471520200371u,
+    1776356839400250464u, 2220446049250313080u, 1387778780781445675u,
+    1734723475976807094u, 2168404344971008868u, 1355252715606880542u,
+    1694065894508600678u, 2117582368135750847u, 1323488980084844279u,
+    1654361225106055349u, 2067951531382569187u, 1292469707114105741u,
+    1615587133892632177u, 2019483917365790221u,
+};
+
+// ceil(log2(5^e)), floor(log10(2^e)) and floor(log10(5^e)), for the e we need
+int pow5bits(int e) { return (int) (((uint32_t) e * 1217359) >> 19) + 1; }
+uint32_t log10_pow2(int e) { return ((uint32_t) e * 78913) >> 18; }
+uint32_t log10_pow5(int e) { return ((uint32_t) e * 732923) >> 20; }
+
+bool multiple_of_pow5(uint32_t value, uint32_t p) {
+    uint32_t count = 0;
+    while (value % 5 == 0 && value != 0) { value /= 5; count++; }
+    return count >= p;
+}
+
+bool multiple_of_pow2(uint32_t value, uint32_t p) {
+    return (value & ((1u << p) - 1)) == 0;
+}
+
+uint32_t mul_shift32(uint32_t m, uint64_t factor, int shift) {
+    uint64_t bits0 = (uint64_t) m * (uint32_t) factor;
+    uint64_t bits1 = (uint64_t) m * (factor >> 32);
+    return (uint32_t) (((bits0 >> 32) + bits1) >> (shift - 32));
+}
+
+// the shortest digits (as an integer) and decimal exponent with digits * 10^exp == f,
+// for a finite, positive f
+void float_to_decimal(float f, uint32_t* digits, int* exponent) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    uint32_t ieee_mantissa = bits & ((1u << FLOAT_MANTISSA_BITS) - 1);
+    uint32_t ieee_exponent = (bits >> FLOAT_MANTISSA_BITS) & ((1u << FLOAT_EXPONENT_BITS) - 1);
+    int e2;
+    uint32_t m2;
+    if (ieee_exponent == 0) {
+        e2 = 1 - FLOAT_BIAS - FLOAT_MANTISSA_BITS - 2;
+        m2 = ieee_mantissa;
+    } else {
+        e2 = (int) ieee_exponent - FLOAT_BIAS - FLOAT_MANTISSA_BITS - 2;
+        m2 = (1u << FLOAT_MANTISSA_BITS) | ieee_mantissa;
+    }
+    bool accept_bounds = (m2 & 1) == 0;
+
+    // the float and the halfway points to its neighbours, scaled by 4
+    uint32_t mv = 4 * m2;
+    uint32_t mp = 4 * m2 + 2;
+    uint32_t mm_shift = ieee_mantissa != 0 || ieee_exponent <= 1;
+    uint32_t mm = 4 * m2 - 1 - mm_shift;
+
+    // convert them to decimal, with just enough precision to pick the shortest digits
+    uint32_t vr, vp, vm;
+    int e10;
+    bool vm_trailing_zeros = false, vr_trailing_zeros = false;
+    uint8_t last_removed_digit = 0;
+    if (e2 >= 0) {
+        uint32_t q = log10_pow2(e2);
+        e10 = (int) q;
+        int k = FLOAT_POW5_INV_BITCOUNT + pow5bits((int) q) - 1;
+        int i = -e2 + (int) q + k;
+        vr = mul_shift32(mv, FLOAT_POW5_INV_SPLIT[q], i);
+        vp = mul_shift32(mp, FLOAT_POW5_INV_SPLIT[q], i);
+        vm = mul_shift32(mm, FLOAT_POW5_INV_SPLIT[q], i);
+        if (q != 0 && (vp - 1) / 10 <= vm / 10) {
+            // we need the digit we are about to drop, to round correctly
+            int l = FLOAT_POW5_INV_BITCOUNT + pow5bits((int) q - 1) - 1;
+            last_removed_digit = (uint8_t) (mul_shift32(mv, FLOAT_POW5_INV_SPLIT[q - 1], -e2 + (int) q - 1 + l) % 10);
+        }
+        if (q <= 9) {
+            // only one of mp, mv and mm can be a multiple of 5, if any
+            if (mv % 5 == 0) {
+                vr_trailing_zeros = multiple_of_pow5(mv, q);
+            } else if (accept_bounds) {
+                vm_trailing_zeros = multiple_of_pow5(mm, q);
+            } else {
+                vp -= multiple_of_pow5(mp, q);
+            }
+        }
+    } else {
+        uint32_t q = log10_pow5(-e2);
+        e10 = (int) q + e2;
+        int i = -e2 - (int) q;
+        int k = pow5bits(i) - FLOAT_POW5_BITCOUNT;
+        int j = (int) q - k;
+        vr = mul_shift32(mv, FLOAT_POW5_SPLIT[i], j);
+        vp = mul_shift32(mp, FLOAT_POW5_SPLIT[i], j);
+        vm = mul_shift32(mm, FLOAT_POW5_SPLIT[i], j);
+        if (q != 0 && (vp - 1) / 10 <= vm / 10) {
+            j = (int) q - 1 - (pow5bits(i + 1) - FLOAT_POW5_BITCOUNT);
+            last_removed_digit = (uint8_t) (mul_shift32(mv, FLOAT_POW5_SPLIT[i + 1], j) % 10);
+        }
+        if (q <= 1) {
+            // mv = 4 * m2 always has at least two trailing zero bits
+            vr_trailing_zeros = true;
+            if (accept_bounds) {
+                vm_trailing_zeros = mm_shift == 1;
+            } else {
+                vp--;
+            }
+        } else if (q < 31) {
+            vr_trailing_zeros = multiple_of_pow2(mv, q - 1);
+        }
+    }
+
+    // drop digits while the interval (vm, vp) still has a shorter number in it
+    int removed = 0;
+    uint32_t output;
+    if (vm_trailing_zeros || vr_trailing_zeros) {
+        // the rare general case
+        while (vp / 10 > vm / 10) {
+            vm_trailing_zeros &= vm % 10 == 0;
+            vr_trailing_zeros &= last_removed_digit == 0;
+            last_removed_digit = (uint8_t) (vr % 10);
+            vr /= 10; vp /= 10; vm /= 10;
+            removed++;
+        }
+        if (vm_trailing_zeros) {
+            while (vm % 10 == 0) {
+                vr_trailing_zeros &= last_removed_digit == 0;
+                last_removed_digit = (uint8_t) (vr % 10);
+                vr /= 10; vp /= 10; vm /= 10;
+                removed++;
+            }
+        }
+        if (vr_trailing_zeros && last_removed_digit == 5 && vr % 2 == 0) {
+            // exactly halfway: round to even
+            last_removed_digit = 4;
+        }
+        output = vr + ((vr == vm && (!accept_bounds || !vm_trailing_zeros)) || last_removed_digit >= 5);
+    } else {
+        while (vp / 10 > vm / 10) {
+            last_removed_digit = (uint8_t) (vr % 10);
+            vr /= 10; vp /= 10; vm /= 10;
+            removed++;
+        }
+        output = vr + (vr == vm || last_removed_digit >= 5);
+    }
+    *digits = output;
+    *exponent = e10 + removed;
+}
+
+// the longest text any one element can print as, see set_printoptions for the precision
+#define MAX_PRINT_PRECISION 16
+#define MAX_ELEMENT_CHARS (48 + MAX_PRINT_PRECISION)
+
+int format_uint(uint64_t value, char* out) {
+    char digits[20];
+    int n = 0;
+    do { digits[n++] = (char) ('0' + value % 10); value /= 10; } while (value != 0);
+    for (int i = 0; i < n; i++) { out[i] = digits[n - 1 - i]; }
+    return n;
+}
+
+int format_int(int64_t value, char* out) {
+    if (value >= 0) { return format_uint((uint64_t) value, out); }
+    out[0] = '-';
+    return 1 + format_uint(-(uint64_t) value, out + 1);
+}
+
+// writes the shortest text that reads back as exactly f, in the style of Python's repr
+// (always with a '.' or an exponent, so 1.0 and not 1), returns the number of chars
+int format_float(float f, char* out) {
+    if (isnan(f)) { memcpy(out, "nan", 3); return 3; }
+    int n = 0;
+    if (signbit(f)) { out[n++] = '-'; f = -f; }
+    if (isinf(f)) { memcpy(out + n, "inf", 3); return n + 3; }
+    if (f == 0.0f) { memcpy(out + n, "0.0", 3); return n + 3; }
+    uint32_t digits;
+    int exponent;
+    float_to_decimal(f, &digits, &exponent);
+    char d[10];
+    int nd = format_uint(digits, d);
+    int point = nd + exponent; // the decimal point goes after this many digits
+    if (point > -4 && point <= 16) {
+        if (point <= 0) {
+            // 0.000ddd
+            out[n++] = '0';
+            out[n++] = '.';
+            for (int i = 0; i < -point; i++) { out[n++] = '0'; }
+            memcpy(out + n, d, nd);
+            n += nd;
+        } else if (point >= nd) {
+            // ddd000.0
+            memcpy(out + n, d, nd);
+            n += nd;
+            for (int i = nd; i < point; i++) { out[n++] = '0'; }
+            out[n++] = '.';
+            out[n++] = '0';
+        } else {
+            // dd.ddd
+            memcpy(out + n, d, point);
+            n += point;
+            out[n++] = '.';
+            memcpy(out + n, d + point, nd - point);
+            n += nd - point;
+        }
+    } else {
+        // d.ddde+XX
+        out[n++] = d[0];
+        if (nd > 1) {
+            out[n++] = '.';
+            memcpy(out + n, d + 1, nd - 1);
+            n += nd - 1;
+        }
+        int e = point - 1;
+        out[n++] = 'e';
+        out[n++] = e < 0 ? '-' : '+';
+        if (e < 0) { e = -e; }
+        if (e < 10) { out[n++] = '0'; }
+        n += format_uint((uint64_t) e, out + n);
+    }
+    return n;
+}
+
+// like torch.set_printoptions: a precision < 0 prints floats as short as they can be
+// while still reading back exactly, tensors with more than threshold elements print
+// only their first and last edgeitems elements
+int print_precision = -1;
+int print_threshold = 1000;
+int print_edgeitems = 3;
+// bumped on every change of the options, so cached reprs made with the old ones are stale
+uint64_t print_generation = 0;
+
+void tensor_set_printoptions(int precision, int threshold, int edgeitems) {
+    print_precision = min(precision, MAX_PRINT_PRECISION);
+    print_threshold = threshold;
+    print_edgeitems = max(edgeitems, 0);
+    print_generation++;
+}
+
+// writes element i of t to out, returns the number of chars
+int format_element(Tensor* t, int i, char* out) {
+    int idx = logical_to_physical(t, i);
+    switch (tensor_dtype(t)) {
+        case DTYPE_FLOAT32: {
+            float val = storage_load(t->storage, idx);
+            if (print_precision < 0 || !isfinite(val)) { return format_float(val, out); }
+            return snprintf(out, MAX_ELEMENT_CHARS, "%.*f", print_precision, val);
+        }
+        case DTYPE_INT32:
+        case DTYPE_INT64:
+            return format_int(storage_load_int(t->storage, idx), out);
+        case DTYPE_BOOL:
+            if (storage_getbit(t->storage, idx)) { memcpy(out, "True", 4); return 4; }
+            memcpy(out, "False", 5);
+            return 5;
+    }
+    return 0;
+}
+
+// Formats t a chunk of elements at a time, handing each chunk of text to emit, so that
+// nothing ever needs to hold the text for the whole tensor. Large tensors are summarized.
+#define PRINT_CHUNK_SIZE 256
+
+typedef bool (*TextSink)(const char* text, size_t n, void* ctx);
+
+bool tensor_format(Tensor* t, TextSink emit, void* ctx) {
+    char buf[PRINT_CHUNK_SIZE * (MAX_ELEMENT_CHARS + 2) + 8];
+    bool summarize = print_threshold >= 0 && t->size > print_threshold && 2 * print_edgeitems < t->size;
+    int head_end = summarize ? print_edgeitems : t->size; // the elements [head_end, tail_start)
+    int tail_start = summarize ? t->size - print_edgeitems : t->size; // are skipped
+    int n = 0, pending = 0; // chars and elements in buf
+    buf[n++] = '[';
     for (int i = 0; i < t->size; i++) {
-        float val = tensor_getitem(t, i);
-        current += sprintf(current, "%.1f", val);
+        if (i == head_end && i < tail_start) {
+            memcpy(buf + n, "...", 3);
+            n += 3;
+            i = tail_start;
+            if (i == t->size) { break; }
+            buf[n++] = ',';
+            buf[n++] = ' ';
+        }
+        n += format_element(t, i, buf + n);
         if (i < t->size - 1) {
-            current += sprintf(current, ", ");
+            buf[n++] = ',';
+            buf[n++] = ' ';
         }
+        if (++pending == PRINT_CHUNK_SIZE) {
+            if (!emit(buf, n, ctx)) { return false; }
+            n = pending = 0;
+        }
+    }
+    buf[n++] = ']';
+    return emit(buf, n, ctx);
+}
+
+bool file_sink(const char* text, size_t n, void* ctx) {
+    return fwrite(text, 1, n, (FILE*) ctx) == n;
+}
+
+// prints t to f, as tensor_to_string would, without building the whole string first
+bool tensor_write(Tensor* t, FILE* f) {
+    return tensor_format(t, file_sink, f);
+}
+
+typedef struct {
+    char* text;
+    size_t len;
+    size_t capacity;
+} StringBuilder;
+
+bool string_sink(const char* text, size_t n, void* ctx) {
+    StringBuilder* sb = ctx;
+    if (sb->len + n + 1 > sb->capacity) {
+        sb->capacity = (sb->len + n + 1) * 2;
+        sb->text = realloc(sb->text, sb->capacity);
+        if (sb->text == NULL) { fprintf(stderr, "Error: Memory allocation failed\n"); exit(EXIT_FAILURE); }
+    }
+    memcpy(sb->text + sb->len, text, n);
+    sb->len += n;
+    sb->text[sb->len] = '\0';
+    return true;
+}
+
+char* tensor_to_string(Tensor* t) {
+    // if we already have a string representation and nothing was written since (nor were
+    // the print options changed), return it. A pinned Storage can be written without us
+    // knowing, so its text is always made anew
+    if (t->repr != NULL && t->repr_version == t->storage->version && t->repr_generation == print_generation &&
+        t->storage->pins == 0) {
+        return t->repr;
     }
-    current += sprintf(current, "]");
-    // ensure we didn't write past the end of the buffer
-    assert(current - t->repr < max_size);
+    // otherwise create a new string representation
+    free(t->repr);
+    t->repr_version = t->storage->version;
+    t->repr_generation = print_generation;
+    StringBuilder sb = { NULL, 0, 0 };
+    tensor_format(t, string_sink, &sb);
+    t->repr = sb.text;
     return t->repr;
 }
 
 void tensor_print(Tensor* t) {
-    char* str = tensor_to_string(t);
-    printf("%s\n", str);
+    tensor_write(t, stdout);
+    printf("\n");
 }
 
 void tensor_free(Tensor* t) {
-    storage_decref(t->storage);
+    pthread_mutex_lock(&storages_lock);
+    Storage* s = t->storage;
+    storage_detach_locked(s, t);
+    // with this view gone, the rest of the Storage may be worth compacting,
+    // or some of its pages may have become unreachable
+    storage_maybe_compact(s);
+    storage_maybe_release(s);
+    pthread_mutex_unlock(&storages_lock);
     free(t->repr);
-    free(t);
+    // the Tensor of an inline scalar goes with the block, when the Storage does
+    if (!s->inline_scalar || t != &scalar_block_of(s)->tensor) { free(t); }
+    storage_decref(s);
+}
+
+// ----------------------------------------------------------------------------
+// bool masks: packed 64 elements to a uint64_t word, so that masks cost 1 bit
+// per element and counting is a popcount per word
+
+// load n <= 64 consecutive bits of the storage, starting at physical index idx, as one word
+uint64_t storage_load_bits(Storage* s, int idx, int n) {
+    // the bits straddle at most two storage words
+    uint64_t* words = s->data;
+    int shift = idx & 63;
+    uint64_t word = words[idx >> 6] >> shift;
+    if (shift != 0 && shift + n > 64) { word |= words[(idx >> 6) + 1] << (64 - shift); }
+    return word;
+}
+
+uint64_t reverse_bits(uint64_t x) {
+    // reverse the bits within each byte, then the order of the bytes
+    x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+    x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+    x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    return __builtin_bswap64(x);
+}
+
+// load up to 64 consecutive elements of a bool tensor, starting at ix, as one word
+uint64_t tensor_load_bits(Tensor* t, int ix) {
+    int n = min(64, t->size - ix);
+    uint64_t word = 0;
+    if (t->stride == 1) {
+        word = storage_load_bits(t->storage, logical_to_physical(t, ix), n);
+    } else if (t->stride == 0) {
+        // expanded (broadcast) view: one bit repeated
+        word = storage_getbit(t->storage, t->offset) ? ~(uint64_t) 0 : 0;
+    } else if (t->stride == -1) {
+        // a reversed view is the same run of bits read forwards from its lowest
+        // element, with the order of the n bits flipped
+        word = storage_load_bits(t->storage, logical_to_physical(t, ix + n - 1), n);
+        word = reverse_bits(word) >> (64 - n);
+    } else {
+        for (int i = 0; i < n; i++) {
+            word |= (uint64_t) storage_getbit(t->storage, logical_to_physical(t, ix + i)) << i;
+        }
+    }
+    // clear the bits past the end of the tensor
+    if (n < 64) { word &= ((uint64_t) 1 << n) - 1; }
+    return word;
+}
+
+enum { CMP_LT, CMP_GT, CMP_EQ };
+
+Tensor* tensor_comparef(Tensor* t, float val, int op) {
+    // compares each element against val, returns a new bool tensor built a word at a time
+    Tensor* result = tensor_empty_dtype(t->size, DTYPE_BOOL);
+    uint64_t* out = result->storage->data;
+    float buf[64];
+    for (int start = 0; start < t->size; start += 64) {
+        int n = min(64, t->size - start);
+        const float* in = tensor_load_floats(t, start, n, buf);
+        uint64_t word = 0;
+        for (int i = 0; i < n; i++) {
+            float x = in[i];
+            bool bit = op == CMP_LT ? x < val : (op == CMP_GT ? x > val : x == val);
+            word |= (uint64_t) bit << i;
+        }
+        out[start / 64] = word;
+    }
+    return result;
+}
+
+// t < val
+Tensor* tensor_ltf(Tensor* t, float val) {
+    return tensor_comparef(t, val, CMP_LT);
+}
+
+// t > val
+Tensor* tensor_gtf(Tensor* t, float val) {
+    return tensor_comparef(t, val, CMP_GT);
+}
+
+// t == val
+Tensor* tensor_eqf(Tensor* t, float val) {
+    return tensor_comparef(t, val, CMP_EQ);
+}
+
+enum { LOGICAL_NOT, LOGICAL_AND, LOGICAL_OR };
+
+Tensor* tensor_logical(Tensor* t1, Tensor* t2, int op) {
+    int result_size = t2 == NULL ? t1->size : broadcast_size(t1, t2);
+    // non-bool inputs are logically "nonzero", like torch.logical_*
+    Tensor* b1 = tensor_dtype(t1) == DTYPE_BOOL ? t1 : tensor_to_dtype(t1, DTYPE_BOOL);
+    Tensor* e1 = tensor_expand(b1, result_size);
+    if (b1 != t1) { tensor_free(b1); } // the expanded view keeps its Storage alive
+    Tensor* e2 = NULL;
+    if (t2 != NULL) {
+        Tensor* b2 = tensor_dtype(t2) == DTYPE_BOOL ? t2 : tensor_to_dtype(t2, DTYPE_BOOL);
+        e2 = tensor_expand(b2, result_size);
+        if (b2 != t2) { tensor_free(b2); }
+    }
+    Tensor* result = tensor_empty_dtype(result_size, DTYPE_BOOL);
+    uint64_t* out = result->storage->data;
+    for (int start = 0; start < result_size; start += 64) {
+        int n = min(64, result_size - start);
+        uint64_t w1 = tensor_load_bits(e1, start);
+        uint64_t w2 = e2 != NULL ? tensor_load_bits(e2, start) : 0;
+        uint64_t word = op == LOGICAL_NOT ? ~w1 : (op == LOGICAL_AND ? w1 & w2 : w1 | w2);
+        if (n < 64) { word &= ((uint64_t) 1 << n) - 1; }
+        out[start / 64] = word;
+    }
+    tensor_free(e1);
+    if (e2 != NULL) { tensor_free(e2); }
+    return result;
+}
+
+// torch.logical_not(t)
+Tensor* tensor_logical_not(Tensor* t) {
+    return tensor_logical(t, NULL, LOGICAL_NOT);
+}
+
+// torch.logical_and(t1, t2)
+Tensor* tensor_logical_and(Tensor* t1, Tensor* t2) {
+    if (!broadcastable(t1, t2)) { return NULL; }
+    return tensor_logical(t1, t2, LOGICAL_AND);
+}
+
+// torch.logical_or(t1, t2)
+Tensor* tensor_logical_or(Tensor* t1, Tensor* t2) {
+    if (!broadcastable(t1, t2)) { return NULL; }
+    return tensor_logical(t1, t2, LOGICAL_OR);
+}
+
+// torch.count_nonzero(t)
+int tensor_count_nonzero(Tensor* t) {
+    int count = 0;
+    if (tensor_dtype(t) == DTYPE_BOOL) {
+        for (int start = 0; start < t->size; start += 64) {
+            count += __builtin_popcountll(tensor_load_bits(t, start));
+        }
+        return count;
+    }
+    for (int i = 0; i < t->size; i++) {
+        count += storage_load_int(t->storage, logical_to_physical(t, i)) != 0;
+    }
+    return count;
+}
+
+// ----------------------------------------------------------------------------
+// copy: copy_ / contiguous / clone
+
+// beyond this many bytes the destination won't fit in cache anyway, so big strided
+// copies write it with non-temporal stores instead of evicting everything else
+#define STREAMING_MIN_BYTES (1 << 23)
+
+// out[i] = in[i * stride] for a huge strided float32 copy into a contiguous out
+void copy_floats_streaming(const float* in, int stride, int n, float* out) {
+    int i = 0;
+#ifdef __SSE2__
+    // scalar head until out is 16-byte aligned, as the streaming stores require
+    for (; i < n && ((uintptr_t) &out[i] & 15) != 0; i++) { out[i] = in[i * stride]; }
+    for (; i + 4 <= n; i += 4) {
+        // every element is its own cache line, so keep PREFETCH_DISTANCE loads in flight
+        if (i + PREFETCH_DISTANCE < n) { __builtin_prefetch(&in[(i + PREFETCH_DISTANCE) * stride]); }
+        __m128 v = _mm_setr_ps(in[i * stride], in[(i + 1) * stride], in[(i + 2) * stride], in[(i + 3) * stride]);
+        _mm_stream_ps(&out[i], v);
+    }
+    _mm_sfence();
+#endif
+    for (; i < n; i++) { out[i] = in[i * stride]; }
+}
+
+// the element-wise copy, for views that don't overlap and have the same size
+void copy_kernel(Tensor* dst, Tensor* src) {
+    int n = dst->size;
+    DType dtype = tensor_dtype(dst);
+    if (dtype == tensor_dtype(src) && dtype != DTYPE_BOOL && dst->stride == 1 && src->stride == 1) {
+        // both contiguous: a plain memcpy
+        size_t itemsize = dtype_itemsize(dtype);
+        memcpy((char*) dst->storage->data + dst->offset * itemsize,
+               (char*) src->storage->data + src->offset * itemsize, n * itemsize);
+        return;
+    }
+    if (dtype == DTYPE_FLOAT32 && dst->stride == 1) {
+        float* out = (float*) dst->storage->data + dst->offset;
+        if (tensor_dtype(src) == DTYPE_FLOAT32 && (size_t) n * sizeof(float) >= STREAMING_MIN_BYTES) {
+            copy_floats_streaming((float*) src->storage->data + src->offset, src->stride, n, out);
+            return;
+        }
+        // the loader gathers (and converts) straight into the destination
+        tensor_load_floats(src, 0, n, out);
+        return;
+    }
+    if (dtype == DTYPE_FLOAT32) {
+        float* out = (float*) dst->storage->data + dst->offset;
+        float buf[BLOCK_SIZE];
+        for (int start = 0; start < n; start += BLOCK_SIZE) {
+            int len = min(BLOCK_SIZE, n - start);
+            const float* in = tensor_load_floats(src, start, len, buf);
+            for (int i = 0; i < len; i++) { out[(start + i) * dst->stride] = in[i]; }
+        }
+        return;
+    }
+    bool same = dtype == tensor_dtype(src);
+    bool via_float = tensor_dtype(src) == DTYPE_FLOAT32;
+    for (int i = 0; i < n; i++) {
+        int di = logical_to_physical(dst, i);
+        int si = logical_to_physical(src, i);
+        if (same) {
+            storage_copy_item(dst->storage, di, src->storage, si);
+        } else if (via_float) {
+            storage_store(dst->storage, di, storage_load(src->storage, si));
+        } else {
+            storage_store_int(dst->storage, di, storage_load_int(src->storage, si));
+        }
+    }
+}
+
+// t.clone(): a copy of the elements of t, in a new contiguous Storage of its own.
+// With copy-on-write on, a contiguous t that starts on a chunk shares its pages instead.
+Tensor* tensor_clone(Tensor* t) {
+    DType dtype = tensor_dtype(t);
+    size_t byte_offset = storage_byte_offset(t->storage, t->offset);
+    if (t->stride == 1 && cow_wanted(storage_nbytes(t->size, dtype)) && byte_offset % COW_CHUNK_BYTES == 0 &&
+        (dtype != DTYPE_BOOL || t->offset % 64 == 0)) {
+        Storage* shared = storage_cow_clone(t->storage, t->offset, t->size);
+        if (shared != NULL) { return tensor_from_storage(shared); }
+    }
+    Tensor* result = tensor_empty_dtype(t->size, tensor_dtype(t));
+    copy_kernel(result, t);
+    return result;
+}
+
+// t.contiguous(): t itself (as a new view) if it is already contiguous, else a clone
+Tensor* tensor_contiguous(Tensor* t) {
+    if (t->stride == 1 || t->size <= 1) { return tensor_view(t, t->offset, t->size, t->stride); }
+    return tensor_clone(t);
+}
+
+// dst.copy_(src): copies the elements of src into the view dst, in place, converting
+// dtypes and broadcasting a 1-element src. Returns false if the sizes don't match.
+bool tensor_copy_(Tensor* dst, Tensor* src) {
+    if (!tensor_check_no_overlap(dst, "copy_")) { return false; }
+    if (src->size != dst->size && src->size != 1) {
+        fprintf(stderr, "ValueError: cannot copy a tensor of size %d into a tensor of size %d\n", src->size, dst->size);
+        return false;
+    }
+    // only once we know the copy goes ahead, so a failed one leaves dst untouched
+    if (!tensor_check_writable(dst)) { return false; }
+    Tensor* s = tensor_expand(src, dst->size);
+    if (s->storage == dst->storage && dst->size > 0) {
+        // when the two views overlap in the Storage, e.g. t.copy_(t[::-1]),
+        // we first take a private copy of src so we don't read what we wrote
+        int dst_lo, dst_hi, src_lo, src_hi;
+        tensor_physical_range(dst, &dst_lo, &dst_hi);
+        tensor_physical_range(s, &src_lo, &src_hi);
+        if (dst_lo <= src_hi && src_lo <= dst_hi) {
+            Tensor* tmp = tensor_clone(s);
+            tensor_free(s);
+            s = tmp;
+        }
+    }
+    copy_kernel(dst, s);
+    tensor_free(s);
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// indexing: index_select / gather / scatter / masked_select
+// Indices are validated against the indexed tensor in one pass up front, so that the
+// kernels themselves run without any checks.
+
+bool is_integer_dtype(DType dtype) {
+    return dtype == DTYPE_INT32 || dtype == DTYPE_INT64;
+}
+
+// Load elements [ix, ix + n) of an integer index tensor as ints, the same way
+// tensor_load_floats does for floats. Unit-stride int32 is returned in place.
+const int* tensor_load_indices(Tensor* index, int ix, int n, int* buf) {
+    if (tensor_dtype(index) == DTYPE_INT32 && index->stride == 1) {
+        return (int32_t*) index->storage->data + logical_to_physical(index, ix);
+    }
+    for (int i = 0; i < n; i++) {
+        buf[i] = (int) storage_load_int(index->storage, logical_to_physical(index, ix + i));
+    }
+    return buf;
+}
+
+// checks that index is an integer tensor with every element in [0, size)
+bool indices_valid(Tensor* index, int size) {
+    if (!is_integer_dtype(tensor_dtype(index))) {
+        fprintf(stderr, "ValueError: indices must be an int32 or int64 tensor\n");
+        return false;
+    }
+    for (int i = 0; i < index->size; i++) {
+        int64_t ix = storage_load_int(index->storage, logical_to_physical(index, i));
+        if (ix < 0 || ix >= size) {
+            fprintf(stderr, "IndexError: index %lld is out of bounds of %d\n", (long long) ix, size);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool tensor_is_large(Tensor* t) {
+    return (size_t) t->size * (size_t) abs(t->stride) * sizeof(float) >= PREFETCH_MIN_BYTES;
+}
+
+// out[i] = t[index[i]] for i in [0, n), for a float32 tensor t
+void gather_floats(Tensor* t, const int* index, int n, float* out) {
+    const float* data = (float*) t->storage->data + t->offset;
+    int stride = t->stride;
+    if (tensor_is_large(t)) {
+        // big table: the loads miss cache, so keep PREFETCH_DISTANCE of them in flight
+        for (int i = 0; i < n; i++) {
+            if (i + PREFETCH_DISTANCE < n) { __builtin_prefetch(&data[index[i + PREFETCH_DISTANCE] * stride]); }
+            out[i] = data[index[i] * stride];
+        }
+        return;
+    }
+    int i = 0;
+#if defined(__AVX512F__)
+    // cache-resident table: hardware gathers, 16 lanes at a time
+    __m512i vstride = _mm512_set1_epi32(stride);
+    for (; i + 16 <= n; i += 16) {
+        __m512i vindex = _mm512_mullo_epi32(_mm512_loadu_si512((const void*) &index[i]), vstride);
+        _mm512_storeu_ps(&out[i], _mm512_i32gather_ps(vindex, data, sizeof(float)));
+    }
+#elif defined(__AVX2__)
+    // cache-resident table: hardware gathers, 8 lanes at a time
+    __m256i vstride = _mm256_set1_epi32(stride);
+    for (; i + 8 <= n; i += 8) {
+        __m256i vindex = _mm256_mullo_epi32(_mm256_loadu_si256((const __m256i*) &index[i]), vstride);
+        _mm256_storeu_ps(&out[i], _mm256_i32gather_ps(data, vindex, sizeof(float)));
+    }
+#endif
+    for (; i < n; i++) {
+        out[i] = data[index[i] * stride];
+    }
+}
+
+// torch.index_select(t, 0, index): a new tensor with out[i] = t[index[i]]
+Tensor* tensor_index_select(Tensor* t, Tensor* index) {
+    if (!indices_valid(index, t->size)) { return NULL; }
+    Tensor* result = tensor_empty_dtype(index->size, tensor_dtype(t));
+    int buf[BLOCK_SIZE];
+    for (int start = 0; start < index->size; start += BLOCK_SIZE) {
+        int n = min(BLOCK_SIZE, index->size - start);
+        const int* ix = tensor_load_indices(index, start, n, buf);
+        if (tensor_dtype(t) == DTYPE_FLOAT32) {
+            gather_floats(t, ix, n, (float*) result->storage->data + start);
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            storage_copy_item(result->storage, start + i, t->storage, logical_to_physical(t, ix[i]));
+        }
+    }
+    return result;
+}
+
+// torch.gather(t, 0, index): for 1D tensors this is the same as index_select
+Tensor* tensor_gather(Tensor* t, Tensor* index) {
+    return tensor_index_select(t, index);
+}
+
+bool tensor_scatter_impl(Tensor* t, Tensor* index, Tensor* src, bool accumulate) {
+    if (!tensor_check_no_overlap(t, accumulate ? "scatter_add_" : "scatter_")) { return false; }
+    if (!indices_valid(index, t->size)) { return false; }
+    if (tensor_dtype(src) != tensor_dtype(t)) {
+        fprintf(stderr, "ValueError: scatter src must have the same dtype as the tensor\n");
+        return false;
+    }
+    if (src->size != 1 && src->size < index->size) {
+        fprintf(stderr, "ValueError: scatter src of size %d is smaller than index of size %d\n", src->size, index->size);
+        return false;
+    }
+    if (!tensor_check_writable(t)) { return false; }
+    // a 1-element src is broadcast over all the indices
+    Tensor* e = src->size == 1 ? tensor_expand(src, index->size) : NULL;
+    Tensor* values = e != NULL ? e : src;
+    bool fast = tensor_dtype(t) == DTYPE_FLOAT32;
+    bool prefetch = tensor_is_large(t);
+    float* data = (float*) t->storage->data + t->offset;
+    int buf[BLOCK_SIZE];
+    float vbuf[BLOCK_SIZE];
+    for (int start = 0; start < index->size; start += BLOCK_SIZE) {
+        int n = min(BLOCK_SIZE, index->size - start);
+        const int* ix = tensor_load_indices(index, start, n, buf);
+        if (fast) {
+            // in order, so with duplicate indices the last write wins (or all accumulate)
+            const float* v = tensor_load_floats(values, start, n, vbuf);
+            for (int i = 0; i < n; i++) {
+                if (prefetch && i + PREFETCH_DISTANCE < n) {
+                    __builtin_prefetch(&data[ix[i + PREFETCH_DISTANCE] * t->stride], 1);
+                }
+                if (accumulate) { data[ix[i] * t->stride] += v[i]; } else { data[ix[i] * t->stride] = v[i]; }
+            }
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            int di = logical_to_physical(t, ix[i]);
+            int si = logical_to_physical(values, start + i);
+            if (accumulate) {
+                int64_t val = storage_load_int(t->storage, di) + storage_load_int(values->storage, si);
+                storage_store_int(t->storage, di, val);
+            } else {
+                storage_copy_item(t->storage, di, values->storage, si);
+            }
+        }
+    }
+    if (e != NULL) { tensor_free(e); }
+    return true;
+}
+
+// t.scatter_(0, index, src): t[index[i]] = src[i], in place
+bool tensor_scatter_(Tensor* t, Tensor* index, Tensor* src) {
+    return tensor_scatter_impl(t, index, src, false);
+}
+
+// t.scatter_add_(0, index, src): t[index[i]] += src[i], in place, accumulating duplicates
+bool tensor_scatter_add_(Tensor* t, Tensor* index, Tensor* src) {
+    return tensor_scatter_impl(t, index, src, true);
+}
+
+// torch.masked_select(t, mask): a new tensor with the elements of t where mask is True
+Tensor* tensor_masked_select(Tensor* t, Tensor* mask) {
+    if (tensor_dtype(mask) != DTYPE_BOOL) {
+        fprintf(stderr, "ValueError: mask must be a bool tensor\n");
+        return NULL;
+    }
+    if (!broadcastable(t, mask) || (t->size == 1 && mask->size != 1)) {
+        fprintf(stderr, "ValueError: mask of size %d does not match tensor of size %d\n", mask->size, t->size);
+        return NULL;
+    }
+    // the popcount tells us the size of the result, so it is allocated exactly once
+    Tensor* m = tensor_expand(mask, t->size);
+    Tensor* result = tensor_empty_dtype(tensor_count_nonzero(m), tensor_dtype(t));
+    int k = 0;
+    for (int start = 0; start < t->size; start += 64) {
+        uint64_t word = tensor_load_bits(m, start);
+        // visit only the set bits of the word, lowest first
+        while (word != 0) {
+            int ix = start + __builtin_ctzll(word);
+            storage_copy_item(result->storage, k++, t->storage, logical_to_physical(t, ix));
+            word &= word - 1;
+        }
+    }
+    tensor_free(m);
+    return result;
+}
+
+// ----------------------------------------------------------------------------
+// foreach: in-place ops over a whole list of float tensors in one call, like
+// torch._foreach_add_, for when the work is thousands of small tensors (the parameters of
+// a model, say) and the per-call overhead would dwarf the math. The whole list is checked
+// before anything is written, then each tensor is swept BLOCK_SIZE elements at a time.
+
+typedef enum {
+    FOREACH_ADD, // t += scalar * other, or t += scalar
+    FOREACH_MUL, // t *= other, or t *= scalar
+} ForeachOp;
+
+// the checks of a foreach op; others (if given) must match ts one to one, or have 1 element
+bool foreach_check(const char* name, Tensor** ts, Tensor** others, int n) {
+    for (int i = 0; i < n; i++) {
+        Tensor* t = ts[i];
+        if (tensor_dtype(t) != DTYPE_FLOAT32) {
+            fprintf(stderr, "ValueError: %s needs float32 tensors, tensor %d is not\n", name, i);
+            return false;
+        }
+        if (t->storage->readonly) {
+            fprintf(stderr, "RuntimeError: %s cannot write to tensor %d, it is read-only\n", name, i);
+            return false;
+        }
+        if (t->stride == 0 && t->size > 1) {
+            fprintf(stderr, "ValueError: %s cannot write in place to tensor %d, its elements overlap\n", name, i);
+            return false;
+        }
+        if (others != NULL && others[i]->size != t->size && others[i]->size != 1) {
+            fprintf(stderr, "ValueError: %s: tensor %d of size %d does not match tensor of size %d\n",
+                    name, i, others[i]->size, t->size);
+            return false;
+        }
+    }
+    return true;
+}
+
+// The n floats of t from element ix on, ready to be updated in place: a pointer into the
+// Storage if t is contiguous, else buf filled with them, for tensor_store_block to write
+// back. t must be float32 and its elements must not overlap.
+float* tensor_block(Tensor* t, int ix, int n, float* buf) {
+    if (t->stride == 1) { return (float*) t->storage->data + t->offset + ix; }
+    tensor_load_floats(t, ix, n, buf);
+    return buf;
+}
+
+void tensor_store_block(Tensor* t, int ix, int n, const float* buf) {
+    if (t->stride == 1) { return; }
+    float* data = t->storage->data;
+    for (int i = 0; i < n; i++) { data[logical_to_physical(t, ix + i)] = buf[i]; }
+}
+
+// applies op to all of t, with other (NULL for just the scalar)
+void foreach_apply(ForeachOp op, Tensor* t, Tensor* other, float scalar) {
+    // a one-element other is just a scalar
+    if (other != NULL && other->size == 1) {
+        float val = storage_load(other->storage, other->offset);
+        scalar = op == FOREACH_ADD ? scalar * val : val;
+        other = NULL;
+    }
+    // when other overlaps t in the Storage, e.g. foreach_add_([t[1:]], [t[:-1]]), we first
+    // take a private copy of it so the sweep doesn't read what it wrote. The very same
+    // view is fine: each element is read right before it is written.
+    Tensor* copy = NULL;
+    if (other != NULL && other->storage == t->storage && t->size > 0 &&
+        !(other->offset == t->offset && other->stride == t->stride)) {
+        int t_lo, t_hi, other_lo, other_hi;
+        tensor_physical_range(t, &t_lo, &t_hi);
+        tensor_physical_range(other, &other_lo, &other_hi);
+        if (t_lo <= other_hi && other_lo <= t_hi) {
+            copy = tensor_clone(other);
+            other = copy;
+        }
+    }
+    tensor_check_writable(t);
+    float buf[BLOCK_SIZE], other_buf[BLOCK_SIZE];
+    for (int start = 0; start < t->size; start += BLOCK_SIZE) {
+        int n = min(BLOCK_SIZE, t->size - start);
+        float* x = tensor_block(t, start, n, buf);
+        const float* b = other != NULL ? tensor_load_floats(other, start, n, other_buf) : NULL;
+        if (op == FOREACH_ADD && b != NULL) {
+            for (int i = 0; i < n; i++) { x[i] += scalar * b[i]; }
+        } else if (op == FOREACH_ADD) {
+            for (int i = 0; i < n; i++) { x[i] += scalar; }
+        } else if (b != NULL) {
+            for (int i = 0; i < n; i++) { x[i] *= b[i]; }
+        } else {
+            for (int i = 0; i < n; i++) { x[i] *= scalar; }
+        }
+        tensor_store_block(t, start, n, x);
+    }
+    if (copy != NULL) { tensor_free(copy); }
+}
+
+bool foreach_run(const char* name, ForeachOp op, Tensor** ts, Tensor** others, int n, float scalar) {
+    if (!foreach_check(name, ts, others, n)) { return false; }
+    for (int i = 0; i < n; i++) { foreach_apply(op, ts[i], others != NULL ? others[i] : NULL, scalar); }
+    return true;
+}
+
+// torch._foreach_add_(ts, others, alpha=alpha): ts[i] += alpha * others[i]
+bool tensor_foreach_add_(Tensor** ts, Tensor** others, int n, float alpha) {
+    return foreach_run("foreach_add_", FOREACH_ADD, ts, others, n, alpha);
+}
+
+// torch._foreach_add_(ts, val): ts[i] += val
+bool tensor_foreach_addf_(Tensor** ts, int n, float val) {
+    return foreach_run("foreach_add_", FOREACH_ADD, ts, NULL, n, val);
+}
+
+// torch._foreach_mul_(ts, others): ts[i] *= others[i]
+bool tensor_foreach_mul_(Tensor** ts, Tensor** others, int n) {
+    return foreach_run("foreach_mul_", FOREACH_MUL, ts, others, n, 1.0f);
+}
+
+// torch._foreach_mul_(ts, val): ts[i] *= val
+bool tensor_foreach_mulf_(Tensor** ts, int n, float val) {
+    return foreach_run("foreach_mul_", FOREACH_MUL, ts, NULL, n, val);
+}
+
+// ----------------------------------------------------------------------------
+// fused optimizer steps: SGD (with momentum) and Adam / AdamW, like torch.optim, updating
+// whole lists of parameters and their state in place in one call. Each element of the
+// parameters, gradients and state is read once and written once, BLOCK_SIZE at a time;
+// strided views go through buffers like in foreach.
+
+// the checks of an optimizer step: for each parameter i, lists[k][i] must be float32 and of
+// the size of the parameter, and all but the gradients (list 1) writable
+bool optim_check(const char* name, Tensor*** lists, int num_lists, int n) {
+    for (int i = 0; i < n; i++) {
+        for (int k = 0; k < num_lists; k++) {
+            Tensor* t = lists[k][i];
+            if (tensor_dtype(t) != DTYPE_FLOAT32 || t->size != lists[0][i]->size) {
+                fprintf(stderr, "ValueError: %s needs float32 tensors of the size of parameter %d\n", name, i);
+                return false;
+            }
+            if (k != 1 && t->storage->readonly) {
+                fprintf(stderr, "RuntimeError: %s cannot write to the tensors of parameter %d, they are read-only\n", name, i);
+                return false;
+            }
+            if (k != 1 && t->stride == 0 && t->size > 1) {
+                fprintf(stderr, "ValueError: %s cannot write in place to the tensors of parameter %d, their elements overlap\n", name, i);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// torch.optim.SGD's step, over n parameters: with weight decay, momentum (momentum_buffers
+// can be NULL without it), dampening and Nesterov. On the first step the buffers are
+// started from the gradients, as in torch.
+bool tensor_sgd_(Tensor** params, Tensor** grads, Tensor** momentum_buffers, int n, float lr, float momentum,
+                 float dampening, float weight_decay, bool nesterov, bool first_step) {
+    bool use_momentum = momentum != 0.0f;
+    if (use_momentum && momentum_buffers == NULL) {
+        fprintf(stderr, "ValueError: sgd_ with momentum needs momentum buffers\n");
+        return false;
+    }
+    Tensor** lists[] = { params, grads, momentum_buffers };
+    if (!optim_check("sgd_", lists, use_momentum ? 3 : 2, n)) { return false; }
+    float keep = first_step ? 0.0f : momentum; // buf = keep * buf + take * grad
+    float take = first_step ? 1.0f : 1.0f - dampening;
+    float p_buf[BLOCK_SIZE], g_buf[BLOCK_SIZE], m_buf[BLOCK_SIZE];
+    for (int k = 0; k < n; k++) {
+        Tensor* param = params[k];
+        Tensor* buffer = use_momentum ? momentum_buffers[k] : NULL;
+        tensor_check_writable(param);
+        if (buffer != NULL) { tensor_check_writable(buffer); }
+        for (int start = 0; start < param->size; start += BLOCK_SIZE) {
+            int bn = min(BLOCK_SIZE, param->size - start);
+            float* p = tensor_block(param, start, bn, p_buf);
+            const float* g = tensor_load_floats(grads[k], start, bn, g_buf);
+            if (buffer == NULL) {
+                for (int i = 0; i < bn; i++) { p[i] -= lr * (g[i] + weight_decay * p[i]); }
+            } else {
+                float* m = tensor_block(buffer, start, bn, m_buf);
+                for (int i = 0; i < bn; i++) {
+                    float d = g[i] + weight_decay * p[i];
+                    float b = keep * m[i] + take * d;
+                    m[i] = b;
+                    p[i] -= lr * (nesterov ? d + momentum * b : b);
+                }
+                tensor_store_block(buffer, start, bn, m);
+            }
+            tensor_store_block(param, start, bn, p);
+        }
+    }
+    return true;
+}
+
+typedef struct {
+    float beta1, beta2, eps;
+    float decay; // params are scaled by this first: 1 - lr * weight_decay for AdamW, else 1
+    float l2; // weight_decay for Adam (added to the gradient), else 0
+    float step_size; // lr / (1 - beta1^step)
+    float inv_sqrt_bc2; // 1 / sqrt(1 - beta2^step)
+} AdamCoefficients;
+
+// one block of Adam: the n elements of p, m (exp_avg) and v (exp_avg_sq) updated in place
+void adam_block(float* p, const float* g, float* m, float* v, int n, const AdamCoefficients* c) {
+    int i = 0;
+#ifdef __SSE2__
+    // by hand, since sqrtf (it may set errno) keeps the compiler from vectorizing it
+    __m128 beta1 = _mm_set1_ps(c->beta1), one_minus_beta1 = _mm_set1_ps(1.0f - c->beta1);
+    __m128 beta2 = _mm_set1_ps(c->beta2), one_minus_beta2 = _mm_set1_ps(1.0f - c->beta2);
+    __m128 eps = _mm_set1_ps(c->eps), decay = _mm_set1_ps(c->decay), l2 = _mm_set1_ps(c->l2);
+    __m128 step_size = _mm_set1_ps(c->step_size), inv_sqrt_bc2 = _mm_set1_ps(c->inv_sqrt_bc2);
+    for (; i + 4 <= n; i += 4) {
+        __m128 pi = _mm_loadu_ps(p + i);
+        __m128 gi = _mm_add_ps(_mm_loadu_ps(g + i), _mm_mul_ps(l2, pi));
+        __m128 mi = _mm_add_ps(_mm_mul_ps(beta1, _mm_loadu_ps(m + i)), _mm_mul_ps(one_minus_beta1, gi));
+        __m128 vi = _mm_add_ps(_mm_mul_ps(beta2, _mm_loadu_ps(v + i)), _mm_mul_ps(one_minus_beta2, _mm_mul_ps(gi, gi)));
+        __m128 denom = _mm_add_ps(_mm_mul_ps(_mm_sqrt_ps(vi), inv_sqrt_bc2), eps);
+        pi = _mm_sub_ps(_mm_mul_ps(pi, decay), _mm_div_ps(_mm_mul_ps(step_size, mi), denom));
+        _mm_storeu_ps(m + i, mi);
+        _mm_storeu_ps(v + i, vi);
+        _mm_storeu_ps(p + i, pi);
+    }
+#endif
+    for (; i < n; i++) {
+        float gi = g[i] + c->l2 * p[i];
+        float mi = c->beta1 * m[i] + (1.0f - c->beta1) * gi;
+        float vi = c->beta2 * v[i] + (1.0f - c->beta2) * gi * gi;
+        float denom = sqrtf(vi) * c->inv_sqrt_bc2 + c->eps;
+        m[i] = mi;
+        v[i] = vi;
+        p[i] = p[i] * c->decay - c->step_size * mi / denom;
+    }
+}
+
+// torch.optim.Adam's step (or AdamW's, with decoupled_weight_decay) over n parameters,
+// step being the number of this step, counting from 1
+bool tensor_adam_(Tensor** params, Tensor** grads, Tensor** exp_avgs, Tensor** exp_avg_sqs, int n, int step,
+                  float lr, float beta1, float beta2, float eps, float weight_decay, bool decoupled_weight_decay) {
+    if (step < 1) {
+        fprintf(stderr, "ValueError: adam_ steps count from 1, got %d\n", step);
+        return false;
+    }
+    Tensor** lists[] = { params, grads, exp_avgs, exp_avg_sqs };
+    if (!optim_check("adam_", lists, 4, n)) { return false; }
+    AdamCoefficients c;
+    c.beta1 = beta1;
+    c.beta2 = beta2;
+    c.eps = eps;
+    c.decay = decoupled_weight_decay ? 1.0f - lr * weight_decay : 1.0f;
+    c.l2 = decoupled_weight_decay ? 0.0f : weight_decay;
+    c.step_size = (float) (lr / (1.0 - pow(beta1, step)));
+    c.inv_sqrt_bc2 = (float) (1.0 / sqrt(1.0 - pow(beta2, step)));
+    float p_buf[BLOCK_SIZE], g_buf[BLOCK_SIZE], m_buf[BLOCK_SIZE], v_buf[BLOCK_SIZE];
+    for (int k = 0; k < n; k++) {
+        tensor_check_writable(params[k]);
+        tensor_check_writable(exp_avgs[k]);
+        tensor_check_writable(exp_avg_sqs[k]);
+        for (int start = 0; start < params[k]->size; start += BLOCK_SIZE) {
+            int bn = min(BLOCK_SIZE, params[k]->size - start);
+            float* p = tensor_block(params[k], start, bn, p_buf);
+            const float* g = tensor_load_floats(grads[k], start, bn, g_buf);
+            float* m = tensor_block(exp_avgs[k], start, bn, m_buf);
+            float* v = tensor_block(exp_avg_sqs[k], start, bn, v_buf);
+            adam_block(p, g, m, v, bn, &c);
+            tensor_store_block(exp_avgs[k], start, bn, m);
+            tensor_store_block(exp_avg_sqs[k], start, bn, v);
+            tensor_store_block(params[k], start, bn, p);
+        }
+    }
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// sending tensors over Unix domain sockets: each message is a small fixed-size header
+// describing the view, with the fd of its shared memory Storage attached (SCM_RIGHTS).
+// The receiver maps that fd, so no element is ever copied, and a slice arrives as the
+// same slice of the same memory.
+
+#define TENSOR_MESSAGE_MAGIC 0x31643174u // "t1d1"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t dtype;
+    int32_t storage_size;
+    int32_t offset;
+    int32_t size;
+    int32_t stride;
+} TensorMessage;
+
+// tensor_send, for a view t whose Storage may still need moving into shared memory
+bool tensor_send_shared(int sock, Tensor* t) {
+    TensorHandle handle;
+    if (!storage_share_memory(t->storage) || !tensor_export(t, &handle)) { return false; }
+    TensorMessage msg = { TENSOR_MESSAGE_MAGIC, (uint32_t) handle.dtype, handle.storage_size,
+                          handle.offset, handle.size, handle.stride };
+    struct iovec iov = { &msg, sizeof(msg) };
+    union { char buf[CMSG_SPACE(sizeof(int))]; struct cmsghdr align; } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control.buf;
+    header.msg_controllen = sizeof(control.buf);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&header);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &handle.fd, sizeof(int));
+    ssize_t n;
+    do { n = sendmsg(sock, &header, MSG_NOSIGNAL); } while (n < 0 && errno == EINTR);
+    if (n != (ssize_t) sizeof(msg)) {
+        fprintf(stderr, "OSError: sending a tensor failed: %s\n", n < 0 ? strerror(errno) : "short write");
+        return false;
+    }
+    return true;
+}
+
+// sends the view t to the other end of the socket sock. t's Storage is moved into
+// shared memory first if it isn't there already (see tensor_share_memory_). If it can't
+// be moved, e.g. it maps a file, a copy of the view in shared memory is sent instead.
+bool tensor_send(int sock, Tensor* t) {
+    Tensor* copy = NULL;
+    if (t->storage->fd < 0 && !storage_movable(t->storage)) {
+        Storage* shared = storage_new_shared(t->size, tensor_dtype(t));
+        if (shared == NULL) { return false; }
+        copy = tensor_from_storage(shared);
+        copy_kernel(copy, t);
+        t = copy;
+    }
+    bool sent = tensor_send_shared(sock, t);
+    // the fd in flight holds on to the memory of the copy until the other end maps it
+    if (copy != NULL) { tensor_free(copy); }
+    return sent;
+}
+
+// Receives a tensor sent with tensor_send into *t. Like read(), returns 1 on success,
+// 0 once the other end has closed the socket, and -1 on error.
+int tensor_recv(int sock, Tensor** t) {
+    TensorMessage msg;
+    struct iovec iov = { &msg, sizeof(msg) };
+    union { char buf[CMSG_SPACE(sizeof(int))]; struct cmsghdr align; } control;
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control.buf;
+    header.msg_controllen = sizeof(control.buf);
+    ssize_t n;
+    do { n = recvmsg(sock, &header, MSG_CMSG_CLOEXEC); } while (n < 0 && errno == EINTR);
+    if (n == 0) { return 0; }
+    // the fd comes with the first byte of the message
+    int fd = -1;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&header); n > 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&header, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) { memcpy(&fd, CMSG_DATA(cmsg), sizeof(int)); }
+    }
+    // on a stream socket the rest of the header may come separately
+    size_t got = n > 0 ? (size_t) n : 0;
+    while (n > 0 && got < sizeof(msg)) {
+        n = recv(sock, (char*) &msg + got, sizeof(msg) - got, 0);
+        if (n < 0 && errno == EINTR) { n = 1; continue; }
+        if (n > 0) { got += (size_t) n; }
+    }
+    if (got < sizeof(msg) || fd < 0 || msg.magic != TENSOR_MESSAGE_MAGIC) {
+        fprintf(stderr, "OSError: receiving a tensor failed: %s\n", n < 0 ? strerror(errno) : "bad message");
+        if (fd >= 0) { close(fd); }
+        return -1;
+    }
+    TensorHandle handle = { fd, (DType) msg.dtype, msg.storage_size, msg.offset, msg.size, msg.stride };
+    *t = tensor_import(&handle);
+    close(fd);
+    return *t != NULL ? 1 : -1;
+}
+
+// ----------------------------------------------------------------------------
+// collectives across local processes (all_reduce, broadcast, all_gather), through one
+// shared memory segment: a small header with the barrier, then a buffer of capacity
+// floats per rank. The creator makes the segment; every other process joins it through
+// its fd (inherited over fork, or passed like in tensor_send) with its own rank.
+
+#define GROUP_ALIGN 64
+#define BARRIER_SPINS 4096
+
+typedef struct {
+    int32_t world_size;
+    int32_t capacity;
+    atomic_uint arrived;    // ranks at the barrier
+    atomic_uint generation; // bumped every time the barrier opens, the futex word
+} GroupHeader;
+
+struct ProcessGroup {
+    int fd;
+    int rank;
+    int world_size;
+    int capacity;
+    GroupHeader* header;
+    float* buffers; // world_size buffers of capacity floats
+    size_t map_size;
+};
+
+size_t group_buffer_stride(int capacity) {
+    // whole cache lines per rank, so ranks never write to the same line
+    return ((size_t) capacity * sizeof(float) + GROUP_ALIGN - 1) / GROUP_ALIGN * GROUP_ALIGN / sizeof(float);
+}
+
+size_t group_map_size(int world_size, int capacity) {
+    return GROUP_ALIGN + (size_t) world_size * group_buffer_stride(capacity) * sizeof(float);
+}
+
+float* group_buffer(ProcessGroup* g, int rank) {
+    return g->buffers + (size_t) rank * group_buffer_stride(g->capacity);
+}
+
+ProcessGroup* group_map(int fd, int rank, int world_size, int capacity) {
+    size_t map_size = group_map_size(world_size, capacity);
+    void* mapping = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "OSError: cannot map the process group\n");
+        close(fd);
+        return NULL;
+    }
+    ProcessGroup* g = mallocCheck(sizeof(ProcessGroup));
+    g->fd = fd;
+    g->rank = rank;
+    g->world_size = world_size;
+    g->capacity = capacity;
+    g->header = mapping;
+    g->buffers = (float*) ((char*) mapping + GROUP_ALIGN);
+    g->map_size = map_size;
+    return g;
+}
+
+// A new group of world_size processes, with the caller as rank 0. Collectives move up
+// to capacity elements per round, bigger tensors take several.
+ProcessGroup* tensor_group_new(int world_size, int capacity) {
+    if (world_size < 1 || capacity < 1) {
+        fprintf(stderr, "ValueError: a process group needs world_size >= 1 and capacity >= 1\n");
+        return NULL;
+    }
+    int fd = shared_fd_new(group_map_size(world_size, capacity));
+    if (fd < 0) { return NULL; }
+    ProcessGroup* g = group_map(fd, 0, world_size, capacity);
+    if (g == NULL) { return NULL; }
+    // the memfd starts zeroed, so the barrier is already reset
+    g->header->world_size = world_size;
+    g->header->capacity = capacity;
+    return g;
+}
+
+// joins the group whose segment is fd (the caller keeps owning fd) as rank
+ProcessGroup* tensor_group_join(int fd, int rank) {
+    GroupHeader header;
+    if (pread(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header) || header.world_size < 1) {
+        fprintf(stderr, "ValueError: fd %d is not a process group\n", fd);
+        return NULL;
+    }
+    if (rank < 0 || rank >= header.world_size) {
+        fprintf(stderr, "ValueError: rank %d is outside a group of %d\n", rank, header.world_size);
+        return NULL;
+    }
+    int own_fd = dup(fd);
+    if (own_fd < 0) {
+        fprintf(stderr, "OSError: bad file descriptor %d\n", fd);
+        return NULL;
+    }
+    return group_map(own_fd, rank, header.world_size, header.capacity);
+}
+
+int tensor_group_fd(ProcessGroup* g) { return g->fd; }
+int tensor_group_rank(ProcessGroup* g) { return g->rank; }
+int tensor_group_world_size(ProcessGroup* g) { return g->world_size; }
+
+void tensor_group_free(ProcessGroup* g) {
+    munmap(g->header, g->map_size);
+    close(g->fd);
+    free(g);
+}
+
+// waits until every rank of the group got here. Spins a little first, since the other
+// ranks are usually close behind, then sleeps on a futex on the shared generation
+void group_barrier(ProcessGroup* g) {
+    GroupHeader* h = g->header;
+    unsigned generation = atomic_load(&h->generation);
+    if (atomic_fetch_add(&h->arrived, 1) == (unsigned) g->world_size - 1) {
+        // last one in: reset for next time and let everyone go
+        atomic_store(&h->arrived, 0);
+        atomic_fetch_add(&h->generation, 1);
+#ifdef __linux__
+        syscall(SYS_futex, &h->generation, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+        return;
+    }
+    for (int i = 0; i < BARRIER_SPINS; i++) {
+        if (atomic_load(&h->generation) != generation) { return; }
+    }
+    while (atomic_load(&h->generation) == generation) {
+#ifdef __linux__
+        // not FUTEX_PRIVATE_FLAG: the waiters are in other processes
+        syscall(SYS_futex, &h->generation, FUTEX_WAIT, generation, NULL, NULL, 0);
+#else
+        sched_yield();
+#endif
+    }
+}
+
+// copies elements [start, start + n) of t into dst
+void group_load(Tensor* t, int start, int n, float* dst) {
+    const float* in = tensor_load_floats(t, start, n, dst);
+    if (in != dst) { memcpy(dst, in, n * sizeof(float)); }
+}
+
+// copies n floats from src into elements [start, start + n) of t
+void group_store(Tensor* t, int start, int n, const float* src) {
+    if (t->stride == 1) {
+        memcpy((float*) t->storage->data + logical_to_physical(t, start), src, n * sizeof(float));
+        return;
+    }
+    for (int i = 0; i < n; i++) { storage_store(t->storage, logical_to_physical(t, start + i), src[i]); }
+}
+
+bool group_check(ProcessGroup* g, Tensor* t) {
+    if (tensor_dtype(t) != DTYPE_FLOAT32) {
+        fprintf(stderr, "ValueError: collectives work on float32 tensors\n");
+        return false;
+    }
+    return true;
+}
+
+// the sum of t over all ranks, into t on every rank. Every rank must call it, with
+// tensors of the same size. Reduce-scatter then all-gather: each rank sums just its own
+// 1/world_size of the elements, then everybody copies out all the sums, so the work per
+// rank shrinks as the group grows.
+bool tensor_all_reduce_sum_(ProcessGroup* g, Tensor* t) {
+    if (!group_check(g, t) || !tensor_check_writable(t)) { return false; }
+    int world = g->world_size;
+    for (int start = 0; start < t->size; start += g->capacity) {
+        int n = min(g->capacity, t->size - start);
+        group_load(t, start, n, group_buffer(g, g->rank));
+        group_barrier(g);
+        // reduce-scatter: this rank's segment, in whole cache lines
+        int segment = ceil_div(ceil_div(n, world), GROUP_ALIGN / sizeof(float)) * (GROUP_ALIGN / sizeof(float));
+        int lo = min(g->rank * segment, n), hi = min(lo + segment, n);
+        // a block at a time, so the adds vectorize
+        for (int block = lo; block < hi; block += BLOCK_SIZE) {
+            int m = min(BLOCK_SIZE, hi - block);
+            float acc[BLOCK_SIZE];
+            memcpy(acc, group_buffer(g, 0) + block, m * sizeof(float));
+            for (int r = 1; r < world; r++) {
+                const float* other = group_buffer(g, r) + block;
+                for (int i = 0; i < m; i++) { acc[i] += other[i]; }
+            }
+            memcpy(group_buffer(g, g->rank) + block, acc, m * sizeof(float));
+        }
+        group_barrier(g);
+        // all-gather: every segment from the rank that summed it
+        for (int r = 0; r < world; r++) {
+            int rlo = min(r * segment, n), rhi = min(rlo + segment, n);
+            if (rhi > rlo) { group_store(t, start + rlo, rhi - rlo, group_buffer(g, r) + rlo); }
+        }
+        // nobody refills their buffer until everyone has copied out of it
+        group_barrier(g);
+    }
+    return true;
+}
+
+// copies t on rank root into t on every other rank
+bool tensor_broadcast_(ProcessGroup* g, Tensor* t, int root) {
+    if (root < 0 || root >= g->world_size) {
+        fprintf(stderr, "ValueError: root %d is outside a group of %d\n", root, g->world_size);
+        return false;
+    }
+    if (!group_check(g, t) || !tensor_check_writable(t)) { return false; }
+    for (int start = 0; start < t->size; start += g->capacity) {
+        int n = min(g->capacity, t->size - start);
+        if (g->rank == root) { group_load(t, start, n, group_buffer(g, root)); }
+        group_barrier(g);
+        if (g->rank != root) { group_store(t, start, n, group_buffer(g, root)); }
+        group_barrier(g);
+    }
+    return true;
+}
+
+// out = the t of every rank, one after the other in rank order; out needs world_size
+// times as many elements as t
+bool tensor_all_gather(ProcessGroup* g, Tensor* t, Tensor* out) {
+    if (out->size != t->size * g->world_size) {
+        fprintf(stderr, "ValueError: all_gather of %d elements over %d ranks needs an output of %d, not %d\n",
+                t->size, g->world_size, t->size * g->world_size, out->size);
+        return false;
+    }
+    if (!group_check(g, t) || !group_check(g, out) || !tensor_check_writable(out)) { return false; }
+    for (int start = 0; start < t->size; start += g->capacity) {
+        int n = min(g->capacity, t->size - start);
+        group_load(t, start, n, group_buffer(g, g->rank));
+        group_barrier(g);
+        for (int r = 0; r < g->world_size; r++) { group_store(out, r * t->size + start, n, group_buffer(g, r)); }
+        group_barrier(g);
+    }
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// text ingestion: parsing a dump of numbers (CSV, or whitespace separated) into a tensor
+
+// Correctly rounded decimal -> float32, after the Eisel-Lemire algorithm (as in
+// fast_float, Lemire 2021): multiply the decimal mantissa by a 128-bit truncation of the
+// power of ten and read the float straight off the top bits of the product. Inputs it
+// can't settle (more than 19 digits, or the rare ambiguous products) go to strtof.
+
+#define FLOAT_SMALLEST_POWER_OF_TEN -65
+#define FLOAT_LARGEST_POWER_OF_TEN 38
+
+// 5^q for q in [-65, 38], normalized to 128 bits and truncated, as {high, low}
+const uint64_t POW5_128[][2] = {
+    {0x86ccbb52ea94baeau, 0x98e947129fc2b4e9u},
+    {0xa87fea27a539e9a5u, 0x3f2398d747b36224u},
+    {0xd29fe4b18e88640eu, 0x8eec7f0d19a03aadu},
+    {0x83a3eeeef9153e89u, 0x1953cf68300424acu},
+    {0xa48ceaaab75a8e2bu, 0x5fa8c3423c052dd7u},
+    {0xcdb02555653131b6u, 0x3792f412cb06794du},
+    {0x808e17555f3ebf11u, 0xe2bbd88bbee40bd0u},
+    {0xa0b19d2ab70e6ed6u, 0x5b6aceaeae9d0ec4u},
+    {0xc8de047564d20a8bu, 0xf245825a5a445275u},
+    {0xfb158592be068d2eu, 0xeed6e2f0f0d56712u},
+    {0x9ced737bb6c4183du, 0x55464dd69685606bu},
+    {0xc428d05aa4751e4cu, 0xaa97e14c3c26b886u},
+    {0xf53304714d9265dfu, 0xd53dd99f4b3066a8u},
+    {0x993fe2c6d07b7fabu, 0xe546a8038efe4029u},
+    {0xbf8fdb78849a5f96u, 0xde98520472bdd033u},
+    {0xef73d256a5c0f77cu, 0x963e66858f6d4440u},
+    {0x95a8637627989aadu, 0xdde7001379a44aa8u},
+    {0xbb127c53b17ec159u, 0x5560c018580d5d52u},
+    {0xe9d71b689dde71afu, 0xaab8f01e6e10b4a6u},
+    {0x9226712162ab070du, 0xcab3961304ca70e8u},
+    {0xb6b00d69bb55c8d1u, 0x3d607b97c5fd0d22u},
+    {0xe45c10c42a2b3b05u, 0x8cb89a7db77c506au},
+    {0x8eb98a7a9a5b04e3u, 0x77f3608e92adb242u},
+    {0xb267ed1940f1c61cu, 0x55f038b237591ed3u},
+    {0xdf01e85f912e37a3u, 0x6b6c46dec52f6688u},
+    {0x8b61313bbabce2c6u, 0x2323ac4b3b3da015u},
+    {0xae397d8aa96c1b77u, 0xabec975e0a0d081au},
+    {0xd9c7dced53c72255u, 0x96e7bd358c904a21u},
+    {0x881cea14545c7575u, 0x7e50d64177da2e54u},
+    {0xaa242499697392d2u, 0xdde50bd1d5d0b9e9u},
+    {0xd4ad2dbfc3d07787u, 0x955e4ec64b44e864u},
+    {0x84ec3c97da624ab4u, 0xbd5af13bef0b113eu},
+    {0xa6274bbdd0fadd61u, 0xecb1ad8aeacdd58eu},
+    {0xcfb11ead453994bau, 0x67de18eda5814af2u},
+    {0x81ceb32c4b43fcf4u, 0x80eacf948770ced7u},
+    {0xa2425ff75e14fc31u, 0xa1258379a94d028du},
+    {0xcad2f7f5359a3b3eu, 0x096ee45813a04330u},
+    {0xfd87b5f28300ca0du, 0x8bca9d6e188853fcu},
+    {0x9e74d1b791e07e48u, 0x775ea264cf55347eu},
+    {0xc612062576589ddau, 0x95364afe032a819eu},
+    {0xf79687aed3eec551u, 0x3a83ddbd83f52205u},
+    {0x9abe14cd44753b52u, 0xc4926a9672793543u},
+    {0xc16d9a0095928a27u, 0x75b7053c0f178294u},
+    {0xf1c90080baf72cb1u, 0x5324c68b12dd6339u},
+    {0x971da05074da7beeu, 0xd3f6fc16ebca5e04u},
+    {0xbce5086492111aeau, 0x88f4bb1ca6bcf585u},
+    {0xec1e4a7db69561a5u, 0x2b31e9e3d06c32e6u},
+    {0x9392ee8e921d5d07u, 0x3aff322e62439fd0u},
+    {0xb877aa3236a4b449u, 0x09befeb9fad487c3u},
+    {0xe69594bec44de15bu, 0x4c2ebe687989a9b4u},
+    {0x901d7cf73ab0acd9u, 0x0f9d37014bf60a11u},
+    {0xb424dc35095cd80fu, 0x538484c19ef38c95u},
+    {0xe12e13424bb40e13u, 0x2865a5f206b06fbau},
+    {0x8cbccc096f5088cbu, 0xf93f87b7442e45d4u},
+    {0xafebff0bcb24aafeu, 0xf78f69a51539d749u},
+    {0xdbe6fecebdedd5beu, 0xb573440e5a884d1cu},
+    {0x89705f4136b4a597u, 0x31680a88f8953031u},
+    {0xabcc77118461cefcu, 0xfdc20d2b36ba7c3eu},
+    {0xd6bf94d5e57a42bcu, 0x3d32907604691b4du},
+    {0x8637bd05af6c69b5u, 0xa63f9a49c2c1b110u},
+    {0xa7c5ac471b478423u, 0x0fcf80dc33721d54u},
+    {0xd1b71758e219652bu, 0xd3c36113404ea4a9u},
+    {0x83126e978d4fdf3bu, 0x645a1cac083126eau},
+    {0xa3d70a3d70a3d70au, 0x3d70a3d70a3d70a4u},
+    {0xccccccccccccccccu, 0xcccccccccccccccdu},
+    {0x8000000000000000u, 0x0000000000000000u},
+    {0xa000000000000000u, 0x0000000000000000u},
+    {0xc800000000000000u, 0x0000000000000000u},
+    {0xfa00000000000000u, 0x0000000000000000u},
+    {0x9c40000000000000u, 0x0000000000000000u},
+    {0xc350000000000000u, 0x0000000000000000u},
+    {0xf424000000000000u, 0x0000000000000000u},
+    {0x9896800000000000u, 0x0000000000000000u},
+    {0xbebc200000000000u, 0x0000000000000000u},
+    {0xee6b280000000000u, 0x0000000000000000u},
+    {0x9502f90000000000u, 0x0000000000000000u},
+    {0xba43b74000000000u, 0x0000000000000000u},
+    {0xe8d4a51000000000u, 0x0000000000000000u},
+    {0x9184e72a00000000u, 0x0000000000000000u},
+    {0xb5e620f480000000u, 0x0000000000000000u},
+    {0xe35fa931a0000000u, 0x0000000000000000u},
+    {0x8e1bc9bf04000000u, 0x0000000000000000u},
+    {0xb1a2bc2ec5000000u, 0x0000000000000000u},
+    {0xde0b6b3a76400000u, 0x0000000000000000u},
+    {0x8ac7230489e80000u, 0x0000000000000000u},
+    {0xad78ebc5ac620000u, 0x0000000000000000u},
+    {0xd8d726b7177a8000u, 0x0000000000000000u},
+    {0x878678326eac9000u, 0x0000000000000000u},
+    {0xa968163f0a57b400u, 0x0000000000000000u},
+    {0xd3c21bcecceda100u, 0x0000000000000000u},
+    {0x84595161401484a0u, 0x0000000000000000u},
+    {0xa56fa5b99019a5c8u, 0x0000000000000000u},
+    {0xcecb8f27f4200f3au, 0x0000000000000000u},
+    {0x813f3978f8940984u, 0x4000000000000000u},
+    {0xa18f07d736b90be5u, 0x5000000000000000u},
+    {0xc9f2c9cd04674edeu, 0xa400000000000000u},
+    {0xfc6f7c4045812296u, 0x4d00000000000000u},
+    {0x9dc5ada82b70b59du, 0xf020000000000000u},
+    {0xc5371912364ce305u, 0x6c28000000000000u},
+    {0xf684df56c3e01bc6u, 0xc732000000000000u},
+    {0x9a130b963a6c115cu, 0x3c7f400000000000u},
+    {0xc097ce7bc90715b3u, 0x4b9f100000000000u},
+    {0xf0bdc21abb48db20u, 0x1e86d40000000000u},
+    {0x96769950b50d88f4u, 0x1314448000000000u},
+};
+
+// computes the float32 for w * 10^q into *out; false if it can't be sure
+bool eisel_lemire(uint64_t w, int q, float* out) {
+    uint32_t bits;
+    if (w == 0 || q < FLOAT_SMALLEST_POWER_OF_TEN) {
+        bits = 0;
+    } else if (q > FLOAT_LARGEST_POWER_OF_TEN) {
+        bits = 0xFFu << FLOAT_MANTISSA_BITS; // inf
+    } else {
+        int lz = __builtin_clzll(w);
+        w <<= lz;
+        // the product, to just enough bits: the second half of the power only matters
+        // if the bits below the 26 we need are all ones, and might carry into them
+        const uint64_t* pow5 = POW5_128[q - FLOAT_SMALLEST_POWER_OF_TEN];
+        __uint128_t product = (__uint128_t) w * pow5[0];
+        uint64_t high = (uint64_t) (product >> 64), low = (uint64_t) product;
+        uint64_t precision_mask = ~(uint64_t) 0 >> (FLOAT_MANTISSA_BITS + 3);
+        if ((high & precision_mask) == precision_mask) {
+            uint64_t second = (uint64_t) (((__uint128_t) w * pow5[1]) >> 64);
+            low += second;
+            if (second > low) { high++; }
+        }
+        if (low == ~(uint64_t) 0 && (q < -27 || q > 55)) { return false; }
+        int upperbit = (int) (high >> 63);
+        int shift = upperbit + 64 - FLOAT_MANTISSA_BITS - 3;
+        uint64_t mantissa = high >> shift;
+        int power2 = (((152170 + 65536) * q) >> 16) + 63 + upperbit - lz + FLOAT_BIAS;
+        if (power2 <= 0) {
+            // subnormal (or zero)
+            if (-power2 + 1 >= 64) {
+                mantissa = 0;
+            } else {
+                mantissa >>= -power2 + 1;
+                mantissa += mantissa & 1;
+                mantissa >>= 1;
+            }
+            power2 = mantissa < ((uint64_t) 1 << FLOAT_MANTISSA_BITS) ? 0 : 1;
+        } else {
+            // exactly halfway between two floats: round to even
+            if (low <= 1 && q >= -17 && q <= 10 && (mantissa & 3) == 1 && (mantissa << shift) == high) {
+                mantissa &= ~(uint64_t) 1;
+            }
+            mantissa += mantissa & 1;
+            mantissa >>= 1;
+            if (mantissa >= ((uint64_t) 2 << FLOAT_MANTISSA_BITS)) {
+                mantissa = (uint64_t) 1 << FLOAT_MANTISSA_BITS;
+                power2++;
+            }
+            mantissa &= ~((uint64_t) 1 << FLOAT_MANTISSA_BITS);
+            if (power2 >= 0xFF) { power2 = 0xFF; mantissa = 0; }
+        }
+        bits = (uint32_t) power2 << FLOAT_MANTISSA_BITS | (uint32_t) mantissa;
+    }
+    memcpy(out, &bits, sizeof(bits));
+    return true;
+}
+
+bool is_separator(char c, char delimiter) {
+    return c == delimiter || c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// parses the number at [p, end) up to the next separator into *out, returns the pointer
+// after it, or NULL if that isn't a number
+const char* parse_float(const char* p, const char* end, char delimiter, float* out) {
+    const char* start = p;
+    bool negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) { p++; }
+    uint64_t w = 0;
+    int digits = 0, exponent = 0; // significant digits seen, and the power of ten of the last one
+    bool any = false;
+    while (p < end && *p == '0') { p++; any = true; } // leading zeros don't count
+    for (; p < end && *p >= '0' && *p <= '9'; p++, any = true) {
+        if (digits < 19) { w = 10 * w + (uint64_t) (*p - '0'); } else { exponent++; }
+        digits++;
+    }
+    if (p < end && *p == '.') {
+        p++;
+        if (digits == 0) {
+            while (p < end && *p == '0') { p++; exponent--; any = true; }
+        }
+        for (; p < end && *p >= '0' && *p <= '9'; p++, any = true) {
+            if (digits < 19) { w = 10 * w + (uint64_t) (*p - '0'); exponent--; }
+            digits++;
+        }
+    }
+    if (any && p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        bool negative_exp = p < end && *p == '-';
+        if (p < end && (*p == '-' || *p == '+')) { p++; }
+        if (p == end || *p < '0' || *p > '9') { return NULL; }
+        int e = 0;
+        for (; p < end && *p >= '0' && *p <= '9'; p++) {
+            if (e < 100000) { e = 10 * e + (*p - '0'); }
+        }
+        exponent += negative_exp ? -e : e;
+    }
+    bool done = any && (p == end || is_separator(*p, delimiter));
+    if (done && digits <= 19 && eisel_lemire(w, exponent, out)) {
+        if (negative) { *out = -*out; }
+        return p;
+    }
+    // everything else (nan, inf, very long mantissas): let strtof sort it out
+    while (p < end && !is_separator(*p, delimiter)) { p++; }
+    char token[64];
+    size_t n = (size_t) (p - start);
+    if (n >= sizeof(token)) {
+        char* long_token = mallocCheck(n + 1);
+        memcpy(long_token, start, n);
+        long_token[n] = '\0';
+        char* parsed;
+        *out = strtof(long_token, &parsed);
+        bool ok = parsed == long_token + n && n > 0;
+        free(long_token);
+        return ok ? p : NULL;
+    }
+    memcpy(token, start, n);
+    token[n] = '\0';
+    char* parsed;
+    *out = strtof(token, &parsed);
+    return parsed == token + n && n > 0 ? p : NULL;
+}
+
+// the number of tokens (runs of non-separators) in the text, 16 bytes at a time with SSE2
+size_t count_tokens(const char* text, size_t len, char delimiter) {
+    size_t count = 0, i = 0;
+    uint32_t prev_separator = 1;
+#ifdef __SSE2__
+    const __m128i delim = _mm_set1_epi8(delimiter), space = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t');
+    const __m128i newline = _mm_set1_epi8('\n'), carriage = _mm_set1_epi8('\r');
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (text + i));
+        __m128i sep = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, delim), _mm_cmpeq_epi8(v, space)),
+                                   _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, tab), _mm_cmpeq_epi8(v, newline)),
+                                                _mm_cmpeq_epi8(v, carriage)));
+        uint32_t separators = (uint32_t) _mm_movemask_epi8(sep);
+        // a token starts at each non-separator that follows a separator
+        uint32_t starts = ~separators & ((separators << 1) | prev_separator) & 0xFFFF;
+        count += (size_t) __builtin_popcount(starts);
+        prev_separator = separators >> 15;
+    }
+#endif
+    for (; i < len; i++) {
+        uint32_t separator = is_separator(text[i], delimiter);
+        count += !separator && prev_separator;
+        prev_separator = separator;
+    }
+    return count;
+}
+
+// Parses the numbers in text (len bytes) into a new float32 tensor. Numbers are separated
+// by delimiter (e.g. ',') and/or whitespace, so one per line, CSV rows, and space
+// separated dumps all work; a delimiter of '\0' means whitespace only. Runs of whitespace
+// collapse, but delimiters don't: an empty field, as in "1,,2", is an error. Counts the
+// numbers first, so that the Storage is allocated once, at its exact size.
+Tensor* tensor_from_text(const char* text, size_t len, char delimiter) {
+    size_t count = count_tokens(text, len, delimiter);
+    if (count > INT32_MAX) {
+        fprintf(stderr, "ValueError: %zu numbers do not fit in a tensor\n", count);
+        return NULL;
+    }
+    Tensor* t = tensor_empty((int) count);
+    float* out = t->storage->data;
+    const char* p = text;
+    const char* end = text + len;
+    bool in_field = false; // whether a number was read since the last delimiter
+    for (size_t i = 0; i <= count; i++) {
+        // skip to the next number (or, after the last one, to the end of the text)
+        for (; p < end && is_separator(*p, delimiter); p++) {
+            if (*p != delimiter || delimiter == '\0') { continue; }
+            if (!in_field) {
+                fprintf(stderr, "ValueError: could not convert '' to float\n");
+                tensor_free(t);
+                return NULL;
+            }
+            in_field = false;
+        }
+        if (i == count) { break; }
+        const char* next = parse_float(p, end, delimiter, &out[i]);
+        if (next == NULL) {
+            const char* token_end = p;
+            while (token_end < end && !is_separator(*token_end, delimiter)) { token_end++; }
+            fprintf(stderr, "ValueError: could not convert '%.*s' to float\n", (int) min(token_end - p, 64), p);
+            tensor_free(t);
+            return NULL;
+        }
+        p = next;
+        in_field = true;
+    }
+    return t;
+}
+
+// tensor_from_text, on the contents of the file at path (which are mapped, not read)
+Tensor* tensor_from_text_file(const char* path, char delimiter) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "OSError: cannot open %s\n", path);
+        if (fd >= 0) { close(fd); }
+        return NULL;
+    }
+    size_t len = (size_t) st.st_size;
+    if (len == 0) {
+        close(fd);
+        return tensor_empty(0);
+    }
+    void* text = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED) {
+        fprintf(stderr, "OSError: cannot mmap %s\n", path);
+        return NULL;
+    }
+    madvise(text, len, MADV_SEQUENTIAL);
+    Tensor* t = tensor_from_text(text, len, delimiter);
+    munmap(text, len);
+    return t;
+}
+
+// ----------------------------------------------------------------------------
+// save / load: a simple file format for several named tensors, laid out so that
+// loading is just an mmap of each tensor's data (see tensor_mmap)
+//
+// - 16 byte header: the magic "TENSOR1D", uint32 version, uint32 number of tensors
+// - a TensorFileEntry (128 bytes) per tensor: name, dtype, size, stride, data offset
+// - the raw data of each tensor (native byte order), starting on a 64-byte boundary
+//
+// Bool tensors are stored the same way as in memory, packed into uint64_t words.
+
+#define TENSOR_FILE_MAGIC "TENSOR1D"
+#define TENSOR_FILE_VERSION 1
+#define TENSOR_FILE_ALIGN 64
+// strided views are written out through a contiguous chunk of this many elements
+#define SAVE_CHUNK_SIZE 65536
+
+// writes the elements of t to f, contiguously, without first making a contiguous copy of t
+bool tensor_write_data(Tensor* t, FILE* f) {
+    DType dtype = tensor_dtype(t);
+    size_t nbytes = storage_nbytes(t->size, dtype);
+    if (t->stride == 1 && (dtype != DTYPE_BOOL || t->offset % 64 == 0)) {
+        // already laid out like the file wants it: straight from the Storage
+        const char* data = (const char*) t->storage->data + storage_byte_offset(t->storage, t->offset);
+        return fwrite(data, 1, nbytes, f) == nbytes;
+    }
+    // strided (or reversed, or misaligned bools): stream it out a chunk at a time
+    Tensor* chunk = tensor_empty_dtype(min(SAVE_CHUNK_SIZE, t->size), dtype);
+    bool ok = true;
+    for (int start = 0; start < t->size && ok; start += SAVE_CHUNK_SIZE) {
+        int n = min(SAVE_CHUNK_SIZE, t->size - start);
+        Tensor* src = tensor_view(t, logical_to_physical(t, start), n, t->stride);
+        Tensor* dst = tensor_view(chunk, 0, n, 1);
+        copy_kernel(dst, src);
+        size_t chunk_bytes = storage_nbytes(n, dtype);
+        ok = fwrite(chunk->storage->data, 1, chunk_bytes, f) == chunk_bytes;
+        tensor_free(dst);
+        tensor_free(src);
+    }
+    tensor_free(chunk);
+    return ok;
+}
+
+// torch.save({names[i]: tensors[i]}, path)
+bool tensor_save(const char* path, const char** names, Tensor** tensors, int count) {
+    TensorFileEntry* entries = mallocCheck((count + 1) * sizeof(TensorFileEntry));
+    memset(entries, 0, (count + 1) * sizeof(TensorFileEntry));
+    uint64_t offset = 16 + (uint64_t) count * sizeof(TensorFileEntry);
+    for (int i = 0; i < count; i++) {
+        if (strlen(names[i]) >= sizeof(entries[i].name)) {
+            fprintf(stderr, "ValueError: tensor name %s is too long\n", names[i]);
+            free(entries);
+            return false;
+        }
+        strcpy(entries[i].name, names[i]);
+        entries[i].dtype = tensor_dtype(tensors[i]);
+        entries[i].size = tensors[i]->size;
+        entries[i].stride = 1;
+        offset = (offset + TENSOR_FILE_ALIGN - 1) / TENSOR_FILE_ALIGN * TENSOR_FILE_ALIGN;
+        entries[i].data_offset = offset;
+        offset += storage_nbytes(tensors[i]->size, tensor_dtype(tensors[i]));
+    }
+    FILE* f = fopen(path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "OSError: cannot open %s for writing\n", path);
+        free(entries);
+        return false;
+    }
+    setvbuf(f, NULL, _IOFBF, 1 << 20); // big writes, so we go at disk speed
+    uint32_t header[2] = { TENSOR_FILE_VERSION, (uint32_t) count };
+    bool ok = fwrite(TENSOR_FILE_MAGIC, 1, 8, f) == 8 && fwrite(header, sizeof(header), 1, f) == 1;
+    ok = ok && (count == 0 || fwrite(entries, sizeof(TensorFileEntry), count, f) == (size_t) count);
+    char padding[TENSOR_FILE_ALIGN] = {0};
+    for (int i = 0; i < count && ok; i++) {
+        long pad = (long) entries[i].data_offset - ftell(f);
+        ok = pad >= 0 && fwrite(padding, 1, pad, f) == (size_t) pad;
+        ok = ok && tensor_write_data(tensors[i], f);
+    }
+    ok = fclose(f) == 0 && ok;
+    if (!ok) { fprintf(stderr, "OSError: failed writing %s\n", path); }
+    free(entries);
+    return ok;
+}
+
+// reads the table of contents of the tensor file at path into entries (up to capacity
+// of them) and returns the number of tensors in the file, or -1 if it isn't one
+int tensor_file_entries(const char* path, TensorFileEntry* entries, int capacity) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "OSError: cannot open %s\n", path);
+        return -1;
+    }
+    char magic[8];
+    uint32_t header[2];
+    if (fread(magic, 1, 8, f) != 8 || memcmp(magic, TENSOR_FILE_MAGIC, 8) != 0 ||
+        fread(header, sizeof(header), 1, f) != 1 || header[0] != TENSOR_FILE_VERSION) {
+        fprintf(stderr, "ValueError: %s is not a tensor file\n", path);
+        fclose(f);
+        return -1;
+    }
+    int count = (int) header[1];
+    int n = entries == NULL ? 0 : min(count, capacity);
+    if (n > 0 && fread(entries, sizeof(TensorFileEntry), n, f) != (size_t) n) {
+        fprintf(stderr, "ValueError: %s is truncated\n", path);
+        count = -1;
+    }
+    fclose(f);
+    return count;
+}
+
+// torch.load(path)[name], except that nothing is read: the tensor's data is memory-mapped
+Tensor* tensor_load(const char* path, const char* name, MmapMode mode) {
+    int count = tensor_file_entries(path, NULL, 0);
+    if (count < 0) { return NULL; }
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        fprintf(stderr, "OSError: cannot stat %s\n", path);
+        return NULL;
+    }
+    uint64_t file_size = (uint64_t) st.st_size;
+    TensorFileEntry* entries = mallocCheck((count + 1) * sizeof(TensorFileEntry));
+    count = tensor_file_entries(path, entries, count);
+    Tensor* t = NULL;
+    bool found = false;
+    for (int i = 0; i < count && !found; i++) {
+        TensorFileEntry* e = &entries[i];
+        if (strncmp(e->name, name, sizeof(e->name)) != 0) { continue; }
+        found = true;
+        if (e->dtype > DTYPE_BOOL || e->size < 0 || e->stride < 1) {
+            fprintf(stderr, "ValueError: invalid entry for %s in %s\n", name, path);
+            continue;
+        }
+        // map the span of the data, then view it with the stored stride. The fields come
+        // straight from the file, so the span must fit an int and the file before we map
+        int64_t span = e->size > 0 ? (int64_t) (e->size - 1) * e->stride + 1 : 0;
+        if (span > INT_MAX || e->data_offset > file_size ||
+            storage_nbytes((int) span, (DType) e->dtype) > file_size - e->data_offset) {
+            fprintf(stderr, "ValueError: entry for %s reaches past the end of %s\n", name, path);
+            continue;
+        }
+        Tensor* base = tensor_mmap(path, e->data_offset, (int) span, (DType) e->dtype, mode);
+        if (base != NULL && e->stride != 1) {
+            t = tensor_view(base, 0, e->size, e->stride);
+            tensor_free(base);
+        } else {
+            t = base;
+        }
+    }
+    if (!found) { fprintf(stderr, "KeyError: no tensor %s in %s\n", name, path); }
+    free(entries);
+    return t;
+}
+
+// ----------------------------------------------------------------------------
+// .npy and safetensors: the formats numpy and the safetensors library write. Both keep
+// the raw elements of a tensor in one run of the file, so loading is tensor_mmap when
+// the run is aligned for its dtype, and one bulk read otherwise. Both store bools one
+// byte each, so those are always read (and packed into bits) or written a chunk at a
+// time. Multi-dimensional arrays are flattened, the only shape a tensor1d can have.
+// Everything is little-endian, as on the machines we run on.
+
+// reads nbytes at byte_offset of fd into buf, returns false on error or a short file
+bool pread_full(int fd, void* buf, size_t nbytes, size_t byte_offset) {
+    char* p = buf;
+    while (nbytes > 0) {
+        ssize_t n = pread(fd, p, nbytes, (off_t) byte_offset);
+        if (n <= 0) { return false; }
+        p += n;
+        nbytes -= (size_t) n;
+        byte_offset += (size_t) n;
+    }
+    return true;
+}
+
+// the size elements at byte_offset of path: zero-copy when we can, one copy when we can't.
+// With bool_bytes, bools are one byte each in the file and get packed into bits.
+Tensor* tensor_read_file(const char* path, size_t byte_offset, int size, DType dtype, bool bool_bytes, MmapMode mode) {
+    size_t alignment = dtype == DTYPE_BOOL ? sizeof(uint64_t) : dtype_itemsize(dtype);
+    if (!(dtype == DTYPE_BOOL && bool_bytes) && byte_offset % alignment == 0) {
+        return tensor_mmap(path, byte_offset, size, dtype, mode);
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "OSError: cannot open %s\n", path);
+        return NULL;
+    }
+    Tensor* t = tensor_empty_dtype(size, dtype);
+    bool ok = true;
+    if (dtype != DTYPE_BOOL || !bool_bytes) {
+        // misaligned: a single read of all of it
+        ok = pread_full(fd, t->storage->data, storage_nbytes(size, dtype), byte_offset);
+    } else {
+        uint64_t* words = t->storage->data;
+        uint8_t* bytes = mallocCheck(min(SAVE_CHUNK_SIZE, size) + 1);
+        for (int start = 0; start < size && ok; start += SAVE_CHUNK_SIZE) {
+            int n = min(SAVE_CHUNK_SIZE, size - start);
+            ok = pread_full(fd, bytes, n, byte_offset + start);
+            for (int i = 0; i < n && ok; i += 64) {
+                uint64_t word = 0;
+                for (int j = 0; j < min(64, n - i); j++) { word |= (uint64_t) (bytes[i + j] != 0) << j; }
+                words[(start + i) / 64] = word;
+            }
+        }
+        free(bytes);
+    }
+    close(fd);
+    if (!ok) {
+        fprintf(stderr, "ValueError: %s is too small for %d elements at byte offset %zu\n", path, size, byte_offset);
+        tensor_free(t);
+        return NULL;
+    }
+    // same contract as a mapping, even though this one happens to be a copy
+    t->storage->readonly = mode == MMAP_READONLY;
+    return t;
+}
+
+// writes the elements of a bool tensor to f as one byte each
+bool tensor_write_bool_bytes(Tensor* t, FILE* f) {
+    uint8_t* bytes = mallocCheck(min(SAVE_CHUNK_SIZE, t->size) + 1);
+    bool ok = true;
+    for (int start = 0; start < t->size && ok; start += SAVE_CHUNK_SIZE) {
+        int n = min(SAVE_CHUNK_SIZE, t->size - start);
+        for (int i = 0; i < n; i += 64) {
+            uint64_t word = tensor_load_bits(t, start + i);
+            for (int j = 0; j < min(64, n - i); j++) { bytes[i + j] = (word >> j) & 1; }
+        }
+        ok = fwrite(bytes, 1, n, f) == (size_t) n;
+    }
+    free(bytes);
+    return ok;
+}
+
+// the number of bytes t takes up in a .npy or safetensors file
+size_t file_nbytes(Tensor* t) {
+    DType dtype = tensor_dtype(t);
+    return dtype == DTYPE_BOOL ? (size_t) t->size : storage_nbytes(t->size, dtype);
+}
+
+bool tensor_write_file_data(Tensor* t, FILE* f) {
+    return tensor_dtype(t) == DTYPE_BOOL ? tensor_write_bool_bytes(t, f) : tensor_write_data(t, f);
+}
+
+// the product of a shape, or -1 if it doesn't fit in a tensor
+int64_t shape_numel(const int64_t* shape, int ndim) {
+    int64_t numel = 1;
+    for (int i = 0; i < ndim; i++) {
+        if (shape[i] < 0 || (shape[i] > 0 && numel > INT32_MAX / shape[i])) { return -1; }
+        numel *= shape[i];
+    }
+    return numel;
+}
+
+#define NPY_MAGIC "\x93NUMPY"
+#define NPY_MAX_HEADER (1 << 20)
+#define MAX_NDIM 32
+
+const char* npy_descr(DType dtype) {
+    switch (dtype) {
+        case DTYPE_FLOAT32: return "<f4";
+        case DTYPE_INT32: return "<i4";
+        case DTYPE_INT64: return "<i8";
+        case DTYPE_BOOL: return "|b1";
+    }
+    return NULL;
+}
+
+// the value of key in the header dict of a .npy file, which is a Python literal
+// like {'descr': '<f4', 'fortran_order': False, 'shape': (3,), }
+const char* npy_header_value(const char* header, const char* key) {
+    const char* p = strstr(header, key);
+    if (p == NULL) { return NULL; }
+    p = strchr(p + strlen(key), ':');
+    if (p == NULL) { return NULL; }
+    p++;
+    while (*p == ' ') { p++; }
+    return p;
+}
+
+// np.load(path, mmap_mode=...)
+Tensor* tensor_load_npy(const char* path, MmapMode mode) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "OSError: cannot open %s\n", path);
+        return NULL;
+    }
+    // magic, version, then the length of the header: 2 bytes in version 1, 4 after that
+    uint8_t preamble[12];
+    bool ok = fread(preamble, 1, 10, f) == 10 && memcmp(preamble, NPY_MAGIC, 6) == 0;
+    size_t header_len = 0, data_offset = 10;
+    if (ok && preamble[6] == 1) {
+        header_len = preamble[8] | (size_t) preamble[9] << 8;
+    } else if (ok && (preamble[6] == 2 || preamble[6] == 3) && fread(preamble + 10, 1, 2, f) == 2) {
+        header_len = preamble[8] | (size_t) preamble[9] << 8 | (size_t) preamble[10] << 16 | (size_t) preamble[11] << 24;
+        data_offset = 12;
+    } else {
+        ok = false;
+    }
+    ok = ok && header_len < NPY_MAX_HEADER;
+    char* header = mallocCheck(header_len + 1);
+    ok = ok && fread(header, 1, header_len, f) == header_len;
+    fclose(f);
+    if (!ok) {
+        fprintf(stderr, "ValueError: %s is not a .npy file\n", path);
+        free(header);
+        return NULL;
+    }
+    header[header_len] = '\0';
+    data_offset += header_len;
+
+    const char* descr = npy_header_value(header, "descr");
+    const char* fortran_order = npy_header_value(header, "fortran_order");
+    const char* shape = npy_header_value(header, "shape");
+    int dtype = -1;
+    for (int d = DTYPE_FLOAT32; descr != NULL && d <= DTYPE_BOOL; d++) {
+        const char* name = npy_descr(d);
+        // '<' and '|' are both fine for bytes, '=' is native which is little-endian for us
+        if ((descr[0] == '\'' || descr[0] == '"') && strncmp(descr + 2, name + 1, 2) == 0 &&
+            (descr[1] == name[0] || descr[1] == '=' || (descr[1] == '|' && d == DTYPE_BOOL))) {
+            dtype = d;
+        }
+    }
+    int64_t dims[MAX_NDIM];
+    int ndim = 0;
+    ok = shape != NULL && *shape == '(';
+    for (const char* p = ok ? shape + 1 : ""; ok && *p != ')'; ) {
+        char* end;
+        if (ndim == MAX_NDIM) { ok = false; break; }
+        dims[ndim++] = strtoll(p, &end, 10);
+        ok = end != p;
+        p = end;
+        while (*p == ',' || *p == ' ' || *p == 'L') { p++; }
+    }
+    int64_t numel = ok ? shape_numel(dims, ndim) : -1;
+    if (dtype < 0 || numel < 0 || (ndim > 1 && fortran_order != NULL && strncmp(fortran_order, "True", 4) == 0)) {
+        fprintf(stderr, "ValueError: unsupported .npy header in %s: %s\n", path, header);
+        free(header);
+        return NULL;
+    }
+    free(header);
+    return tensor_read_file(path, data_offset, (int) numel, (DType) dtype, true, mode);
+}
+
+// np.save(path, t)
+bool tensor_save_npy(const char* path, Tensor* t) {
+    // the header is padded with spaces so that the data starts on a 64-byte boundary,
+    // like numpy does, which is what lets us mmap it back
+    char header[128];
+    int len = snprintf(header, sizeof(header), "{'descr': '%s', 'fortran_order': False, 'shape': (%d,), }",
+                       npy_descr(tensor_dtype(t)), t->size);
+    int total = (10 + len + 1 + 63) / 64 * 64;
+    FILE* f = fopen(path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "OSError: cannot open %s for writing\n", path);
+        return false;
+    }
+    setvbuf(f, NULL, _IOFBF, 1 << 20);
+    int header_len = total - 10;
+    uint8_t preamble[10] = { 0x93, 'N', 'U', 'M', 'P', 'Y', 1, 0, header_len & 0xFF, header_len >> 8 };
+    bool ok = fwrite(preamble, 1, 10, f) == 10 && fwrite(header, 1, len, f) == (size_t) len;
+    for (int i = 10 + len; i < total - 1 && ok; i++) { ok = fputc(' ', f) != EOF; }
+    ok = ok && fputc('\n', f) != EOF && tensor_write_file_data(t, f);
+    ok = fclose(f) == 0 && ok;
+    if (!ok) { fprintf(stderr, "OSError: failed writing %s\n", path); }
+    return ok;
+}
+
+// safetensors: an 8-byte header length, a JSON header like
+// {"name": {"dtype": "F32", "shape": [3], "data_offsets": [0, 12]}, "__metadata__": {...}}
+// and then the data, with the offsets relative to the end of the header.
+
+#define SAFETENSORS_MAX_HEADER (100 << 20)
+
+const char* safetensors_dtype(DType dtype) {
+    switch (dtype) {
+        case DTYPE_FLOAT32: return "F32";
+        case DTYPE_INT32: return "I32";
+        case DTYPE_INT64: return "I64";
+        case DTYPE_BOOL: return "BOOL";
+    }
+    return NULL;
+}
+
+// just enough of a JSON parser for safetensors headers
+typedef struct {
+    const char* p;
+    const char* end;
+} JsonCursor;
+
+void json_ws(JsonCursor* c) {
+    while (c->p < c->end && (*c->p == ' ' || *c->p == '\t' || *c->p == '\n' || *c->p == '\r')) { c->p++; }
+}
+
+bool json_expect(JsonCursor* c, char ch) {
+    json_ws(c);
+    if (c->p < c->end && *c->p == ch) { c->p++; return true; }
+    return false;
+}
+
+// parses a string into out (if not NULL), truncated to capacity; \u escapes are kept as is
+bool json_string(JsonCursor* c, char* out, size_t capacity) {
+    if (!json_expect(c, '"')) { return false; }
+    size_t n = 0;
+    while (c->p < c->end && *c->p != '"') {
+        char ch = *c->p++;
+        if (ch == '\\' && c->p < c->end) {
+            ch = *c->p++;
+            switch (ch) {
+                case 'n': ch = '\n'; break;
+                case 't': ch = '\t'; break;
+                case 'r': ch = '\r'; break;
+                case 'b': ch = '\b'; break;
+                case 'f': ch = '\f'; break;
+            }
+        }
+        if (out != NULL && n + 1 < capacity) { out[n] = ch; }
+        n++;
+    }
+    if (out != NULL && capacity > 0) { out[min(n, capacity - 1)] = '\0'; }
+    if (out != NULL && n >= capacity) { return false; }
+    return json_expect(c, '"');
+}
+
+bool json_int(JsonCursor* c, int64_t* out) {
+    json_ws(c);
+    char buf[32];
+    size_t n = 0;
+    while (c->p < c->end && n < sizeof(buf) - 1 && (*c->p == '-' || (*c->p >= '0' && *c->p <= '9'))) { buf[n++] = *c->p++; }
+    buf[n] = '\0';
+    char* end;
+    *out = strtoll(buf, &end, 10);
+    return n > 0 && *end == '\0';
+}
+
+// skips over any value
+bool json_skip(JsonCursor* c) {
+    json_ws(c);
+    if (c->p >= c->end) { return false; }
+    if (*c->p == '"') { return json_string(c, NULL, 0); }
+    if (*c->p == '{' || *c->p == '[') {
+        char close = *c->p == '{' ? '}' : ']';
+        c->p++;
+        if (json_expect(c, close)) { return true; }
+        do {
+            if (close == '}' && !(json_string(c, NULL, 0) && json_expect(c, ':'))) { return false; }
+            if (!json_skip(c)) { return false; }
+        } while (json_expect(c, ','));
+        return json_expect(c, close);
+    }
+    // number, true, false, null
+    while (c->p < c->end && strchr(",}] \t\r\n", *c->p) == NULL) { c->p++; }
+    return true;
+}
+
+// parses one {"dtype": ..., "shape": [...], "data_offsets": [begin, end]} into entry
+bool safetensors_parse_entry(JsonCursor* c, TensorFileEntry* entry, size_t data_start, size_t file_size) {
+    int64_t dims[MAX_NDIM], offsets[2] = {-1, -1};
+    int ndim = -1;
+    int dtype = -1;
+    if (!json_expect(c, '{')) { return false; }
+    do {
+        char key[32], value[16];
+        if (!json_string(c, key, sizeof(key)) || !json_expect(c, ':')) { return false; }
+        if (strcmp(key, "dtype") == 0) {
+            if (!json_string(c, value, sizeof(value))) { return false; }
+            for (int d = DTYPE_FLOAT32; d <= DTYPE_BOOL; d++) {
+                if (strcmp(value, safetensors_dtype(d)) == 0) { dtype = d; }
+            }
+        } else if (strcmp(key, "shape") == 0 || strcmp(key, "data_offsets") == 0) {
+            bool is_shape = key[0] == 's';
+            int64_t* out = is_shape ? dims : offsets;
+            int capacity = is_shape ? MAX_NDIM : 2, n = 0;
+            if (!json_expect(c, '[')) { return false; }
+            if (!json_expect(c, ']')) {
+                do {
+                    if (n == capacity || !json_int(c, &out[n++])) { return false; }
+                } while (json_expect(c, ','));
+                if (!json_expect(c, ']')) { return false; }
+            }
+            if (is_shape) { ndim = n; }
+        } else if (!json_skip(c)) {
+            return false;
+        }
+    } while (json_expect(c, ','));
+    if (!json_expect(c, '}')) { return false; }
+    int64_t numel = ndim >= 0 ? shape_numel(dims, ndim) : -1;
+    if (dtype < 0 || numel < 0) {
+        fprintf(stderr, "ValueError: unsupported tensor %s (only F32, I32, I64 and BOOL are)\n", entry->name);
+        return false;
+    }
+    entry->dtype = dtype;
+    entry->size = (int) numel;
+    entry->stride = 1;
+    entry->data_offset = data_start + offsets[0];
+    size_t nbytes = dtype == DTYPE_BOOL ? (size_t) numel : storage_nbytes((int) numel, dtype);
+    return offsets[0] >= 0 && offsets[1] - offsets[0] == (int64_t) nbytes && data_start + offsets[1] <= file_size;
+}
+
+// like tensor_file_entries, for a safetensors file: the tensors in it, with their data
+// offsets from the start of the file. Names must fit in a TensorFileEntry.
+int tensor_safetensors_entries(const char* path, TensorFileEntry* entries, int capacity) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "OSError: cannot open %s\n", path);
+        return -1;
+    }
+    uint8_t len_bytes[8];
+    uint64_t header_len = 0;
+    bool ok = fread(len_bytes, 1, 8, f) == 8;
+    for (int i = 7; i >= 0; i--) { header_len = header_len << 8 | len_bytes[i]; }
+    ok = ok && header_len < SAFETENSORS_MAX_HEADER;
+    char* header = mallocCheck(ok ? header_len + 1 : 1);
+    ok = ok && fread(header, 1, header_len, f) == header_len;
+    fseek(f, 0, SEEK_END);
+    size_t file_size = (size_t) ftell(f);
+    fclose(f);
+
+    JsonCursor c = { header, header + (ok ? header_len : 0) };
+    int count = 0;
+    ok = ok && json_expect(&c, '{');
+    if (ok && !json_expect(&c, '}')) {
+        do {
+            TensorFileEntry entry;
+            memset(&entry, 0, sizeof(entry));
+            ok = json_string(&c, entry.name, sizeof(entry.name)) && json_expect(&c, ':');
+            if (ok && strcmp(entry.name, "__metadata__") == 0) {
+                ok = json_skip(&c);
+                continue;
+            }
+            ok = ok && safetensors_parse_entry(&c, &entry, 8 + header_len, file_size);
+            if (ok && entries != NULL && count < capacity) { entries[count] = entry; }
+            count++;
+        } while (ok && json_expect(&c, ','));
+        ok = ok && json_expect(&c, '}');
+    }
+    free(header);
+    if (!ok) {
+        fprintf(stderr, "ValueError: %s is not a safetensors file we can read\n", path);
+        return -1;
+    }
+    return count;
+}
+
+// safetensors.torch.load_file(path)[name], memory-mapped when aligned
+Tensor* tensor_load_safetensors(const char* path, const char* name, MmapMode mode) {
+    int count = tensor_safetensors_entries(path, NULL, 0);
+    if (count < 0) { return NULL; }
+    TensorFileEntry* entries = mallocCheck((count + 1) * sizeof(TensorFileEntry));
+    count = tensor_safetensors_entries(path, entries, count);
+    for (int i = 0; i < count; i++) {
+        if (strcmp(entries[i].name, name) == 0) {
+            TensorFileEntry e = entries[i];
+            free(entries);
+            return tensor_read_file(path, e.data_offset, e.size, (DType) e.dtype, true, mode);
+        }
+    }
+    free(entries);
+    fprintf(stderr, "KeyError: no tensor %s in %s\n", name, path);
+    return NULL;
+}
+
+// appends s to the JSON header being built in buf, as a string, escaped
+void json_append_string(char** buf, size_t* len, size_t* capacity, const char* s) {
+    size_t needed = *len + 2 * strlen(s) + 3;
+    if (needed > *capacity) {
+        *capacity = needed * 2;
+        *buf = realloc(*buf, *capacity);
+        if (*buf == NULL) { fprintf(stderr, "Error: Memory allocation failed\n"); exit(EXIT_FAILURE); }
+    }
+    (*buf)[(*len)++] = '"';
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') { (*buf)[(*len)++] = '\\'; }
+        (*buf)[(*len)++] = *s;
+    }
+    (*buf)[(*len)++] = '"';
+}
+
+void json_append(char** buf, size_t* len, size_t* capacity, const char* s) {
+    size_t n = strlen(s);
+    if (*len + n + 1 > *capacity) {
+        *capacity = (*len + n + 1) * 2;
+        *buf = realloc(*buf, *capacity);
+        if (*buf == NULL) { fprintf(stderr, "Error: Memory allocation failed\n"); exit(EXIT_FAILURE); }
+    }
+    memcpy(*buf + *len, s, n + 1);
+    *len += n;
+}
+
+// safetensors.torch.save_file({names[i]: tensors[i]}, path)
+bool tensor_save_safetensors(const char* path, const char** names, Tensor** tensors, int count) {
+    // widest dtypes first, like the safetensors library, so that with the header padded
+    // to 8 bytes every tensor's data comes out aligned for its dtype
+    int* order = mallocCheck((count + 1) * sizeof(int));
+    int n = 0;
+    DType by_width[] = { DTYPE_INT64, DTYPE_FLOAT32, DTYPE_INT32, DTYPE_BOOL };
+    for (int w = 0; w < 4; w++) {
+        for (int i = 0; i < count; i++) {
+            if (tensor_dtype(tensors[i]) == by_width[w]) { order[n++] = i; }
+        }
+    }
+    size_t len = 0, capacity = 256;
+    char* header = mallocCheck(capacity);
+    json_append(&header, &len, &capacity, "{");
+    size_t offset = 0;
+    for (int k = 0; k < count; k++) {
+        Tensor* t = tensors[order[k]];
+        char fields[160];
+        snprintf(fields, sizeof(fields), ":{\"dtype\":\"%s\",\"shape\":[%d],\"data_offsets\":[%zu,%zu]}%s",
+                 safetensors_dtype(tensor_dtype(t)), t->size, offset, offset + file_nbytes(t), k + 1 < count ? "," : "");
+        json_append_string(&header, &len, &capacity, names[order[k]]);
+        json_append(&header, &len, &capacity, fields);
+        offset += file_nbytes(t);
+    }
+    json_append(&header, &len, &capacity, "}");
+    while (len % 8 != 0) { json_append(&header, &len, &capacity, " "); }
+
+    FILE* f = fopen(path, "wb");
+    bool ok = f != NULL;
+    if (ok) {
+        setvbuf(f, NULL, _IOFBF, 1 << 20);
+        uint8_t len_bytes[8];
+        for (int i = 0; i < 8; i++) { len_bytes[i] = (uint8_t) ((uint64_t) len >> (8 * i)); }
+        ok = fwrite(len_bytes, 1, 8, f) == 8 && fwrite(header, 1, len, f) == len;
+        for (int k = 0; k < count && ok; k++) { ok = tensor_write_file_data(tensors[order[k]], f); }
+        ok = fclose(f) == 0 && ok;
+    }
+    if (!ok) { fprintf(stderr, "OSError: failed writing %s\n", path); }
+    free(header);
+    free(order);
+    return ok;
+}
+
+// ----------------------------------------------------------------------------
+// DLPack: handing tensors to and from torch, numpy, ... without copying. An exported
+// DLManagedTensor describes a view of our Storage, which is pinned (see tensor_pin) until
+// the consumer calls the deleter. An imported one becomes an external Storage
+// that calls the producer's deleter once the last view of it is gone.
+
+typedef struct {
+    DLManagedTensor managed; // what was handed out, in one of the two flavours
+    DLManagedTensorVersioned versioned;
+    Tensor* pinned;
+    int64_t shape;
+    int64_t stride;
+} DLPackExport;
+
+bool dtype_to_dlpack(DType dtype, DLDataType* out) {
+    switch (dtype) {
+        case DTYPE_FLOAT32: *out = (DLDataType) { kDLFloat, 32, 1 }; return true;
+        case DTYPE_INT32: *out = (DLDataType) { kDLInt, 32, 1 }; return true;
+        case DTYPE_INT64: *out = (DLDataType) { kDLInt, 64, 1 }; return true;
+        default: return false; // DLPack bools are a byte each, ours are packed bits
+    }
+}
+
+// a DLPackExport whose DLTensor views the same elements as t, with its offset and stride
+DLPackExport* dlpack_export_new(Tensor* t, DLTensor* d) {
+    DLDataType dtype;
+    if (!dtype_to_dlpack(t->storage->dtype, &dtype)) {
+        fprintf(stderr, "ValueError: bool tensors are packed into bits and can't be exported to DLPack\n");
+        return NULL;
+    }
+    DLPackExport* e = mallocCheck(sizeof(DLPackExport));
+    e->pinned = tensor_pin(t);
+    e->shape = t->size;
+    e->stride = t->stride;
+    d->data = e->pinned->storage->data;
+    d->device = (DLDevice) { kDLCPU, 0 };
+    d->ndim = 1;
+    d->dtype = dtype;
+    d->shape = &e->shape;
+    d->strides = &e->stride;
+    d->byte_offset = storage_byte_offset(t->storage, t->offset);
+    return e;
+}
+
+void dlpack_export_free(DLPackExport* e) {
+    tensor_unpin(e->pinned);
+    free(e);
+}
+
+void dlpack_export_delete(DLManagedTensor* managed) {
+    dlpack_export_free(managed->manager_ctx);
+}
+
+void dlpack_export_delete_versioned(DLManagedTensorVersioned* managed) {
+    dlpack_export_free(managed->manager_ctx);
+}
+
+// a DLManagedTensor viewing the same elements as t, NULL if its dtype has no DLPack twin
+DLManagedTensor* tensor_to_dlpack(Tensor* t) {
+    DLManagedTensor m;
+    DLPackExport* e = dlpack_export_new(t, &m.dl_tensor);
+    if (e == NULL) { return NULL; }
+    e->managed = m;
+    e->managed.manager_ctx = e;
+    e->managed.deleter = dlpack_export_delete;
+    return &e->managed;
+}
+
+// the same for DLPack 1.0, flags being e.g. DLPACK_FLAG_BITMASK_READ_ONLY
+DLManagedTensorVersioned* tensor_to_dlpack_versioned(Tensor* t, uint64_t flags) {
+    DLManagedTensorVersioned m;
+    DLPackExport* e = dlpack_export_new(t, &m.dl_tensor);
+    if (e == NULL) { return NULL; }
+    e->versioned = m;
+    e->versioned.version = (DLPackVersion) { 1, 0 };
+    e->versioned.manager_ctx = e;
+    e->versioned.deleter = dlpack_export_delete_versioned;
+    e->versioned.flags = flags;
+    return &e->versioned;
+}
+
+// A Tensor over the elements of a 0-d or 1-d CPU DLTensor, zero-copy, which calls
+// release(ctx) once the last view of it is gone. NULL if d can't be represented.
+Tensor* dlpack_import(DLTensor* d, void (*release)(void* ctx), void* ctx) {
+    DType dtype;
+    if (d->dtype.lanes == 1 && d->dtype.code == kDLFloat && d->dtype.bits == 32) { dtype = DTYPE_FLOAT32; }
+    else if (d->dtype.lanes == 1 && d->dtype.code == kDLInt && d->dtype.bits == 32) { dtype = DTYPE_INT32; }
+    else if (d->dtype.lanes == 1 && d->dtype.code == kDLInt && d->dtype.bits == 64) { dtype = DTYPE_INT64; }
+    else {
+        fprintf(stderr, "ValueError: unsupported DLPack dtype (code=%d, bits=%d, lanes=%d)\n",
+                d->dtype.code, d->dtype.bits, d->dtype.lanes);
+        return NULL;
+    }
+    if (d->device.device_type != kDLCPU) {
+        fprintf(stderr, "ValueError: only CPU tensors can be imported from DLPack, got device type %d\n", d->device.device_type);
+        return NULL;
+    }
+    if (d->ndim > 1) {
+        fprintf(stderr, "ValueError: only 0-d and 1-d tensors can be imported from DLPack, got %d-d\n", d->ndim);
+        return NULL;
+    }
+    int64_t size = d->ndim == 0 ? 1 : d->shape[0];
+    int64_t stride = d->ndim == 0 || d->strides == NULL || size <= 1 ? 1 : d->strides[0];
+    size_t itemsize = dtype_itemsize(dtype);
+    char* first = (char*) d->data + d->byte_offset;
+    // the Storage spans from the lowest to the highest element, the view walks it
+    int64_t lo = size > 0 && stride < 0 ? (size - 1) * stride : 0;
+    int64_t span = size > 0 ? (size - 1) * (stride < 0 ? -stride : stride) + 1 : 0;
+    if (span > INT_MAX || size > INT_MAX) {
+        fprintf(stderr, "ValueError: DLPack tensor of %lld elements is too big\n", (long long) span);
+        return NULL;
+    }
+    if ((uintptr_t) first % itemsize != 0) {
+        fprintf(stderr, "ValueError: DLPack tensor data is not aligned to its dtype\n");
+        return NULL;
+    }
+    Tensor* whole = tensor_from_external(first + lo * (int64_t) itemsize, (int) span, dtype, release, ctx);
+    if (size == 0) { return whole; }
+    Tensor* t = tensor_view(whole, (int) -lo, (int) size, (int) stride);
+    tensor_free(whole);
+    return t;
+}
+
+void dlpack_release(void* ctx) {
+    DLManagedTensor* managed = ctx;
+    if (managed->deleter != NULL) { managed->deleter(managed); }
+}
+
+void dlpack_release_versioned(void* ctx) {
+    DLManagedTensorVersioned* managed = ctx;
+    if (managed->deleter != NULL) { managed->deleter(managed); }
+}
+
+// The Tensor owns managed from then on (it calls the deleter when it's done with it).
+// On failure (NULL) managed is left to the caller.
+Tensor* tensor_from_dlpack(DLManagedTensor* managed) {
+    return dlpack_import(&managed->dl_tensor, dlpack_release, managed);
+}
+
+// the same for DLPack 1.0, where a read-only producer gives a read-only Tensor
+Tensor* tensor_from_dlpack_versioned(DLManagedTensorVersioned* managed) {
+    if (managed->version.major != 1) {
+        fprintf(stderr, "ValueError: unsupported DLPack version %u.%u\n", managed->version.major, managed->version.minor);
+        return NULL;
+    }
+    Tensor* t = dlpack_import(&managed->dl_tensor, dlpack_release_versioned, managed);
+    if (t != NULL) { t->storage->readonly = (managed->flags & DLPACK_FLAG_BITMASK_READ_ONLY) != 0; }
+    return t;
 }
 
 // ----------------------------------------------------------------------------
@@ -6,37 +6,235 @@ tensor1d.h
 #define TENSOR1D_H
 
 #include <stddef.h>
+#include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 
-typedef struct {
-    float* data;
-    int data_size;
+// the element types a Storage can hold, similar to torch.dtype
+typedef enum {
+    DTYPE_FLOAT32,
+    DTYPE_INT32,
+    DTYPE_INT64,
+    DTYPE_BOOL, // packed, 1 bit per element
+} DType;
+
+// how a Storage can be backed by a memory-mapped file
+typedef enum {
+    MMAP_READONLY, // writes are an error
+    MMAP_COPY_ON_WRITE, // writes go to private copies of the pages, never to the file
+} MmapMode;
+
+// access pattern hints for the pages of a memory-mapped tensor, see madvise
+typedef enum {
+    ADVICE_NORMAL,
+    ADVICE_SEQUENTIAL,
+    ADVICE_RANDOM,
+    ADVICE_WILLNEED,
+} Advice;
+
+typedef struct CowMapping CowMapping; // see tensor_set_copy_on_write
+
+typedef struct Storage {
+    void* data;
+    int data_size; // number of elements (bits for DTYPE_BOOL)
     int ref_count;
+    DType dtype;
+    bool readonly;
+    void* mapping; // for a file-backed Storage the mmap-ed region holding data, else NULL
+    size_t mapping_size;
+    size_t released_bytes; // bytes of unreachable pages given back to the OS
+    CowMapping* cow; // set if the Storage is copy-on-write
+    int fd; // the memfd of a Storage in shared memory, -1 otherwise
+    uint64_t version; // bumped by every write, so derived caches can tell they are stale
+    void (*release)(void* ctx); // set if data is someone else's memory, see tensor_from_external
+    void* release_ctx;
+    bool inline_scalar; // shares one allocation with its only Tensor, see tensor_new_scalar
+    int pins; // live pointers into data handed out to others, see tensor_pin
+    struct Tensor* views; // linked list of the live Tensors viewing this Storage
+    struct Storage* prev; // linked list of all live Storages, for introspection
+    struct Storage* next;
 } Storage;
 
-// The equivalent of tensor in PyTorch
+// one entry of the table of contents of a tensor file (see tensor_save), as it is on disk
+typedef struct {
+    char name[104]; // null-terminated
+    uint32_t dtype;
+    int32_t size;
+    int32_t stride;
+    uint32_t reserved;
+    uint64_t data_offset; // from the start of the file, always a multiple of 64
+} TensorFileEntry;
+
+// what another process needs to map a view of a shared memory Storage, see tensor_export
+typedef struct {
+    int fd; // the memfd of the Storage, as numbered in the exporting process
+    DType dtype;
+    int storage_size;
+    int offset;
+    int size;
+    int stride;
+} TensorHandle;
+
+typedef struct ProcessGroup ProcessGroup; // see tensor_group_new
+
+// the DLPack ABI (github.com/dmlc/dlpack) for handing tensors to other frameworks
+// zero-copy, just the parts of dlpack.h we need
+enum { kDLCPU = 1 }; // DLDevice.device_type
+enum { kDLInt = 0, kDLUInt = 1, kDLFloat = 2, kDLBool = 6 }; // DLDataType.code
+
+typedef struct {
+    int32_t device_type;
+    int32_t device_id;
+} DLDevice;
+
+typedef struct {
+    uint8_t code;
+    uint8_t bits;
+    uint16_t lanes;
+} DLDataType;
+
+typedef struct {
+    void* data;
+    DLDevice device;
+    int32_t ndim;
+    DLDataType dtype;
+    int64_t* shape;
+    int64_t* strides; // in elements, NULL for contiguous
+    uint64_t byte_offset; // from data to the first element
+} DLTensor;
+
+typedef struct DLManagedTensor {
+    DLTensor dl_tensor;
+    void* manager_ctx;
+    void (*deleter)(struct DLManagedTensor* self); // called once the consumer is done
+} DLManagedTensor;
+
+// the DLPack 1.0 flavour, which also carries a version and flags
+enum { DLPACK_FLAG_BITMASK_READ_ONLY = 1, DLPACK_FLAG_BITMASK_IS_COPIED = 2 };
+
 typedef struct {
+    uint32_t major;
+    uint32_t minor;
+} DLPackVersion;
+
+typedef struct DLManagedTensorVersioned {
+    DLPackVersion version;
+    void* manager_ctx;
+    void (*deleter)(struct DLManagedTensorVersioned* self);
+    uint64_t flags;
+    DLTensor dl_tensor;
+} DLManagedTensorVersioned;
+
+// The equivalent of tensor in PyTorch
+typedef struct Tensor {
     Storage* storage;
     int offset;
     int size;
     int stride;
     char* repr; // holds the text representation of the tensor
+    uint64_t repr_version; // the version of the Storage that repr was made from
+    uint64_t repr_generation; // the generation of the print options repr was made with
+    struct Tensor* prev_view; // the other Tensors viewing the same Storage
+    struct Tensor* next_view;
 } Tensor;
 
+// memory used by a Storage versus what its live views can still reach
+typedef struct {
+    size_t nbytes; // bytes allocated for the Storage
+    size_t reachable_bytes; // bytes spanned by the live views, from their first to last element
+    size_t released_bytes; // bytes of unreachable pages given back to the OS
+    int num_views;
+} StorageStats;
+
 Tensor* tensor_empty(int size);
+Tensor* tensor_empty_dtype(int size, DType dtype);
+DType tensor_dtype(Tensor* t);
 int logical_to_physical(Tensor *t, int ix);
 float tensor_getitem(Tensor* t, int ix);
+int64_t tensor_getitem_int(Tensor* t, int ix);
 Tensor* tensor_getitem_astensor(Tensor* t, int ix);
 float tensor_item(Tensor* t);
+uint64_t tensor_version(Tensor* t);
 void tensor_setitem(Tensor* t, int ix, float val);
+void tensor_setitem_int(Tensor* t, int ix, int64_t val);
 Tensor* tensor_arange(int size);
+Tensor* tensor_mmap(const char* path, size_t byte_offset, int size, DType dtype, MmapMode mode);
+bool tensor_advise(Tensor* t, Advice advice);
+Tensor* tensor_from_external(void* data, int size, DType dtype, void (*release)(void* ctx), void* ctx);
+Tensor* tensor_empty_shared(int size, DType dtype);
+bool tensor_share_memory_(Tensor* t);
+bool tensor_is_shared(Tensor* t);
+bool tensor_can_share_memory(Tensor* t);
+bool tensor_export(Tensor* t, TensorHandle* handle);
+Tensor* tensor_import(const TensorHandle* handle);
+bool tensor_send(int sock, Tensor* t);
+int tensor_recv(int sock, Tensor** t);
+ProcessGroup* tensor_group_new(int world_size, int capacity);
+ProcessGroup* tensor_group_join(int fd, int rank);
+int tensor_group_fd(ProcessGroup* g);
+int tensor_group_rank(ProcessGroup* g);
+int tensor_group_world_size(ProcessGroup* g);
+void tensor_group_free(ProcessGroup* g);
+bool tensor_all_reduce_sum_(ProcessGroup* g, Tensor* t);
+bool tensor_broadcast_(ProcessGroup* g, Tensor* t, int root);
+bool tensor_all_gather(ProcessGroup* g, Tensor* t, Tensor* out);
+Tensor* tensor_from_text(const char* text, size_t len, char delimiter);
+Tensor* tensor_from_text_file(const char* path, char delimiter);
+bool tensor_save(const char* path, const char** names, Tensor** tensors, int count);
+int tensor_file_entries(const char* path, TensorFileEntry* entries, int capacity);
+Tensor* tensor_load(const char* path, const char* name, MmapMode mode);
+Tensor* tensor_load_npy(const char* path, MmapMode mode);
+bool tensor_save_npy(const char* path, Tensor* t);
+int tensor_safetensors_entries(const char* path, TensorFileEntry* entries, int capacity);
+Tensor* tensor_load_safetensors(const char* path, const char* name, MmapMode mode);
+bool tensor_save_safetensors(const char* path, const char** names, Tensor** tensors, int count);
+DLManagedTensor* tensor_to_dlpack(Tensor* t);
+Tensor* tensor_from_dlpack(DLManagedTensor* managed);
+DLManagedTensorVersioned* tensor_to_dlpack_versioned(Tensor* t, uint64_t flags);
+Tensor* tensor_from_dlpack_versioned(DLManagedTensorVersioned* managed);
+Tensor* tensor_to_dtype(Tensor* t, DType dtype);
+void tensor_set_printoptions(int precision, int threshold, int edgeitems);
 char* tensor_to_string(Tensor* t);
+bool tensor_write(Tensor* t, FILE* f);
 void tensor_print(Tensor* t);
 Tensor* tensor_slice(Tensor* t, int start, int end, int step);
+Tensor* tensor_as_strided(Tensor* t, int size, int stride, int offset);
+Tensor* tensor_expand(Tensor* t, int size);
+int tensor_unfold(Tensor* t, int size, int step, Tensor** windows);
+Tensor* tensor_clone(Tensor* t);
+Tensor* tensor_contiguous(Tensor* t);
+bool tensor_copy_(Tensor* dst, Tensor* src);
 Tensor* tensor_addf(Tensor* t, float val);
 Tensor* tensor_add(Tensor* t1, Tensor* t2);
-void tensor_incref(Tensor* t);
-void tensor_decref(Tensor* t);
+Tensor* tensor_ltf(Tensor* t, float val);
+Tensor* tensor_gtf(Tensor* t, float val);
+Tensor* tensor_eqf(Tensor* t, float val);
+Tensor* tensor_logical_not(Tensor* t);
+Tensor* tensor_logical_and(Tensor* t1, Tensor* t2);
+Tensor* tensor_logical_or(Tensor* t1, Tensor* t2);
+int tensor_count_nonzero(Tensor* t);
+Tensor* tensor_index_select(Tensor* t, Tensor* index);
+Tensor* tensor_gather(Tensor* t, Tensor* index);
+bool tensor_scatter_(Tensor* t, Tensor* index, Tensor* src);
+bool tensor_scatter_add_(Tensor* t, Tensor* index, Tensor* src);
+Tensor* tensor_masked_select(Tensor* t, Tensor* mask);
+bool tensor_foreach_add_(Tensor** ts, Tensor** others, int n, float alpha);
+bool tensor_foreach_addf_(Tensor** ts, int n, float val);
+bool tensor_foreach_mul_(Tensor** ts, Tensor** others, int n);
+bool tensor_foreach_mulf_(Tensor** ts, int n, float val);
+bool tensor_sgd_(Tensor** params, Tensor** grads, Tensor** momentum_buffers, int n, float lr, float momentum,
+                 float dampening, float weight_decay, bool nesterov, bool first_step);
+bool tensor_adam_(Tensor** params, Tensor** grads, Tensor** exp_avgs, Tensor** exp_avg_sqs, int n, int step,
+                  float lr, float beta1, float beta2, float eps, float weight_decay, bool decoupled_weight_decay);
+void tensor_storage_stats(Tensor* t, StorageStats* stats);
+int tensor_all_storage_stats(StorageStats* stats, int capacity);
+void tensor_set_compaction_policy(double max_reachable_fraction, size_t min_bytes);
+void tensor_compact_storage(Tensor* t);
+void tensor_set_page_release(bool enabled, size_t min_bytes);
+void tensor_set_copy_on_write(bool enabled, size_t min_bytes);
+void tensor_release_unreachable(Tensor* t);
+Tensor* tensor_pin(Tensor* t);
+void tensor_unpin(Tensor* pinned);
 void tensor_free(Tensor* t);
 
 #endif // TENSOR1D_H
@@ -1,58 +1,109 @@
+import ctypes
+import itertools
+import os
+import pickle
+from multiprocessing.reduction import DupFd, ForkingPickler
+
 import cffi
 
 # -----------------------------------------------------------------------------
-ffi = cffi.FFI()
-ffi.cdef("""
-typedef struct {
-    float* data;
-    int data_size;
-    int ref_count;
-} Storage;
-
-// The equivalent of tensor in PyTorch
-typedef struct {
-    Storage* storage;
-    int offset;
-    int size;
-    int stride;
-    char* repr; // holds the text representation of the tensor
-} Tensor;
-
-Tensor* tensor_empty(int size);
-int logical_to_physical(Tensor *t, int ix);
-float tensor_getitem(Tensor* t, int ix);
-Tensor* tensor_getitem_astensor(Tensor* t, int ix);
-float tensor_item(Tensor* t);
-void tensor_setitem(Tensor* t, int ix, float val);
-Tensor* tensor_arange(int size);
-char* tensor_to_string(Tensor* t);
-void tensor_print(Tensor* t);
-Tensor* tensor_slice(Tensor* t, int start, int end, int step);
-Tensor* tensor_addf(Tensor* t, float val);
-Tensor* tensor_add(Tensor* t1, Tensor* t2);
-void tensor_incref(Tensor* t);
-void tensor_decref(Tensor* t);
-void tensor_free(Tensor* t);
-""")
-lib = ffi.dlopen("./libtensor1d.so")  # Make sure to compile the C code into a shared library
+try:
+    if os.environ.get("TENSOR1D_ABI"):
+        raise ImportError("TENSOR1D_ABI is set")
+    # the compiled extension (python build_tensor1d.py): calls go straight into C
+    from _tensor1d import ffi, lib
+except ImportError:
+    # ABI mode fallback: the shared library (make libtensor1d.so) next to this file is
+    # loaded at runtime, and every call goes through libffi
+    from build_tensor1d import CDEF
+    ffi = cffi.FFI()
+    ffi.cdef(CDEF)
+    lib = ffi.dlopen(os.path.join(os.path.dirname(os.path.abspath(__file__)), "libtensor1d.so"))
+
+# dtypes, the equivalent of torch.float32 etc.
+float32 = lib.DTYPE_FLOAT32
+int32 = lib.DTYPE_INT32
+int64 = lib.DTYPE_INT64
+bool_ = lib.DTYPE_BOOL
+_itemsizes = {float32: 4, int32: 4, int64: 8}
+# how the other dtypes are spelled by numpy's __array_interface__ and by the buffer protocol
+_typestrs = {float32: "<f4", int32: "<i4", int64: "<i8"}
+_formats = {float32: "f", int32: "i", int64: "q"}
+_ctypes = {float32: "float", int32: "int32_t", int64: "int64_t"}
 # -----------------------------------------------------------------------------
 
+# The Python objects owning the memory of external Storages (see frombuffer), by id.
+# They are let go when C releases the Storage, which can outlive the Tensor that made it.
+_external_owners = {}
+_external_ids = itertools.count(1)
+
+@ffi.callback("void(void*)")
+def _release_external(ctx):
+    del _external_owners[int(ffi.cast("uintptr_t", ctx))]
+
+# DLPack travels in PyCapsules, which only the C API makes. A capsule nobody consumed
+# (renamed to "used_...") still owns its DLManagedTensor, and deletes it on the way out.
+# Capsules keep the pointer to their name, so the names have to live forever
+_DLTENSOR, _DLTENSOR_VERSIONED = b"dltensor", b"dltensor_versioned"
+_USED_NAMES = {_DLTENSOR: b"used_dltensor", _DLTENSOR_VERSIONED: b"used_dltensor_versioned"}
+_capsule_new = ctypes.pythonapi.PyCapsule_New
+_capsule_new.restype, _capsule_new.argtypes = ctypes.py_object, [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_void_p]
+_capsule_is_valid = ctypes.pythonapi.PyCapsule_IsValid
+_capsule_is_valid.restype, _capsule_is_valid.argtypes = ctypes.c_int, [ctypes.c_void_p, ctypes.c_char_p]
+_capsule_get_pointer = ctypes.pythonapi.PyCapsule_GetPointer
+_capsule_get_pointer.restype, _capsule_get_pointer.argtypes = ctypes.c_void_p, [ctypes.c_void_p, ctypes.c_char_p]
+_capsule_set_name = ctypes.pythonapi.PyCapsule_SetName
+_capsule_set_name.restype, _capsule_set_name.argtypes = ctypes.c_int, [ctypes.c_void_p, ctypes.c_char_p]
+
+@ctypes.CFUNCTYPE(None, ctypes.c_void_p)
+def _dlpack_capsule_destructor(capsule):
+    for name, ctype in [(_DLTENSOR, "DLManagedTensor*"), (_DLTENSOR_VERSIONED, "DLManagedTensorVersioned*")]:
+        if _capsule_is_valid(capsule, name):
+            managed = ffi.cast(ctype, _capsule_get_pointer(capsule, name))
+            if managed.deleter != ffi.NULL:
+                managed.deleter(managed)
+
+def _nbytes(size, dtype):
+    # bytes of a Storage of size elements, bools are packed into 64-bit words
+    return (size + 63) // 64 * 8 if dtype == bool_ else size * _itemsizes[dtype]
+
+def _stats_dict(stats):
+    return {"nbytes": stats.nbytes, "reachable_bytes": stats.reachable_bytes,
+            "released_bytes": stats.released_bytes, "num_views": stats.num_views}
+
+def _as_index(index):
+    # indices can be given as an int tensor or as a plain list of ints
+    return index if isinstance(index, Tensor) else Tensor(list(index), dtype=int64)
+
 class Tensor:
-    def __init__(self, size_or_data=None, c_tensor=None):
+    def __init__(self, size_or_data=None, c_tensor=None, dtype=float32):
         # let's ensure only one of size_or_data and c_tensor is passed
         assert (size_or_data is not None) ^ (c_tensor is not None), "Either size_or_data or c_tensor must be passed"
         # let's initialize the tensor
         if c_tensor is not None:
             self.tensor = c_tensor
         elif isinstance(size_or_data, int):
-            self.tensor = lib.tensor_empty(size_or_data)
+            self.tensor = lib.tensor_empty_dtype(size_or_data, dtype)
         elif isinstance(size_or_data, (list, range)):
-            self.tensor = lib.tensor_arange(len(size_or_data))
-            for i, val in enumerate(size_or_data):
-                lib.tensor_setitem(self.tensor, i, float(val))
+            self.tensor = lib.tensor_empty_dtype(len(size_or_data), dtype)
+            if not self._fill(size_or_data):
+                for i, val in enumerate(size_or_data):
+                    self._setscalar(i, val)
         else:
             raise TypeError("Input must be an integer size or a list/range of values")
 
+    def _fill(self, values):
+        # writes all the values with one crossing into C, if cffi takes them as they are
+        # (False for bools, or e.g. floats for an int tensor, which go one by one)
+        if self.dtype == bool_:
+            return False
+        try:
+            data = ffi.new(_ctypes[self.dtype] + "[]", values if isinstance(values, list) else list(values))
+        except (TypeError, OverflowError):
+            return False
+        ffi.memmove(self.tensor.storage.data, data, ffi.sizeof(data))
+        return True
+
     def __del__(self):
         # TODO: when Python intepreter is shutting down, lib can become None
         # I'm not 100% sure how to do cleanup in cffi here properly
@@ -62,13 +113,18 @@ class Tensor:
 
     def __getitem__(self, key):
         if isinstance(key, int):
+            # a one-element tensor holding a copy of the element, see tensor_new_scalar
             c_tensor = lib.tensor_getitem_astensor(self.tensor, key)
+            if c_tensor == ffi.NULL:
+                raise IndexError(f"index {key} is out of bounds of {len(self)}")
             return Tensor(c_tensor=c_tensor)
         elif isinstance(key, slice):
             # assign default values to start, stop, and step
-            start = key.start if key.start is not None else 0
-            stop = self.tensor.size if key.stop is None else key.stop
+            # (a negative step walks from the back to the front, like numpy)
             step = 1 if key.step is None else key.step
+            size = self.tensor.size
+            start = key.start if key.start is not None else (0 if step > 0 else -1)
+            stop = key.stop if key.stop is not None else (size if step > 0 else -size - 1)
             # call the C function to slice the tensor
             sliced_tensor = lib.tensor_slice(self.tensor, start, stop, step)
             return Tensor(c_tensor=sliced_tensor)  # Pass the C tensor directly
@@ -77,10 +133,38 @@ class Tensor:
 
     def __setitem__(self, key, value):
         if isinstance(key, int):
-            lib.tensor_setitem(self.tensor, key, float(value))
+            self._setscalar(key, value)
+        elif isinstance(key, slice):
+            # t[a:b:c] = other copies into the view, in place
+            self[key].copy_(value)
         else:
             raise TypeError("Invalid index type")
 
+    def _getscalar(self, ix):
+        # read element ix as a Python scalar of the matching type
+        dtype = self.dtype
+        if dtype == float32:
+            return lib.tensor_getitem(self.tensor, ix)
+        val = lib.tensor_getitem_int(self.tensor, ix)
+        return val != 0 if dtype == bool_ else val
+
+    def _check_writable(self):
+        if self.tensor.storage.readonly:
+            raise ValueError("assignment destination is read-only")
+
+    def _check_no_overlap(self, name):
+        # like torch, in-place ops refuse to write to e.g. an expanded view
+        if self.tensor.stride == 0 and self.tensor.size > 1:
+            raise ValueError(f"{name} cannot write in place to a tensor whose elements overlap")
+
+    def _setscalar(self, ix, value):
+        # integer dtypes go through the exact int64 path, not through float
+        self._check_writable()
+        if self.dtype == float32:
+            lib.tensor_setitem(self.tensor, ix, float(value))
+        else:
+            lib.tensor_setitem_int(self.tensor, ix, int(value))
+
     def __add__(self, other):
         if isinstance(other, (int, float)):
             c_tensor = lib.tensor_addf(self.tensor, float(other))
@@ -92,6 +176,37 @@ class Tensor:
             raise ValueError("RuntimeError: tensor add returned NULL")
         return Tensor(c_tensor=c_tensor)
 
+    # comparisons against a scalar return a bool mask tensor
+    def __lt__(self, other):
+        return Tensor(c_tensor=lib.tensor_ltf(self.tensor, float(other)))
+
+    def __gt__(self, other):
+        return Tensor(c_tensor=lib.tensor_gtf(self.tensor, float(other)))
+
+    def __eq__(self, other):
+        if not isinstance(other, (int, float)):
+            return NotImplemented
+        return Tensor(c_tensor=lib.tensor_eqf(self.tensor, float(other)))
+
+    __hash__ = object.__hash__
+
+    def _logical(self, fn, other):
+        if not isinstance(other, Tensor):
+            raise TypeError("Invalid type for logical op")
+        c_tensor = fn(self.tensor, other.tensor)
+        if c_tensor == ffi.NULL:
+            raise ValueError("RuntimeError: tensor logical op returned NULL")
+        return Tensor(c_tensor=c_tensor)
+
+    def __and__(self, other):
+        return self._logical(lib.tensor_logical_and, other)
+
+    def __or__(self, other):
+        return self._logical(lib.tensor_logical_or, other)
+
+    def __invert__(self):
+        return Tensor(c_tensor=lib.tensor_logical_not(self.tensor))
+
     def __len__(self):
         return self.tensor.size
 
@@ -103,18 +218,667 @@ class Tensor:
         py_str = ffi.string(c_str).decode('utf-8')
         return py_str
 
+    def write(self, file):
+        # print to an open file, a chunk of elements at a time instead of via one big str
+        if not lib.tensor_write(self.tensor, file):
+            raise OSError("failed writing the tensor")
+
+    def as_strided(self, size, stride, storage_offset=None):
+        # zero-copy view with an arbitrary (absolute) offset, size and stride
+        offset = self.tensor.offset if storage_offset is None else storage_offset
+        c_tensor = lib.tensor_as_strided(self.tensor, size, stride, offset)
+        if c_tensor == ffi.NULL:
+            raise ValueError("as_strided view is out of bounds of the storage")
+        return Tensor(c_tensor=c_tensor)
+
+    def expand(self, size):
+        # zero-copy broadcast of a 1-element tensor, using a stride of 0
+        c_tensor = lib.tensor_expand(self.tensor, size)
+        if c_tensor == ffi.NULL:
+            raise ValueError(f"cannot expand a tensor of size {len(self)} to size {size}")
+        return Tensor(c_tensor=c_tensor)
+
+    def unfold(self, size, step):
+        # zero-copy sliding windows, returned as a list of (possibly overlapping) views
+        count = lib.tensor_unfold(self.tensor, size, step, ffi.NULL)
+        if count < 0:
+            raise ValueError(f"unfold needs 0 <= size <= {len(self)} and step > 0")
+        windows = ffi.new("Tensor*[]", count)
+        lib.tensor_unfold(self.tensor, size, step, windows)
+        return [Tensor(c_tensor=windows[i]) for i in range(count)]
+
+    def copy_(self, src):
+        # src can be a Tensor, a list of values or a single value (which is broadcast)
+        if not isinstance(src, Tensor):
+            src = Tensor(list(src) if isinstance(src, (list, range)) else [src], dtype=self.dtype)
+        self._check_writable()
+        self._check_no_overlap("copy_")
+        if not lib.tensor_copy_(self.tensor, src.tensor):
+            raise ValueError(f"cannot copy a tensor of size {len(src)} into a tensor of size {len(self)}")
+        return self
+
+    def contiguous(self):
+        return Tensor(c_tensor=lib.tensor_contiguous(self.tensor))
+
+    def clone(self):
+        # a copy with its own Storage, so e.g. a small slice stops pinning a big tensor
+        return Tensor(c_tensor=lib.tensor_clone(self.tensor))
+
+    def index_select(self, index):
+        # out[i] = self[index[i]], in one call instead of one getitem per element
+        index = _as_index(index)
+        c_tensor = lib.tensor_index_select(self.tensor, index.tensor)
+        if c_tensor == ffi.NULL:
+            raise IndexError("index_select indices must be integers in range")
+        return Tensor(c_tensor=c_tensor)
+
+    def take(self, index):
+        # torch.take: the elements at index (an int tensor or a list) as a new tensor, all
+        # in one call, where reading them with t[i] costs a call and a tensor each
+        return self.index_select(index)
+
+    def put_(self, index, values, accumulate=False):
+        # torch.put_: self[index[i]] = values[i] (+= if accumulate), in place, in one call
+        if not isinstance(values, Tensor):
+            values = Tensor(list(values), dtype=self.dtype)
+        return self.scatter_add_(index, values) if accumulate else self.scatter_(index, values)
+
+    def put(self, index, values, accumulate=False):
+        return self.clone().put_(index, values, accumulate)
+
+    def gather(self, index):
+        return self.index_select(index)
+
+    def scatter_(self, index, src):
+        # self[index[i]] = src[i], in place
+        self._check_writable()
+        self._check_no_overlap("scatter_")
+        index = _as_index(index)
+        if not lib.tensor_scatter_(self.tensor, index.tensor, src.tensor):
+            raise IndexError("scatter_ indices must be integers in range, src must match")
+        return self
+
+    def scatter_add_(self, index, src):
+        # self[index[i]] += src[i], in place
+        self._check_writable()
+        self._check_no_overlap("scatter_add_")
+        index = _as_index(index)
+        if not lib.tensor_scatter_add_(self.tensor, index.tensor, src.tensor):
+            raise IndexError("scatter_add_ indices must be integers in range, src must match")
+        return self
+
+    def masked_select(self, mask):
+        c_tensor = lib.tensor_masked_select(self.tensor, mask.tensor)
+        if c_tensor == ffi.NULL:
+            raise ValueError("masked_select needs a bool mask of the same size")
+        return Tensor(c_tensor=c_tensor)
+
+    def advise(self, advice):
+        # hint how the pages under this (memory-mapped) tensor will be accessed
+        advices = {"normal": lib.ADVICE_NORMAL, "sequential": lib.ADVICE_SEQUENTIAL,
+                   "random": lib.ADVICE_RANDOM, "willneed": lib.ADVICE_WILLNEED}
+        if not lib.tensor_advise(self.tensor, advices[advice]):
+            raise OSError("madvise failed")
+
+    def share_memory_(self):
+        # move the Storage (and so every view of it) into shared memory, like torch
+        if not lib.tensor_share_memory_(self.tensor):
+            raise OSError("cannot move the tensor into shared memory")
+        return self
+
+    def is_shared(self):
+        return lib.tensor_is_shared(self.tensor)
+
+    def export_handle(self):
+        # (fd, dtype, storage_size, offset, size, stride) for import_handle in another
+        # process. The fd belongs to this tensor's Storage and must reach the other process
+        # as an fd (fork, SCM_RIGHTS, ...), not as a number
+        handle = ffi.new("TensorHandle*")
+        if not lib.tensor_export(self.tensor, handle):
+            raise ValueError("only tensors in shared memory can be exported, see share_memory_()")
+        return (handle.fd, handle.dtype, handle.storage_size, handle.offset, handle.size, handle.stride)
+
+    def __reduce_ex__(self, protocol):
+        # pickle the elements as one raw buffer, never element by element. From protocol 5
+        # on it is a PickleBuffer, which can travel out-of-band (see pickle's
+        # buffer_callback) and is rebuilt around by frombuffer, without a copy
+        t = self._packed()
+        buffer = t._bytes_at(t.tensor.offset, _nbytes(len(t), t.dtype))
+        buffer = pickle.PickleBuffer(buffer) if protocol >= 5 else bytes(buffer)
+        return (_rebuild, (buffer, t.dtype, len(t)))
+
+    def __array__(self, dtype=None, copy=None):
+        # numpy.asarray(t) is a view of the same memory, with the same strides. The array
+        # holds a pin on the memory (see _Pinned), so it stays put for as long as the array lives
+        import numpy
+        if self.dtype == bool_:
+            raise TypeError("bool tensors are packed into bits, convert them with .to() first")
+        return numpy.array(_Pinned(self), dtype=dtype, copy=copy)
+
+    def __buffer__(self, flags):
+        # the buffer protocol (memoryview(t) from Python 3.12 on), with the same strides
+        if self.dtype == bool_:
+            raise BufferError("bool tensors are packed into bits, convert them with .to() first")
+        size, offset = len(self), self.tensor.offset
+        stride = self.tensor.stride if size > 1 else 1
+        if stride == 0:
+            raise BufferError("a memoryview can't have a zero stride, see __array__")
+        lo = min(offset, offset + (size - 1) * stride) if size > 0 else offset
+        span = abs(size - 1) * abs(stride) + 1 if size > 0 else 0
+        view = memoryview(self._bytes_at(lo, span * _itemsizes[self.dtype])).cast(_formats[self.dtype])
+        if self.tensor.storage.readonly:
+            view = view.toreadonly()
+        return view[offset - lo::stride][:size]
+
+    def __dlpack__(self, stream=None, max_version=None, dl_device=None, copy=None):
+        # the DLPack protocol, for torch.from_dlpack(t), numpy.from_dlpack(t), ...: a view
+        # of the same memory, with the same offset and strides. Consumers that know DLPack
+        # 1.0 get the versioned flavour, which can say the tensor is read-only
+        if dl_device is not None and tuple(dl_device) != self.__dlpack_device__():
+            raise BufferError("only CPU tensors")
+        if self.dtype == bool_:
+            raise BufferError("bool tensors are packed into bits, convert them with .to() first")
+        readonly = bool(self.tensor.storage.readonly) and not copy
+        t = self.clone() if copy else self
+        destructor = ctypes.cast(_dlpack_capsule_destructor, ctypes.c_void_p)
+        if max_version is not None and max_version[0] >= 1:
+            flags = (lib.DLPACK_FLAG_BITMASK_READ_ONLY if readonly else 0) | (lib.DLPACK_FLAG_BITMASK_IS_COPIED if copy else 0)
+            managed = lib.tensor_to_dlpack_versioned(t.tensor, flags)
+            return _capsule_new(int(ffi.cast("uintptr_t", managed)), _DLTENSOR_VERSIONED, destructor)
+        if readonly:
+            raise BufferError("DLPack before 1.0 can't mark a tensor read-only, export a copy instead")
+        managed = lib.tensor_to_dlpack(t.tensor)
+        return _capsule_new(int(ffi.cast("uintptr_t", managed)), _DLTENSOR, destructor)
+
+    def __dlpack_device__(self):
+        return (lib.kDLCPU, 0)
+
+    def numpy(self):
+        # like torch: a numpy array sharing the memory of the tensor
+        import numpy
+        return numpy.asarray(self)
+
+    def _bytes_at(self, offset, nbytes):
+        # nbytes of the Storage from element offset on, as a buffer that holds a pin on the
+        # memory (through the no-op destructor), so it stays put for as long as it's used
+        pinned = _Pinned(self)
+        data = ffi.cast("char*", pinned.tensor.storage.data) + _nbytes(offset, self.dtype)
+        return ffi.buffer(ffi.gc(data, lambda _: pinned), nbytes)
+
+    def _packed(self):
+        # self if its elements are already laid out back to back in memory, else a copy
+        offset, stride = self.tensor.offset, self.tensor.stride
+        if (stride == 1 or len(self) <= 1) and (self.dtype != bool_ or offset % 64 == 0):
+            return self
+        return self.clone()
+
+    def storage_stats(self):
+        # how much memory the underlying Storage holds vs. what its live views reach
+        stats = ffi.new("StorageStats*")
+        lib.tensor_storage_stats(self.tensor, stats)
+        return _stats_dict(stats)
+
+    def compact_storage(self):
+        # move the views of the underlying Storage into compact Storages, right away
+        lib.tensor_compact_storage(self.tensor)
+
+    def release_unreachable(self):
+        # give the pages of the underlying Storage that no live view reaches back to the OS
+        lib.tensor_release_unreachable(self.tensor)
+
+    @property
+    def _version(self):
+        # bumped by every write to the Storage, like torch's t._version
+        return lib.tensor_version(self.tensor)
+
+    @property
+    def dtype(self):
+        return lib.tensor_dtype(self.tensor)
+
+    def to(self, dtype):
+        return Tensor(c_tensor=lib.tensor_to_dtype(self.tensor, dtype))
+
+    def count_nonzero(self):
+        return lib.tensor_count_nonzero(self.tensor)
+
     def tolist(self):
-        return [lib.tensor_getitem(self.tensor, i) for i in range(len(self))]
+        # all the elements in one go, copied out of a packed view of them
+        if self.dtype == bool_:
+            return [val != 0 for val in self.to(int32).tolist()]
+        t = self._packed()
+        return ffi.unpack(ffi.cast(_ctypes[t.dtype] + "*", t.tensor.storage.data) + t.tensor.offset, len(t))
+
+    def item(self, index=None):
+        # the only element as a Python scalar or, like numpy, element index: the fast way
+        # to read one element, where t[index] makes a one-element tensor first
+        if index is not None:
+            c_tensor = self.tensor
+            if not -c_tensor.size <= index < c_tensor.size:
+                raise IndexError(f"index {index} is out of bounds of {c_tensor.size}")
+            if c_tensor.storage.dtype == float32:
+                return lib.tensor_getitem(c_tensor, index)
+            return self._getscalar(index)
+        if self.dtype == float32:
+            return lib.tensor_item(self.tensor)
+        if len(self) != 1:
+            raise ValueError("can only convert an array of size 1 to a Python scalar")
+        return self._getscalar(0)
+
+class _Pinned:
+    # the memory of a tensor pinned in place for as long as this lives (see tensor_pin):
+    # numpy arrays and buffers that point into a tensor hold on to one of these
+    def __init__(self, t):
+        self.dtype = t.dtype
+        self.tensor = ffi.gc(lib.tensor_pin(t.tensor), lib.tensor_unpin)
+
+    @property
+    def __array_interface__(self):
+        itemsize = _itemsizes[self.dtype]
+        address = int(ffi.cast("uintptr_t", self.tensor.storage.data)) + self.tensor.offset * itemsize
+        return {"version": 3, "shape": (self.tensor.size,), "typestr": _typestrs[self.dtype],
+                "data": (address, bool(self.tensor.storage.readonly)),
+                "strides": (self.tensor.stride * itemsize,)}
+
+def empty(size, dtype=float32):
+    return Tensor(size, dtype=dtype)
+
+def zeros(size, dtype=float32):
+    return Tensor([0] * size, dtype=dtype)
+
+def empty_shared(size, dtype=float32):
+    c_tensor = lib.tensor_empty_shared(size, dtype)
+    if c_tensor == ffi.NULL:
+        raise OSError("cannot create a shared memory tensor")
+    return Tensor(c_tensor=c_tensor)
+
+def import_handle(handle):
+    # the view described by export_handle(), mapped zero-copy; the fd is duplicated
+    fd, dtype, storage_size, offset, size, stride = handle
+    c_handle = ffi.new("TensorHandle*", {"fd": fd, "dtype": dtype, "storage_size": storage_size,
+                                         "offset": offset, "size": size, "stride": stride})
+    c_tensor = lib.tensor_import(c_handle)
+    if c_tensor == ffi.NULL:
+        raise ValueError(f"cannot import tensor handle {handle}")
+    return Tensor(c_tensor=c_tensor)
+
+def frombuffer(buffer, dtype=float32, count=-1):
+    # torch.frombuffer: a tensor over the memory of any buffer (bytearray, memoryview,
+    # mmap, numpy array, ...), without a copy. The buffer is kept alive for as long as
+    # any view of the tensor is, and a read-only buffer gives a read-only tensor.
+    # Bool tensors read the bytes as packed bits, in whole 64-bit words
+    view = memoryview(buffer).cast("B")
+    capacity = len(view) * 8 if dtype == bool_ else len(view) // _itemsizes[dtype]
+    size = capacity if count < 0 else count
+    if size > capacity or len(view) < _nbytes(size, dtype):
+        raise ValueError(f"buffer of {len(view)} bytes is too small for {size} elements")
+    data = ffi.from_buffer(view, require_writable=False)
+    if size > 0 and int(ffi.cast("uintptr_t", data)) % (8 if dtype == bool_ else _itemsizes[dtype]) != 0:
+        raise ValueError("buffer is not aligned to the dtype")
+    key = next(_external_ids)
+    _external_owners[key] = data
+    c_tensor = lib.tensor_from_external(data, size, dtype, _release_external, ffi.cast("void*", key))
+    c_tensor.storage.readonly = view.readonly
+    return Tensor(c_tensor=c_tensor)
+
+def as_tensor(data, dtype=None):
+    # torch.as_tensor: shares the memory of data whenever it can (numpy arrays and anything
+    # else with __array_interface__ or the buffer protocol, even strided), copies otherwise
+    if isinstance(data, Tensor):
+        t = data
+    elif hasattr(data, "__array_interface__"):
+        t = from_numpy(data)
+    else:
+        try:
+            view = memoryview(data)
+        except TypeError:
+            return tensor(list(data), dtype=float32 if dtype is None else dtype)
+        t = _from_memoryview(view)
+    return t if dtype is None or t.dtype == dtype else t.to(dtype)
+
+def from_numpy(array):
+    # torch.from_numpy: a tensor over the memory of a 1-d array, with its strides.
+    # Works for anything with __array_interface__, and never copies
+    interface = array.__array_interface__
+    shape, strides = interface["shape"], interface.get("strides")
+    dtype = {typestr: dtype for dtype, typestr in _typestrs.items()}.get(interface["typestr"])
+    if len(shape) != 1 or dtype is None or interface["data"] is None:
+        raise TypeError(f"expected a 1-d array of float32, int32 or int64, got {interface['typestr']} of shape {shape}")
+    size, itemsize = shape[0], _itemsizes[dtype]
+    address, readonly = interface["data"]
+    address += interface.get("offset", 0)
+    byte_stride = strides[0] if strides is not None else itemsize
+    if address % itemsize != 0 or byte_stride % itemsize != 0:
+        raise TypeError("the elements of the array are not aligned to the dtype")
+    stride = byte_stride // itemsize if size > 1 else 1
+    # the Storage spans from the lowest to the highest element, the view walks it
+    lo = min(0, (size - 1) * stride) if size > 0 else 0
+    span = abs(size - 1) * abs(stride) + 1 if size > 0 else 0
+    key = next(_external_ids)
+    _external_owners[key] = array
+    data = ffi.cast("void*", address + lo * itemsize)
+    c_tensor = lib.tensor_from_external(data, span, dtype, _release_external, ffi.cast("void*", key))
+    c_tensor.storage.readonly = readonly
+    base = Tensor(c_tensor=c_tensor)
+    return base.as_strided(size, stride, -lo) if size > 0 else base
+
+def _from_memoryview(view):
+    # a tensor over the memory of a 1-d buffer, copied only if it isn't contiguous
+    dtypes = {("f", 4): float32, ("i", 4): int32, ("l", 4): int32, ("l", 8): int64, ("q", 8): int64}
+    dtype = dtypes.get((view.format.lstrip("@=<"), view.itemsize))
+    if view.ndim != 1 or dtype is None:
+        raise TypeError(f"expected a 1-d buffer of float32, int32 or int64, got format {view.format!r}, use frombuffer for raw bytes")
+    if not view.c_contiguous:
+        view = memoryview(bytearray(view.tobytes()))
+    return frombuffer(view, dtype)
+
+def from_dlpack(ext):
+    # torch.from_dlpack: a tensor over the memory of a DLPack producer (a torch tensor, a
+    # numpy array, ...) or of a DLPack capsule, zero-copy. Only 0-d and 1-d CPU tensors
+    if hasattr(ext, "__dlpack_device__") and ext.__dlpack_device__()[0] != lib.kDLCPU:
+        raise BufferError("only CPU tensors can be imported")
+    capsule = ext
+    if hasattr(ext, "__dlpack__"):
+        try:
+            capsule = ext.__dlpack__(max_version=(1, 0))
+        except TypeError:  # a producer from before DLPack 1.0
+            capsule = ext.__dlpack__()
+    if _capsule_is_valid(id(capsule), _DLTENSOR_VERSIONED):
+        name = _DLTENSOR_VERSIONED
+        managed = ffi.cast("DLManagedTensorVersioned*", _capsule_get_pointer(id(capsule), name))
+        c_tensor = lib.tensor_from_dlpack_versioned(managed)
+    else:
+        name = _DLTENSOR
+        managed = ffi.cast("DLManagedTensor*", _capsule_get_pointer(id(capsule), name))
+        c_tensor = lib.tensor_from_dlpack(managed)
+    if c_tensor == ffi.NULL:
+        raise BufferError("cannot import the DLPack tensor")
+    # the tensor owns the DLManagedTensor now, the capsule must not delete it
+    _capsule_set_name(id(capsule), _USED_NAMES[name])
+    return Tensor(c_tensor=c_tensor)
+
+def _rebuild(buffer, dtype, size):
+    # unpickles what Tensor.__reduce_ex__ pickled, around the buffer itself if it can
+    view = memoryview(buffer)
+    if not view.readonly:
+        return frombuffer(view, dtype, size)
+    # e.g. bytes from an older protocol: one copy, so the tensor is writable as it was
+    t = empty(size, dtype)
+    ffi.memmove(t.tensor.storage.data, view, len(view))
+    return t
+
+def _reduce_for_multiprocessing(t):
+    # multiprocessing (queues, pools, ...) sends tensors through shared memory, like
+    # torch.multiprocessing: the Storage moves there once (one memcpy, and the sender sees
+    # the move), after which only its fd travels and the receiver maps it, zero-copy.
+    # Memory-mapped files and memory we don't own (numpy arrays, ...) stay where they
+    # are, and get pickled by value the usual way (as bytes: a reducer can't tell which
+    # protocol it's pickled with, and ForkingPickler.dumps defaults to one without PickleBuffer)
+    if not lib.tensor_can_share_memory(t.tensor):
+        return t.__reduce_ex__(pickle.DEFAULT_PROTOCOL)
+    fd, dtype, storage_size, offset, size, stride = t.share_memory_().export_handle()
+    return (_rebuild_shared, (DupFd(fd), dtype, storage_size, offset, size, stride))
+
+def _rebuild_shared(dup, dtype, storage_size, offset, size, stride):
+    fd = dup.detach()
+    try:
+        return import_handle((fd, dtype, storage_size, offset, size, stride))
+    finally:
+        os.close(fd)
+
+ForkingPickler.register(Tensor, _reduce_for_multiprocessing)
+
+def send(sock, t):
+    # send t over a Unix domain socket (or its fd); only its fd and geometry travel.
+    # A tensor over a memory-mapped file can't move into shared memory, so it travels as a copy
+    fd = sock if isinstance(sock, int) else sock.fileno()
+    if not lib.tensor_send(fd, t.tensor):
+        raise OSError("sending the tensor failed")
+
+def recv(sock):
+    # the next tensor sent with send(), mapped zero-copy; EOFError once the sender is gone
+    fd = sock if isinstance(sock, int) else sock.fileno()
+    out = ffi.new("Tensor**")
+    status = lib.tensor_recv(fd, out)
+    if status == 0:
+        raise EOFError("the sender closed the socket")
+    if status < 0:
+        raise OSError("receiving a tensor failed")
+    return Tensor(c_tensor=out[0])
+
+class ProcessGroup:
+    # a group of local processes doing collectives through shared memory, like a tiny
+    # torch.distributed. The creator is rank 0; the others join with the group's fd
+    # (e.g. inherited over fork) and their own rank
+    def __init__(self, world_size=None, capacity=1 << 20, fd=None, rank=0):
+        if fd is None:
+            self.group = lib.tensor_group_new(world_size, capacity)
+        else:
+            self.group = lib.tensor_group_join(fd, rank)
+        if self.group == ffi.NULL:
+            raise ValueError("cannot create or join the process group")
+
+    def __del__(self):
+        if getattr(self, "group", ffi.NULL) != ffi.NULL:
+            lib.tensor_group_free(self.group)
+
+    @property
+    def fd(self):
+        return lib.tensor_group_fd(self.group)
+
+    @property
+    def rank(self):
+        return lib.tensor_group_rank(self.group)
+
+    @property
+    def world_size(self):
+        return lib.tensor_group_world_size(self.group)
 
-    def item(self):
-        return lib.tensor_item(self.tensor)
+    def all_reduce_(self, t):
+        # t = the sum of t over all ranks, on every rank
+        if not lib.tensor_all_reduce_sum_(self.group, t.tensor):
+            raise ValueError("all_reduce failed")
+        return t
 
-def empty(size):
-    return Tensor(size)
+    def broadcast_(self, t, src=0):
+        if not lib.tensor_broadcast_(self.group, t.tensor, src):
+            raise ValueError("broadcast failed")
+        return t
+
+    def all_gather(self, t):
+        # the t of every rank, concatenated in rank order
+        out = empty(len(t) * self.world_size)
+        if not lib.tensor_all_gather(self.group, t.tensor, out.tensor):
+            raise ValueError("all_gather failed")
+        return out
 
 def arange(size):
     c_tensor = lib.tensor_arange(size)
     return Tensor(c_tensor=c_tensor)
 
-def tensor(data):
-    return Tensor(data)
\ No newline at end of file
+def tensor(data, dtype=float32):
+    return Tensor(data, dtype=dtype)
+
+def from_file(path, dtype=float32, offset=0, size=-1, mode="r"):
+    # memory-map a file of raw elements, zero-copy: the pages are read in lazily.
+    # mode "r" is read-only, "c" is copy-on-write (changes are never written to the file)
+    modes = {"r": lib.MMAP_READONLY, "c": lib.MMAP_COPY_ON_WRITE}
+    c_tensor = lib.tensor_mmap(str(path).encode(), offset, size, dtype, modes[mode])
+    if c_tensor == ffi.NULL:
+        raise OSError(f"cannot memory-map {path}")
+    return Tensor(c_tensor=c_tensor)
+
+def from_text(source, delimiter=None):
+    # parse a text dump of numbers (CSV, one per line, space separated) into a float32
+    # tensor, without going through Python floats. source is a path, or the text as bytes
+    sep = b"\0" if delimiter is None else delimiter.encode()
+    if isinstance(source, (bytes, bytearray)):
+        c_tensor = lib.tensor_from_text(ffi.from_buffer(source), len(source), sep)
+    else:
+        c_tensor = lib.tensor_from_text_file(str(source).encode(), sep)
+    if c_tensor == ffi.NULL:
+        raise ValueError(f"cannot parse numbers from {source if len(source) < 100 else 'text'}")
+    return Tensor(c_tensor=c_tensor)
+
+def save(tensors, path):
+    # write a dict of name -> Tensor to path; views are streamed out, never copied first
+    names = [ffi.new("char[]", name.encode()) for name in tensors]
+    c_tensors = [t.tensor for t in tensors.values()]
+    if not lib.tensor_save(str(path).encode(), names, c_tensors, len(c_tensors)):
+        raise OSError(f"cannot save tensors to {path}")
+
+def load(path, mode="r"):
+    # the dict of name -> Tensor saved to path, each memory-mapped zero-copy (see from_file)
+    modes = {"r": lib.MMAP_READONLY, "c": lib.MMAP_COPY_ON_WRITE}
+    count = lib.tensor_file_entries(str(path).encode(), ffi.NULL, 0)
+    if count < 0:
+        raise ValueError(f"{path} is not a tensor file")
+    entries = ffi.new("TensorFileEntry[]", count)
+    count = lib.tensor_file_entries(str(path).encode(), entries, count)
+    tensors = {}
+    for i in range(count):
+        name = ffi.string(entries[i].name)
+        c_tensor = lib.tensor_load(str(path).encode(), name, modes[mode])
+        if c_tensor == ffi.NULL:
+            raise ValueError(f"cannot load {name.decode()} from {path}, its entry is invalid")
+        tensors[name.decode()] = Tensor(c_tensor=c_tensor)
+    return tensors
+
+def load_npy(path, mode="r"):
+    # np.load(path, mmap_mode=...): memory-mapped when the data is aligned, else one bulk read
+    modes = {"r": lib.MMAP_READONLY, "c": lib.MMAP_COPY_ON_WRITE}
+    c_tensor = lib.tensor_load_npy(str(path).encode(), modes[mode])
+    if c_tensor == ffi.NULL:
+        raise ValueError(f"cannot load {path}")
+    return Tensor(c_tensor=c_tensor)
+
+def save_npy(t, path):
+    if not lib.tensor_save_npy(str(path).encode(), t.tensor):
+        raise OSError(f"cannot save to {path}")
+
+def load_safetensors(path, mode="r"):
+    # the dict of name -> Tensor in a safetensors file, loaded like load_npy
+    modes = {"r": lib.MMAP_READONLY, "c": lib.MMAP_COPY_ON_WRITE}
+    count = lib.tensor_safetensors_entries(str(path).encode(), ffi.NULL, 0)
+    if count < 0:
+        raise ValueError(f"cannot read {path}")
+    entries = ffi.new("TensorFileEntry[]", count)
+    count = lib.tensor_safetensors_entries(str(path).encode(), entries, count)
+    tensors = {}
+    for i in range(count):
+        name = ffi.string(entries[i].name)
+        c_tensor = lib.tensor_load_safetensors(str(path).encode(), name, modes[mode])
+        if c_tensor == ffi.NULL:
+            raise OSError(f"cannot load {name.decode()} from {path}")
+        tensors[name.decode()] = Tensor(c_tensor=c_tensor)
+    return tensors
+
+def save_safetensors(tensors, path):
+    names = [ffi.new("char[]", name.encode()) for name in tensors]
+    c_tensors = [t.tensor for t in tensors.values()]
+    if not lib.tensor_save_safetensors(str(path).encode(), names, c_tensors, len(c_tensors)):
+        raise OSError(f"cannot save tensors to {path}")
+
+def _tensor_array(tensors):
+    return ffi.new("Tensor*[]", [t.tensor for t in tensors])
+
+def _foreach(c_tensor_fn, c_scalar_fn, tensors, other, *args):
+    # one call into C for the whole list, other being a number or a list of tensors
+    tensors = list(tensors)
+    if isinstance(other, (int, float)):
+        ok = c_scalar_fn(_tensor_array(tensors), len(tensors), float(other))
+    else:
+        other = list(other)
+        if len(other) != len(tensors):
+            raise ValueError(f"expected {len(tensors)} tensors to go with the list, got {len(other)}")
+        ok = c_tensor_fn(_tensor_array(tensors), _tensor_array(other), len(tensors), *args)
+    if not ok:
+        raise ValueError("foreach ops need writable float32 tensors, and others of the same size (or 1)")
+
+def foreach_add_(tensors, other, alpha=1.0):
+    # torch._foreach_add_: tensors[i] += alpha * other[i] (or += other, a number), in place
+    _foreach(lib.tensor_foreach_add_, lib.tensor_foreach_addf_, tensors, other, float(alpha))
+
+def foreach_mul_(tensors, other):
+    # torch._foreach_mul_: tensors[i] *= other[i] (or *= other, a number), in place
+    _foreach(lib.tensor_foreach_mul_, lib.tensor_foreach_mulf_, tensors, other)
+
+class SGD:
+    # torch.optim.SGD over a list of float32 tensors, with one fused call into C per step.
+    # There is no autograd here, so step() takes the gradients, one per parameter
+    def __init__(self, params, lr, momentum=0.0, dampening=0.0, weight_decay=0.0, nesterov=False):
+        self.params = list(params)
+        self.lr, self.momentum, self.dampening = lr, momentum, dampening
+        self.weight_decay, self.nesterov = weight_decay, nesterov
+        self.momentum_buffers = [zeros(len(p)) for p in self.params] if momentum != 0 else None
+        self._first_step = True
+
+    def step(self, grads):
+        grads = _optim_grads(self.params, grads)
+        buffers = ffi.NULL if self.momentum_buffers is None else _tensor_array(self.momentum_buffers)
+        if not lib.tensor_sgd_(_tensor_array(self.params), _tensor_array(grads), buffers, len(self.params),
+                               self.lr, self.momentum, self.dampening, self.weight_decay,
+                               self.nesterov, self._first_step):
+            raise ValueError("SGD needs writable float32 parameters, and gradients of the same sizes")
+        self._first_step = False
+
+class Adam:
+    # torch.optim.Adam over a list of float32 tensors, one fused call into C per step that
+    # reads and writes each element of the parameters and the state once. step() takes the
+    # gradients, one per parameter
+    decoupled_weight_decay = False
+
+    def __init__(self, params, lr=1e-3, betas=(0.9, 0.999), eps=1e-8, weight_decay=0.0):
+        self.params = list(params)
+        self.lr, self.betas, self.eps, self.weight_decay = lr, betas, eps, weight_decay
+        self.exp_avgs = [zeros(len(p)) for p in self.params]
+        self.exp_avg_sqs = [zeros(len(p)) for p in self.params]
+        self.steps = 0
+
+    def step(self, grads):
+        grads = _optim_grads(self.params, grads)
+        if not lib.tensor_adam_(_tensor_array(self.params), _tensor_array(grads), _tensor_array(self.exp_avgs),
+                                _tensor_array(self.exp_avg_sqs), len(self.params), self.steps + 1,
+                                self.lr, self.betas[0], self.betas[1], self.eps, self.weight_decay,
+                                self.decoupled_weight_decay):
+            raise ValueError(f"{type(self).__name__} needs writable float32 parameters, and gradients of the same sizes")
+        self.steps += 1
+
+class AdamW(Adam):
+    # torch.optim.AdamW: Adam with the weight decay applied to the parameters directly
+    decoupled_weight_decay = True
+
+    def __init__(self, params, lr=1e-3, betas=(0.9, 0.999), eps=1e-8, weight_decay=1e-2):
+        super().__init__(params, lr, betas, eps, weight_decay)
+
+def _optim_grads(params, grads):
+    grads = list(grads)
+    if len(grads) != len(params):
+        raise ValueError(f"expected {len(params)} gradients, one per parameter, got {len(grads)}")
+    return grads
+
+def count_nonzero(t):
+    return t.count_nonzero()
+
+def storage_stats():
+    # the stats of every live Storage
+    count = lib.tensor_all_storage_stats(ffi.NULL, 0)
+    stats = ffi.new("StorageStats[]", count)
+    count = min(count, lib.tensor_all_storage_stats(stats, count))
+    return [_stats_dict(stats[i]) for i in range(count)]
+
+def set_compaction_policy(max_reachable_fraction, min_bytes=0):
+    # opt in to compacting views once at most this fraction of their Storage is reachable
+    lib.tensor_set_compaction_policy(max_reachable_fraction, min_bytes)
+
+def set_printoptions(precision=None, threshold=1000, edgeitems=3):
+    # like torch.set_printoptions. precision=None prints floats as short as they can be
+    # while still reading back exactly, otherwise with that many decimals
+    lib.tensor_set_printoptions(-1 if precision is None else precision, threshold, edgeitems)
+
+def set_page_release(enabled, min_bytes=0):
+    # opt in to releasing unreachable pages of a Storage whenever one of its views is freed
+    lib.tensor_set_page_release(enabled, min_bytes)
+
+def set_copy_on_write(enabled, min_bytes=0):
+    # opt in to clones that share pages with the original until either side writes to them
+    lib.tensor_set_copy_on_write(enabled, min_bytes)
\ No newline at end of file
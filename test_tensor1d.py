@@ -176,6 +176,14 @@ def test_setitem_indirect():
     tensor1d_view[-1] = 200
     assert_tensor_equal(torch_tensor, tensor1d_tensor)
 
+# out-of-range writes through a reversed view must not land in its Storage
+def test_setitem_out_of_bounds():
+    tensor1d_tensor = tensor1d.arange(20)
+    tensor1d_view = tensor1d_tensor[10:0:-1]
+    tensor1d_view[-15] = -1
+    tensor1d_view[10] = -1
+    assert tensor1d_tensor.tolist() == [float(x) for x in range(20)]
+
 # test addition
 def test_addition():
 
@@ -210,3 +218,1083 @@ def test_addition():
 
     with pytest.raises(ValueError):
         tensor1d_tensor + tensor1d.arange(5)
+
+# integer dtypes hold values exactly, also above 2^24 where float32 can't
+@pytest.mark.parametrize("dtype", ["int32", "int64"])
+def test_int_dtypes(dtype):
+    data = [0, 1, -7, 2**24 + 1, 123456789]
+    torch_tensor = torch.tensor(data, dtype=getattr(torch, dtype))
+    tensor1d_tensor = tensor1d.tensor(data, dtype=getattr(tensor1d, dtype))
+    assert_tensor_equal(torch_tensor, tensor1d_tensor)
+    assert_tensor_equal(torch_tensor[1:5:2], tensor1d_tensor[1:5:2])
+    assert_tensor_equal(torch_tensor + torch_tensor, tensor1d_tensor + tensor1d_tensor)
+    assert torch_tensor[3].item() == tensor1d_tensor[3].item()
+    assert str(tensor1d_tensor) == "[0, 1, -7, 16777217, 123456789]"
+
+# bool masks are packed 1 bit per element, test around the 64-bit word boundaries
+@pytest.mark.parametrize("size", [1, 63, 64, 65, 200])
+def test_bool_masks(size):
+    torch_tensor = torch.arange(size, dtype=torch.float32)
+    tensor1d_tensor = tensor1d.arange(size)
+
+    torch_mask = torch_tensor > size / 3
+    tensor1d_mask = tensor1d_tensor > size / 3
+    assert_tensor_equal(torch_mask, tensor1d_mask)
+    assert torch.count_nonzero(torch_mask).item() == tensor1d.count_nonzero(tensor1d_mask)
+    assert_tensor_equal(~torch_mask, ~tensor1d_mask)
+
+    # masks over strided views, combined with the logical ops, and sliced again
+    torch_mask = (torch_tensor[1::3] < size / 4) | (torch_tensor[1::3] == size - 2)
+    tensor1d_mask = (tensor1d_tensor[1::3] < size / 4) | (tensor1d_tensor[1::3] == size - 2)
+    assert_tensor_equal(torch_mask, tensor1d_mask)
+    torch_mask = torch_mask[1:] & torch_mask[:-1]
+    tensor1d_mask = tensor1d_mask[1:] & tensor1d_mask[:-1]
+    assert_tensor_equal(torch_mask, tensor1d_mask)
+    assert torch.count_nonzero(torch_mask).item() == tensor1d.count_nonzero(tensor1d_mask)
+
+# negative steps follow numpy (and Python list) semantics, which torch doesn't support
+@pytest.mark.parametrize("slice_params", [
+    (None, None, -1),    # [::-1]
+    (None, None, -3),    # [::-3]
+    (15, 5, -1),         # [15:5:-1]
+    (15, 5, -2),         # [15:5:-2]
+    (5, None, -1),       # [5::-1]
+    (-2, -8, -2),        # [-2:-8:-2]
+    (100, -100, -7),     # out of range on both ends
+    (5, 15, -1),         # empty
+])
+def test_negative_step_slicing(slice_params):
+    tensor1d_tensor = tensor1d.arange(20)
+    s = slice(*slice_params)
+    assert tensor1d_tensor[s].tolist() == [float(x) for x in range(20)][s]
+    # slice of a reversed slice
+    assert tensor1d_tensor[s][1::2].tolist() == [float(x) for x in range(20)][s][1::2]
+    assert tensor1d_tensor[::2][s].tolist() == [float(x) for x in range(20)][::2][s]
+
+# the kernels run on reversed views, including across block/word boundaries
+@pytest.mark.parametrize("size", [1, 64, 65, 300, 1000])
+def test_reversed_kernels(size):
+    torch_tensor = torch.arange(size, dtype=torch.float32)
+    tensor1d_tensor = tensor1d.arange(size)
+    torch_reversed = torch.flip(torch_tensor, [0])
+    tensor1d_reversed = tensor1d_tensor[::-1]
+    assert_tensor_equal(torch_reversed + 1.0, tensor1d_reversed + 1.0)
+    assert_tensor_equal(torch_reversed + torch_tensor, tensor1d_reversed + tensor1d_tensor)
+    torch_mask = torch_reversed > size / 3
+    tensor1d_mask = (tensor1d_tensor > size / 3)[::-1]
+    assert_tensor_equal(torch_mask, tensor1d_mask)
+    assert_tensor_equal(torch_mask, tensor1d_reversed > size / 3)
+    assert torch.count_nonzero(torch_mask).item() == tensor1d.count_nonzero(tensor1d_mask)
+    setitem_view = tensor1d_tensor[::-1]
+    setitem_view[0] = -1.0
+    assert tensor1d_tensor[size - 1].item() == -1.0
+
+# zero-copy view constructors
+def test_as_strided():
+    torch_tensor = torch.arange(20, dtype=torch.float32)
+    tensor1d_tensor = tensor1d.arange(20)
+    for size, stride, offset in [(5, 3, 1), (4, -2, 19), (0, 1, 0), (20, 1, 0), (3, 0, 7)]:
+        torch_view = torch_tensor.as_strided((size,), (stride,), offset) if stride >= 0 else None
+        tensor1d_view = tensor1d_tensor.as_strided(size, stride, offset)
+        expected = [float(offset + i * stride) for i in range(size)]
+        assert tensor1d_view.tolist() == expected
+        if torch_view is not None:
+            assert_tensor_equal(torch_view, tensor1d_view)
+    # views are bounds-checked against the storage once, at creation
+    with pytest.raises(ValueError):
+        tensor1d_tensor.as_strided(5, 5, 0)
+    with pytest.raises(ValueError):
+        tensor1d_tensor.as_strided(2, -1, 0)
+    # the offset is absolute, into the storage
+    assert tensor1d_tensor[10:].as_strided(2, 1, 3).tolist() == [3.0, 4.0]
+    assert tensor1d_tensor[10:].as_strided(2, 1).tolist() == [10.0, 11.0]
+
+def test_expand():
+    torch_tensor = torch.tensor([42.0])
+    tensor1d_tensor = tensor1d.tensor([42.0])
+    assert_tensor_equal(torch_tensor.expand(5), tensor1d_tensor.expand(5))
+    assert_tensor_equal(torch_tensor.expand(0), tensor1d_tensor.expand(0))
+    # writes through an expanded view all land on the same element
+    expanded = tensor1d_tensor.expand(3)
+    expanded[1] = 7.0
+    assert expanded.tolist() == [7.0, 7.0, 7.0]
+    with pytest.raises(ValueError):
+        tensor1d.arange(3).expand(5)
+    # but in-place ops refuse to write to it, like in torch
+    with pytest.raises(ValueError):
+        expanded.copy_(tensor1d.tensor([1.0, 2.0, 3.0]))
+    with pytest.raises(ValueError):
+        expanded.put_([0, 2], [1.0, 2.0])
+    with pytest.raises(ValueError):
+        tensor1d.foreach_add_([expanded], 1.0)
+    with pytest.raises(ValueError):
+        tensor1d.SGD([expanded], lr=0.1).step([tensor1d.arange(3)])
+    assert tensor1d_tensor.tolist() == [7.0]
+    # broadcasting a 1-element tensor against an empty one gives an empty result
+    assert (tensor1d_tensor + tensor1d.arange(0)).tolist() == []
+
+@pytest.mark.parametrize("size, step", [(3, 1), (3, 2), (5, 5), (1, 3), (20, 1)])
+def test_unfold(size, step):
+    torch_tensor = torch.arange(20, dtype=torch.float32)
+    tensor1d_tensor = tensor1d.arange(20)[::-1]
+    torch_windows = torch.flip(torch_tensor, [0]).unfold(0, size, step)
+    tensor1d_windows = tensor1d_tensor.unfold(size, step)
+    assert torch_windows.tolist() == [w.tolist() for w in tensor1d_windows]
+    with pytest.raises(ValueError):
+        tensor1d_tensor.unfold(21, 1)
+
+# gather / scatter / masked_select
+@pytest.mark.parametrize("size", [10, 1000, 300000])
+def test_index_select(size):
+    torch_tensor = torch.arange(size, dtype=torch.float32)
+    tensor1d_tensor = tensor1d.arange(size)
+    index = [(i * 7919) % size for i in range(100)]
+    for dtype in ["int32", "int64"]:
+        torch_index = torch.tensor(index, dtype=getattr(torch, dtype))
+        tensor1d_index = tensor1d.tensor(index, dtype=getattr(tensor1d, dtype))
+        assert_tensor_equal(torch_tensor.index_select(0, torch_index), tensor1d_tensor.index_select(tensor1d_index))
+        assert_tensor_equal(torch_tensor.gather(0, torch_index), tensor1d_tensor.gather(tensor1d_index))
+    # over a strided, reversed view
+    torch_index = torch.tensor(index, dtype=torch.int64)
+    torch_result = torch.flip(torch_tensor, [0])[::2].index_select(0, torch_index // 2)
+    tensor1d_result = tensor1d_tensor[::-2].index_select([i // 2 for i in index])
+    assert_tensor_equal(torch_result, tensor1d_result)
+    with pytest.raises(IndexError):
+        tensor1d_tensor.index_select([0, size])
+    with pytest.raises(IndexError):
+        tensor1d_tensor.index_select([-1])
+    with pytest.raises(IndexError):
+        tensor1d_tensor.index_select(tensor1d.tensor([0.0]))
+
+def test_scatter():
+    index = [3, 1, 3, 0, 9]
+    torch_index = torch.tensor(index)
+    src = [10.0, 20.0, 30.0, 40.0, 50.0]
+    torch_tensor = torch.arange(10, dtype=torch.float32)
+    tensor1d_tensor = tensor1d.arange(10)
+    torch_tensor.scatter_add_(0, torch_index, torch.tensor(src))
+    tensor1d_tensor.scatter_add_(index, tensor1d.tensor(src))
+    assert_tensor_equal(torch_tensor, tensor1d_tensor)
+    # without duplicates, so the result doesn't depend on the write order
+    torch_tensor.scatter_(0, torch_index[1:], torch.tensor(src[1:]))
+    tensor1d_tensor.scatter_(index[1:], tensor1d.tensor(src[1:]))
+    assert_tensor_equal(torch_tensor, tensor1d_tensor)
+    # into a strided view, which writes through to the base tensor
+    torch_tensor[1::2].scatter_add_(0, torch.tensor([0, 4]), torch.tensor([1.0, 2.0]))
+    tensor1d_tensor[1::2].scatter_add_([0, 4], tensor1d.tensor([1.0, 2.0]))
+    assert_tensor_equal(torch_tensor, tensor1d_tensor)
+    # integer tensors accumulate exactly
+    counts = tensor1d.tensor([0] * 4, dtype=tensor1d.int64)
+    counts.scatter_add_([1, 1, 3, 1], tensor1d.tensor([2**40], dtype=tensor1d.int64))
+    assert counts.tolist() == [0, 3 * 2**40, 0, 2**40]
+    with pytest.raises(IndexError):
+        tensor1d_tensor.scatter_([10], tensor1d.tensor([1.0]))
+
+@pytest.mark.parametrize("size", [1, 64, 100, 1000])
+def test_masked_select(size):
+    torch_tensor = torch.arange(size, dtype=torch.float32)
+    tensor1d_tensor = tensor1d.arange(size)
+    torch_mask = (torch_tensor < size / 4) | (torch_tensor > size / 2)
+    tensor1d_mask = (tensor1d_tensor < size / 4) | (tensor1d_tensor > size / 2)
+    assert_tensor_equal(torch_tensor.masked_select(torch_mask), tensor1d_tensor.masked_select(tensor1d_mask))
+    torch_result = torch.flip(torch_tensor, [0]).masked_select(torch_mask)
+    assert_tensor_equal(torch_result, tensor1d_tensor[::-1].masked_select(tensor1d_mask))
+    int_tensor = tensor1d.tensor(range(size), dtype=tensor1d.int64)
+    assert_tensor_equal(torch_tensor.masked_select(torch_mask), int_tensor.masked_select(tensor1d_mask))
+    with pytest.raises(ValueError):
+        tensor1d_tensor.masked_select(tensor1d_tensor)
+
+# copy_ / contiguous / clone, and slice assignment on top of them
+def test_copy():
+    torch_tensor = torch.arange(20, dtype=torch.float32)
+    tensor1d_tensor = tensor1d.arange(20)
+    torch_tensor[2:12:3] = torch.tensor([-1.0, -2.0, -3.0, -4.0])
+    tensor1d_tensor[2:12:3] = tensor1d.tensor([-1.0, -2.0, -3.0, -4.0])
+    assert_tensor_equal(torch_tensor, tensor1d_tensor)
+    torch_tensor[15:] = 7.0
+    tensor1d_tensor[15:] = 7.0
+    assert_tensor_equal(torch_tensor, tensor1d_tensor)
+    torch_tensor[:3] = torch.tensor([1, 2, 3])
+    tensor1d_tensor[:3] = tensor1d.tensor([1, 2, 3], dtype=tensor1d.int64)
+    assert_tensor_equal(torch_tensor, tensor1d_tensor)
+    # overlapping views of the same storage, e.g. reversing in place
+    tensor1d_tensor[:] = tensor1d_tensor[::-1]
+    assert tensor1d_tensor.tolist() == torch.flip(torch_tensor, [0]).tolist()
+    tensor1d_tensor[1:] = tensor1d_tensor[:-1]
+    assert tensor1d_tensor.tolist()[1:] == torch.flip(torch_tensor, [0]).tolist()[:-1]
+    with pytest.raises(ValueError):
+        tensor1d_tensor[0:5] = tensor1d.arange(4)
+
+@pytest.mark.parametrize("step", [1, 2, 7, -1, -3])
+@pytest.mark.parametrize("size", [10, 5000, 3000000])
+def test_contiguous_and_clone(size, step):
+    tensor1d_tensor = tensor1d.arange(size)
+    view = tensor1d_tensor[::step]
+    expected = [float(x) for x in range(size)][::step]
+    # spot-check the large sizes (those take the streaming path), to keep the test fast
+    positions = range(len(expected)) if size < 10000 else [0, 1, 2, 3, 4, 5, 6, 7, 1234, len(expected) - 1]
+    for result in (view.contiguous(), view.clone()):
+        assert len(result) == len(expected)
+        assert [result[i].item() for i in positions] == [expected[i] for i in positions]
+    # a clone has its own storage, writing to it leaves the original alone
+    clone = view.clone()
+    clone[0] = -1.0
+    assert view[0].item() == expected[0]
+    # whereas contiguous() of a contiguous tensor is a view of the same storage
+    contiguous = tensor1d_tensor[3:].contiguous()
+    contiguous[0] = -1.0
+    assert tensor1d_tensor[3].item() == -1.0
+
+# storage introspection and compaction of small views over big storages
+def test_storage_stats():
+    t = tensor1d.arange(1000)
+    s1 = t[10:20]
+    s2 = t[15:30:5]
+    assert t.storage_stats() == {"nbytes": 4000, "reachable_bytes": 4000, "released_bytes": 0, "num_views": 3}
+    del t
+    # the views reach [10, 20) and [15, 25], i.e. 16 elements of the 1000
+    assert s1.storage_stats() == {"nbytes": 4000, "reachable_bytes": 64, "released_bytes": 0, "num_views": 2}
+    assert s1.storage_stats() in tensor1d.storage_stats()
+
+# the list of storages is walked while other threads (not holding the GIL in C) change it
+def test_storage_stats_threads():
+    import threading
+    stop = threading.Event()
+    def churn():
+        while not stop.is_set():
+            t = tensor1d.arange(16)
+            views = [t[i:] for i in range(8)]
+            del t, views
+    def compact():
+        while not stop.is_set():
+            t = tensor1d.arange(1000)
+            views = [t[i:i + 2] for i in range(0, 100, 10)]
+            del t
+            views[0].compact_storage()
+            del views
+    def walk():
+        while not stop.is_set():
+            tensor1d.storage_stats()
+    tensor1d.set_compaction_policy(0.25)
+    try:
+        threads = [threading.Thread(target=churn, daemon=True) for _ in range(4)]
+        threads += [threading.Thread(target=compact, daemon=True) for _ in range(2)]
+        threads += [threading.Thread(target=walk, daemon=True) for _ in range(2)]
+        for thread in threads:
+            thread.start()
+        stop.wait(0.5)
+        stop.set()
+        for thread in threads:
+            thread.join(timeout=10)
+            assert not thread.is_alive()
+    finally:
+        tensor1d.set_compaction_policy(0.0)
+
+def test_compaction():
+    tensor1d.set_compaction_policy(0.25)
+    try:
+        t = tensor1d.arange(1000)
+        s1 = t[10:20]
+        s2 = t[15:25]
+        s3 = t[500:600:20]
+        reversed_view = t[900:800:-10]
+        del t
+        assert s1.tolist() == [float(x) for x in range(10, 20)]
+        assert s3.tolist() == [float(x) for x in range(500, 600, 20)]
+        assert reversed_view.tolist() == [float(x) for x in range(900, 800, -10)]
+        # overlapping views were compacted together, and still share their storage
+        assert s1.storage_stats() == {"nbytes": 60, "reachable_bytes": 60, "released_bytes": 0, "num_views": 2}
+        s1[-1] = -1.0
+        assert s2[4].item() == -1.0
+        # a view on its own is packed contiguously
+        assert s3.storage_stats() == {"nbytes": 20, "reachable_bytes": 20, "released_bytes": 0, "num_views": 1}
+        assert reversed_view.storage_stats() == {"nbytes": 40, "reachable_bytes": 40, "released_bytes": 0, "num_views": 1}
+        # a storage that is still mostly reachable is left alone
+        t = tensor1d.arange(100)
+        s = t[1:]
+        del t
+        assert s.storage_stats()["nbytes"] == 400
+    finally:
+        tensor1d.set_compaction_policy(0.0)
+
+def test_page_release():
+    tensor1d.set_page_release(True)
+    try:
+        size = 1 << 22 # 16MB of floats
+        t = tensor1d.arange(size)
+        head = t[:10]
+        middle = t[size // 2:size // 2 + 5000:2]
+        tail = t[::-1][:10]
+        del t
+        stats = head.storage_stats()
+        # everything but the few pages holding the views goes back to the OS
+        assert stats["num_views"] == 3
+        assert stats["released_bytes"] > 0
+        assert stats["nbytes"] - stats["released_bytes"] <= 4 * 65536
+        assert head.tolist() == [float(x) for x in range(10)]
+        assert middle[::500].tolist() == [float(x) for x in range(size // 2, size // 2 + 5000, 1000)]
+        assert tail.tolist() == [float(size - 1 - x) for x in range(10)]
+        # new views can only be made over what is still reachable
+        assert head.as_strided(3, 1, size // 2).tolist() == [float(size // 2 + x) for x in range(3)]
+        with pytest.raises(ValueError):
+            head.as_strided(10, 1, 100)
+        del middle
+        assert head.storage_stats()["released_bytes"] > stats["released_bytes"]
+    finally:
+        tensor1d.set_page_release(False)
+
+# memory-mapped, file-backed tensors
+def test_from_file(tmp_path):
+    import struct
+    path = tmp_path / "floats.bin"
+    values = [float(x) for x in range(5000)]
+    header = b"16 bytes header!"
+    path.write_bytes(header + struct.pack(f"{len(values)}f", *values))
+
+    t = tensor1d.from_file(path, offset=len(header))
+    assert len(t) == len(values)
+    assert t[::-7].tolist() == values[::-7]
+    t[1000:2000].advise("willneed")
+    t.advise("random")
+    # read-only by default
+    with pytest.raises(ValueError):
+        t[0] = 1.0
+    with pytest.raises(ValueError):
+        t[0:2] = 1.0
+    # slices keep the mapping alive after the tensor goes away
+    s = t[4990:]
+    del t
+    assert s.tolist() == values[4990:]
+
+    # copy-on-write: changes stay private to the tensor, the file is untouched
+    c = tensor1d.from_file(path, offset=len(header), size=10, mode="c")
+    c[0:10] = c + 1.0
+    assert c.tolist() == [x + 1.0 for x in values[:10]]
+    assert tensor1d.from_file(path, offset=len(header), size=10).tolist() == values[:10]
+
+    path_int = tmp_path / "int64.bin"
+    path_int.write_bytes(struct.pack("3q", 2**40, -1, 7))
+    assert tensor1d.from_file(path_int, dtype=tensor1d.int64).tolist() == [2**40, -1, 7]
+    with pytest.raises(OSError):
+        tensor1d.from_file(path_int, dtype=tensor1d.int64, offset=4)
+    with pytest.raises(OSError):
+        tensor1d.from_file(path_int, dtype=tensor1d.int64, size=4)
+    with pytest.raises(OSError):
+        tensor1d.from_file(tmp_path / "missing.bin")
+
+def test_save_load(tmp_path):
+    import struct
+    path = tmp_path / "tensors.t1d"
+    t = tensor1d.arange(100000)
+    mask = tensor1d.arange(1000) > 500.0
+    tensors = {
+        "contiguous": t,
+        "strided": t[::-3],
+        "int64": tensor1d.tensor([2**40, -1, 7], dtype=tensor1d.int64),
+        "mask": mask[3:900],  # does not start on a word boundary
+        "empty": t[5:5],
+    }
+    tensor1d.save(tensors, path)
+    data = path.read_bytes()
+    assert data[:8] == b"TENSOR1D"
+    for i in range(len(tensors)):
+        entry = 16 + 128 * i
+        assert struct.unpack_from("Q", data, entry + 120)[0] % 64 == 0
+
+    loaded = tensor1d.load(path)
+    assert list(loaded) == list(tensors)
+    for name, t in tensors.items():
+        assert loaded[name].dtype == t.dtype
+        assert loaded[name].tolist() == t.tolist()
+    # zero-copy mmap: read-only unless asked for copy-on-write
+    with pytest.raises(ValueError):
+        loaded["strided"][0] = 1.0
+    c = tensor1d.load(path, mode="c")["int64"]
+    c[0] = 3
+    assert c.tolist() == [3, -1, 7]
+    assert tensor1d.load(path)["int64"].tolist() == [2**40, -1, 7]
+
+    with pytest.raises(ValueError):
+        tensor1d.load(tmp_path / "not_a_tensor_file")
+    # save always writes contiguous data, but the format allows a stride: the entry is
+    # then a strided view of the mapped span
+    strided = bytearray(data)
+    struct.pack_into("ii", strided, 16 + 108, 50000, 2)
+    path.write_bytes(bytes(strided))
+    assert tensor1d.load(path)["contiguous"].tolist() == tensors["contiguous"][::2].tolist()
+    # entries whose span overflows, or reaches past the end of the file, are rejected
+    for size, stride in [(3, 1 << 30), (2, 1 << 30), (100000, 2)]:
+        corrupt = bytearray(data)
+        struct.pack_into("ii", corrupt, 16 + 108, size, stride)
+        path.write_bytes(bytes(corrupt))
+        with pytest.raises(ValueError):
+            tensor1d.load(path)
+
+def test_npy(tmp_path):
+    np = pytest.importorskip("numpy")
+    mask = tensor1d.arange(1000) > 500.0
+    for t in [tensor1d.arange(10000)[::-3], tensor1d.tensor([2**40, -1, 7], dtype=tensor1d.int64),
+              tensor1d.tensor([1, -2], dtype=tensor1d.int32), mask[3:900], tensor1d.arange(0)]:
+        path = tmp_path / "t.npy"
+        tensor1d.save_npy(t, path)
+        assert np.load(path).tolist() == t.tolist()
+        assert tensor1d.load_npy(path).tolist() == t.tolist()
+
+    # files written by numpy: aligned ones are mapped, 2-d ones flattened
+    path = tmp_path / "np.npy"
+    a = np.arange(12, dtype=np.float32).reshape(3, 4)
+    np.save(path, a)
+    t = tensor1d.load_npy(path)
+    assert t.tolist() == a.ravel().tolist()
+    with pytest.raises(ValueError):
+        t[0] = 1.0
+    np.save(path, np.array([True, False, True]))
+    assert tensor1d.load_npy(path).tolist() == [True, False, True]
+    np.save(path, np.arange(3, dtype=np.float64))
+    with pytest.raises(ValueError):
+        tensor1d.load_npy(path)
+
+def test_safetensors(tmp_path):
+    import json, struct
+    mask = tensor1d.arange(100) > 50.0
+    tensors = {
+        "weight": tensor1d.arange(1000)[::7],
+        "steps": tensor1d.tensor([2**40, 3], dtype=tensor1d.int64),
+        "mask": mask[1:],
+        "ids": tensor1d.tensor([4, 5, 6], dtype=tensor1d.int32),
+    }
+    path = tmp_path / "t.safetensors"
+    tensor1d.save_safetensors(tensors, path)
+    loaded = tensor1d.load_safetensors(path)
+    assert sorted(loaded) == sorted(tensors)
+    for name, t in tensors.items():
+        assert loaded[name].dtype == t.dtype
+        assert loaded[name].tolist() == t.tolist()
+
+    # a file the way the safetensors library lays it out, with a misaligned tensor and metadata
+    header = {"__metadata__": {"format": "pt"},
+              "odd": {"dtype": "I32", "shape": [2], "data_offsets": [1, 9]},
+              "m": {"dtype": "F32", "shape": [2, 2], "data_offsets": [9, 25]}}
+    data = b"\x00" + struct.pack("2i", 7, -7) + struct.pack("4f", 1.0, 2.0, 3.0, 4.0)
+    blob = json.dumps(header).encode()
+    path.write_bytes(struct.pack("<Q", len(blob)) + blob + data)
+    loaded = tensor1d.load_safetensors(path, mode="c")
+    assert loaded["odd"].tolist() == [7, -7]
+    assert loaded["m"].tolist() == [1.0, 2.0, 3.0, 4.0]
+    loaded["odd"][0] = 1
+    assert loaded["odd"].tolist() == [1, -7]
+
+def test_copy_on_write():
+    tensor1d.set_copy_on_write(True)
+    try:
+        n = 1000000  # about 15 chunks of float32
+        t = tensor1d.arange(n)
+        c = t.clone()
+        c[5] = -1.0
+        c[700000] = -2.0
+        t[6] = -3.0
+        assert (c[5].item(), c[6].item(), c[700000].item()) == (-1.0, 6.0, -2.0)
+        assert (t[5].item(), t[6].item(), t[700000].item()) == (5.0, -3.0, 700000.0)
+        # cloning again picks up what t wrote since the last clone
+        c2 = t.clone()
+        t[6] = 6.0
+        assert c2[6].item() == -3.0 and t[6].item() == 6.0
+        # a clone of a clone, and of a view that starts on a chunk
+        cc = c.clone()
+        c[5] = 5.0
+        assert cc[5].item() == -1.0
+        v = t[65536 * 2:].clone()
+        assert len(v) == n - 65536 * 2
+        assert v[0].item() == 65536 * 2
+        v.copy_(tensor1d.tensor([0.5]))
+        assert t[65536 * 2].item() == 65536 * 2 and v[-1].item() == 0.5
+        # in-place kernels go through the write barrier too
+        c.scatter_(tensor1d.tensor([n - 1], dtype=tensor1d.int64), tensor1d.tensor([7.0]))
+        assert c[n - 1].item() == 7.0 and t[n - 1].item() == n - 1
+        # clones outlive the original
+        del t
+        assert c2[700000].item() == 700000.0 and c2[6].item() == -3.0
+        ints = tensor1d.arange(n).to(tensor1d.int64)
+        ci = ints.clone()
+        ci[3] = 2**40
+        assert ci[3].item() == 2**40 and ints[3].item() == 3
+        # strided views still get a real copy
+        s = c2[::3].clone()
+        assert (s[1].item(), s[2].item()) == (3.0, -3.0)
+    finally:
+        tensor1d.set_copy_on_write(False)
+
+def test_version_and_repr_cache():
+    t = tensor1d.arange(5)
+    view = t[1:3]
+    assert str(t) == "[0.0, 1.0, 2.0, 3.0, 4.0]"
+    assert str(view) == "[1.0, 2.0]"
+    version = t._version
+    t[1] = 10.0
+    assert t._version == view._version == version + 1
+    assert str(t) == "[0.0, 10.0, 2.0, 3.0, 4.0]"
+    # a write through another view of the same Storage shows up too
+    view[1] = 20.0
+    assert str(view) == "[10.0, 20.0]"
+    assert str(t) == "[0.0, 10.0, 20.0, 3.0, 4.0]"
+    t[3:] = tensor1d.tensor([7.0, 8.0])
+    assert str(t) == "[0.0, 10.0, 20.0, 7.0, 8.0]"
+    # the version doesn't move for reads, and survives compaction
+    version = view._version
+    str(view)
+    view.compact_storage()
+    assert view._version == version
+    del t
+    view[0] = 1.0
+    assert str(view) == "[1.0, 20.0]"
+    # writes that fail their checks don't count as writes
+    version = view._version
+    with pytest.raises(ValueError):
+        view.copy_(tensor1d.arange(5))
+    with pytest.raises(IndexError):
+        view.scatter_(tensor1d.tensor([0, 2]), tensor1d.tensor([1.0, 2.0]))
+    assert view._version == version
+
+def test_printing(tmp_path):
+    values = [0.1, 0.25, 1.0 / 3.0, -0.0, 1e20, 1.5e-7, 16777216.0, 3.4028235e38, float("inf"), float("nan")]
+    t = tensor1d.tensor(values)
+    assert str(t) == "[0.1, 0.25, 0.33333334, -0.0, 1e+20, 1.5e-07, 16777216.0, 3.4028235e+38, inf, nan]"
+    # what gets printed reads back as exactly the same float32
+    assert tensor1d.tensor([float(x) for x in str(t)[1:-1].split(", ")]).tolist()[:-1] == t.tolist()[:-1]
+    cached = tensor1d.tensor([0.125])
+    assert str(cached) == "[0.125]"
+    try:
+        tensor1d.set_printoptions(precision=2)
+        assert str(tensor1d.tensor([0.125, -1.0, 2.5])) == "[0.12, -1.00, 2.50]"
+        # a repr cached under the old options is made anew
+        assert str(cached) == "[0.12]"
+        tensor1d.set_printoptions(threshold=5, edgeitems=2)
+        assert str(tensor1d.arange(10).to(tensor1d.int64)) == "[0, 1, ..., 8, 9]"
+        assert str(tensor1d.arange(5)) == "[0.0, 1.0, 2.0, 3.0, 4.0]"
+        mask = tensor1d.arange(8) > 3.0
+        assert str(mask) == "[False, False, ..., True, True]"
+    finally:
+        tensor1d.set_printoptions()
+    big = tensor1d.arange(100000)
+    assert str(big) == "[0.0, 1.0, 2.0, ..., 99997.0, 99998.0, 99999.0]"
+
+    # streaming to a file gives the same text, without building it in memory
+    tensor1d.set_printoptions(threshold=10**9)
+    try:
+        path = tmp_path / "t.txt"
+        with open(path, "w") as f:
+            big[::-1].write(f)
+        assert path.read_text() == str(big[::-1])
+        assert path.read_text().count(", ") == len(big) - 1
+    finally:
+        tensor1d.set_printoptions()
+
+def test_from_text(tmp_path):
+    import struct
+    text = b"1.5, -2,3e2\n0.1,  1e-40 ,-0\n+7.25e-3,3.4028235e38,nan,inf"
+    t = tensor1d.from_text(text, delimiter=",")
+    expected = [1.5, -2.0, 300.0, 0.1, 1e-40, -0.0, 7.25e-3, 3.4028235e38, float("nan"), float("inf")]
+    # compare against float32 rounding of the same text, done by Python
+    as_f32 = [struct.unpack("f", struct.pack("f", x))[0] for x in expected]
+    got = t.tolist()
+    assert len(got) == len(as_f32)
+    assert got[8] != got[8]
+    assert got[:8] + got[9:] == as_f32[:8] + as_f32[9:]
+
+    # a big dump, one number per line, from a file
+    path = tmp_path / "dump.txt"
+    path.write_text("\n".join(str(float(i) / 7.0) for i in range(100000)))
+    t = tensor1d.from_text(path)
+    assert len(t) == 100000
+    assert t[1].item() == struct.unpack("f", struct.pack("f", 1.0 / 7.0))[0]
+    assert t[99999].item() == struct.unpack("f", struct.pack("f", 99999.0 / 7.0))[0]
+    assert len(tensor1d.from_text(b"  \n ")) == 0
+
+    with pytest.raises(ValueError):
+        tensor1d.from_text(b"1.0, two, 3.0", delimiter=",")
+    # whitespace collapses, delimiters don't: an empty field is not a number
+    assert tensor1d.from_text(b"1 ,\t 2,\n3,", delimiter=",").tolist() == [1.0, 2.0, 3.0]
+    for text in [b"1,,2", b"1, ,2", b",1", b"1,2,,"]:
+        with pytest.raises(ValueError):
+            tensor1d.from_text(text, delimiter=",")
+
+def test_shared_memory():
+    import os
+    t = tensor1d.arange(10).share_memory_()
+    assert t.is_shared() and t.tolist() == [float(i) for i in range(10)]
+    view = t[8:1:-3]
+    handle = view.export_handle()
+    pid = os.fork()
+    if pid == 0:
+        # the child maps the same memory: reads see the parent's data, writes are seen back
+        try:
+            v = tensor1d.import_handle(handle)
+            ok = v.tolist() == [8.0, 5.0, 2.0]
+            v[1] = -5.0
+            os._exit(0 if ok else 1)
+        except BaseException:
+            os._exit(2)
+    _, status = os.waitpid(pid, 0)
+    assert os.WEXITSTATUS(status) == 0
+    assert t[5].item() == -5.0
+
+    # importing in the same process works as well, and the mapping outlives the original
+    s = tensor1d.empty_shared(4, dtype=tensor1d.int64)
+    s[0:4] = tensor1d.tensor([1, 2, 3, 2**40], dtype=tensor1d.int64)
+    s2 = tensor1d.import_handle(s.export_handle())
+    del s
+    assert s2.tolist() == [1, 2, 3, 2**40] and s2.is_shared()
+    with pytest.raises(ValueError):
+        tensor1d.arange(3).export_handle()
+
+def test_socket_transport(tmp_path):
+    import os, socket
+    for kind in [socket.SOCK_SEQPACKET, socket.SOCK_STREAM]:
+        producer, consumer = socket.socketpair(socket.AF_UNIX, kind)
+        t = tensor1d.arange(20)
+        tensor1d.send(producer, t)
+        tensor1d.send(producer, t[15:2:-4])  # a slice travels as a view
+        tensor1d.send(producer, tensor1d.tensor([2**40, 5], dtype=tensor1d.int64))
+        assert t.is_shared()  # moved into shared memory by the first send
+        whole, view, ints = tensor1d.recv(consumer), tensor1d.recv(consumer), tensor1d.recv(consumer)
+        assert whole.tolist() == t.tolist()
+        assert view.tolist() == [15.0, 11.0, 7.0, 3.0]
+        assert ints.tolist() == [2**40, 5]
+        view[0] = -1.0  # same memory as the sender's
+        assert t[15].item() == -1.0
+        producer.close()
+        with pytest.raises(EOFError):
+            tensor1d.recv(consumer)
+        consumer.close()
+
+    # tensors over a memory-mapped file stay there, and are sent as a copy in shared memory
+    tensor1d.save({"t": tensor1d.arange(20)}, tmp_path / "t.t1d")
+    producer, consumer = socket.socketpair(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+    for mode in ["r", "c"]:
+        t = tensor1d.load(tmp_path / "t.t1d", mode=mode)["t"]
+        tensor1d.send(producer, t[::-3])
+        received = tensor1d.recv(consumer)
+        assert received.tolist() == t[::-3].tolist() and not t.is_shared()
+        received[0] = -1.0
+        assert t[19].item() == 19.0
+    producer.close()
+    consumer.close()
+
+    # across processes
+    producer, consumer = socket.socketpair(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+    pid = os.fork()
+    if pid == 0:
+        try:
+            producer.close()
+            v = tensor1d.recv(consumer)
+            v[0:2] = tensor1d.tensor([7.0, 8.0])
+            os._exit(0)
+        except BaseException:
+            os._exit(1)
+    consumer.close()
+    t = tensor1d.arange(10)
+    tensor1d.send(producer, t[::5])
+    _, status = os.waitpid(pid, 0)
+    assert os.WEXITSTATUS(status) == 0
+    assert t.tolist()[::5] == [7.0, 8.0]
+    producer.close()
+
+def test_collectives():
+    import os
+    world, n = 4, 2500
+    group = tensor1d.ProcessGroup(world, capacity=1000)  # several rounds per collective
+
+    def work(rank):
+        g = group if rank == 0 else tensor1d.ProcessGroup(fd=group.fd, rank=rank)
+        t = tensor1d.arange(n) + float(rank)
+        g.all_reduce_(t)
+        ok = t.tolist() == [4.0 * i + 6.0 for i in range(n)]
+        # strided views take part like anything else
+        b = tensor1d.arange(2 * n)[::-2] + float(rank)
+        g.broadcast_(b, src=2)
+        ok = ok and b.tolist() == [float(2 * n - 1 - 2 * i + 2) for i in range(n)]
+        gathered = g.all_gather(tensor1d.tensor([float(rank), float(-rank)]))
+        ok = ok and gathered.tolist() == [0.0, -0.0, 1.0, -1.0, 2.0, -2.0, 3.0, -3.0]
+        return ok
+
+    pids = []
+    for rank in range(1, world):
+        pid = os.fork()
+        if pid == 0:
+            try:
+                os._exit(0 if work(rank) else 1)
+            except BaseException:
+                os._exit(2)
+        pids.append(pid)
+    assert work(0)
+    for pid in pids:
+        _, status = os.waitpid(pid, 0)
+        assert os.WEXITSTATUS(status) == 0
+    with pytest.raises(ValueError):
+        group.all_reduce_(tensor1d.arange(3).to(tensor1d.int32))
+
+def _pool_increment(t):
+    t[0] = 42.0
+    return t + 1.0
+
+def test_pickle():
+    import multiprocessing
+    import pickle
+    t = tensor1d.arange(10)
+    for protocol in range(pickle.HIGHEST_PROTOCOL + 1):
+        assert pickle.loads(pickle.dumps(t, protocol=protocol)).tolist() == t.tolist()
+    # protocol 5 hands the elements out-of-band, in a single buffer; strided views are packed
+    buffers = []
+    data = pickle.dumps(t[::3], protocol=5, buffer_callback=buffers.append)
+    assert len(buffers) == 1 and len(data) < 100
+    u = pickle.loads(data, buffers=buffers)
+    assert u.tolist() == [0.0, 3.0, 6.0, 9.0]
+    # ... and the rebuilt tensor is a view of that buffer, not a copy of it
+    u[1] = -3.0
+    assert buffers[0].raw()[4:8] == b"\x00\x00\x40\xc0"
+    mask = tensor1d.tensor([True, False, True] * 50, dtype=tensor1d.bool_)
+    for view in [mask, mask[64:], mask[1::2]]:
+        assert pickle.loads(pickle.dumps(view, protocol=5)).tolist() == view.tolist()
+    big = tensor1d.tensor([1, -2**40], dtype=tensor1d.int64)
+    assert pickle.loads(pickle.dumps(big, protocol=2)).tolist() == [1, -2**40]
+
+    # frombuffer shares the memory of the buffer
+    raw = bytearray(16)
+    f = tensor1d.frombuffer(raw)
+    f[1] = 2.0
+    assert len(f) == 4 and raw[4:8] == b"\x00\x00\x00\x40"
+    with pytest.raises(ValueError):
+        tensor1d.frombuffer(bytes(8))[0] = 1.0
+
+    # multiprocessing moves tensors into shared memory, so workers see the same elements
+    with multiprocessing.get_context("fork").Pool(1) as pool:
+        out = pool.apply(_pool_increment, (t,))
+    assert t.is_shared() and t[0].item() == 42.0
+    assert out.tolist() == [43.0] + [float(i + 1) for i in range(1, 10)]
+
+def test_numpy_interop():
+    import array
+    np = pytest.importorskip("numpy")
+    # tensors -> numpy: the array is a view of the same memory, with the view's strides
+    t = tensor1d.arange(10)
+    a = t.numpy()
+    a[2] = -2.0
+    assert t[2].item() == -2.0
+    view = t[8:1:-3]
+    assert np.asarray(view).tolist() == view.tolist() and np.asarray(view).strides == (-12,)
+    assert np.asarray(t.to(tensor1d.int64)[::2]).tolist() == [0, -2, 4, 6, 8]
+    assert np.asarray(tensor1d.arange(1).expand(3)).tolist() == [0.0, 0.0, 0.0]
+    with pytest.raises(TypeError):
+        np.asarray(tensor1d.tensor([True, False], dtype=tensor1d.bool_))
+
+    # numpy (or any buffer) -> tensors: no copy either, strided arrays included
+    x = np.arange(12, dtype=np.float32)
+    u = tensor1d.as_tensor(x[::-4])
+    assert u.tolist() == [11.0, 7.0, 3.0]
+    u[0] = -1.0
+    assert x[11] == -1.0
+    w = tensor1d.from_numpy(x[3:])
+    del x
+    assert w.tolist()[:3] == [3.0, 4.0, 5.0]
+    frozen = np.arange(4, dtype=np.int64)
+    frozen.flags.writeable = False
+    with pytest.raises(ValueError):
+        tensor1d.as_tensor(frozen)[0] = 3
+    ints = array.array("i", [1, 2, 3])
+    assert tensor1d.as_tensor(ints).dtype == tensor1d.int32
+    assert tensor1d.as_tensor(memoryview(array.array("f", [1, 2, 3, 4]))[::2]).tolist() == [1.0, 3.0]
+    assert tensor1d.as_tensor([1.5, 2]).tolist() == [1.5, 2.0]
+    with pytest.raises(TypeError):
+        tensor1d.from_numpy(np.zeros(3))
+    # memory that isn't ours never moves: clones copy it, and it can't go to shared memory
+    import pickle
+    from multiprocessing.reduction import ForkingPickler
+    x = np.zeros(1 << 18, dtype=np.float32)
+    t = tensor1d.from_numpy(x)
+    tensor1d.set_copy_on_write(True)
+    try:
+        c = t.clone()
+    finally:
+        tensor1d.set_copy_on_write(False)
+    x[0] = 123.0
+    assert t[0].item() == 123.0 and c[0].item() == 0.0
+    with pytest.raises(OSError):
+        t.share_memory_()
+    shipped = pickle.loads(ForkingPickler.dumps(t[:3]))
+    x[1] = 5.0
+    assert shipped.tolist() == [123.0, 0.0, 0.0] and not t.is_shared()
+
+    # the buffer protocol (memoryview(t) from Python 3.12 on) describes strided views too
+    buffer = view.__buffer__(0)
+    assert buffer.tolist() == view.tolist() and buffer.strides == (-12,)
+
+    # while an array or buffer points into a tensor, its memory stays where it is
+    import socket
+    t = tensor1d.arange(10)
+    a = t.numpy()
+    with pytest.raises(OSError):
+        t.share_memory_()
+    producer, consumer = socket.socketpair(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+    tensor1d.send(producer, t)  # sent as a copy, like a tensor over a file
+    assert tensor1d.recv(consumer).tolist() == t.tolist() and not t.is_shared()
+    producer.close()
+    consumer.close()
+    assert pickle.loads(ForkingPickler.dumps(t[:3])).tolist() == [0.0, 1.0, 2.0] and not t.is_shared()
+    buffer = t.__buffer__(0)
+    del a
+    with pytest.raises(OSError):
+        t.share_memory_()
+    del buffer
+    t.share_memory_()
+    a = t.numpy()
+    assert a[5] == 5.0
+    tensor1d.set_compaction_policy(0.5)
+    try:
+        t = tensor1d.arange(1000)
+        a = t[0:10].numpy()
+        del t
+        assert a[5] == 5.0
+    finally:
+        tensor1d.set_compaction_policy(0.0)
+    t = tensor1d.arange(1 << 18)
+    a = t.numpy()
+    tensor1d.set_copy_on_write(True)
+    try:
+        c = t.clone()
+        a[5] = -1.0
+        assert t[5].item() == -1.0 and c[5].item() == 5.0
+        # writes through an array go around the write barrier: no stale text or clones
+        t = tensor1d.arange(4)
+        assert str(t) == "[0.0, 1.0, 2.0, 3.0]"
+        np.asarray(t)[0] = 5.0
+        assert str(t) == "[5.0, 1.0, 2.0, 3.0]"
+        c1 = tensor1d.arange(1 << 18).clone()
+        np.asarray(c1)[0] = 99.0
+        assert c1.clone()[0].item() == 99.0
+        a = c1.numpy()
+        c2 = c1.clone()
+        a[1] = 98.0
+        assert c1.clone()[1].item() == 98.0 and c2[1].item() == 1.0
+    finally:
+        tensor1d.set_copy_on_write(False)
+
+def test_dlpack():
+    np = pytest.importorskip("numpy")
+    # export: the consumer sees the same memory, with our offset and (negative) stride
+    t = tensor1d.arange(10)
+    a = np.from_dlpack(t[8:1:-3])
+    assert a.tolist() == [8.0, 5.0, 2.0] and a.strides == (-12,)
+    a[0] = -8.0
+    assert t[8].item() == -8.0
+    assert t.storage_stats()["num_views"] == 2  # the DLManagedTensor holds a view
+    del a
+    assert t.storage_stats()["num_views"] == 1
+    # ... and keeps the Storage alive after the tensor is gone
+    b = np.from_dlpack(t[:3])
+    del t
+    assert b.tolist() == [0.0, 1.0, 2.0]
+    # an unconsumed capsule cleans up after itself
+    t = tensor1d.arange(3)
+    capsule = t.__dlpack__()
+    del capsule
+    assert t.storage_stats()["num_views"] == 1
+    # the exported memory is pinned: it doesn't move into shared memory or get compacted
+    t = tensor1d.arange(10)
+    a = np.from_dlpack(t)
+    with pytest.raises(OSError):
+        t.share_memory_()
+    a[5] = -5.0
+    assert a[5] == -5.0 and str(t).startswith("[0.0, 1.0, 2.0, 3.0, 4.0, -5.0")
+    del a
+    t.share_memory_()
+    tensor1d.set_compaction_policy(0.5)
+    try:
+        t = tensor1d.arange(1000)
+        a = np.from_dlpack(t[990:])
+        del t
+        a[0] = -1.0
+        assert a.tolist() == [-1.0] + [float(x) for x in range(991, 1000)]
+    finally:
+        tensor1d.set_compaction_policy(0.0)
+
+    # import: a view of the producer's memory
+    x = np.arange(12, dtype=np.int64)
+    u = tensor1d.from_dlpack(x[::-4])
+    assert u.tolist() == [11, 7, 3] and u.dtype == tensor1d.int64
+    u[0] = 100
+    assert x[11] == 100
+    del x
+    assert u.tolist() == [100, 7, 3]
+    assert tensor1d.from_dlpack(np.array(3.5, dtype=np.float32)).tolist() == [3.5]
+    assert tensor1d.from_dlpack(tensor1d.arange(4)[1:]).tolist() == [1.0, 2.0, 3.0]
+    with pytest.raises(BufferError):
+        tensor1d.from_dlpack(np.zeros(3))
+
+    # read-only tensors can only travel as DLPack 1.0, which can say so
+    frozen = np.arange(3, dtype=np.float32)
+    frozen.flags.writeable = False
+    r = tensor1d.from_dlpack(frozen)
+    with pytest.raises(ValueError):
+        r[0] = 1.0
+    assert not np.from_dlpack(r).flags.writeable
+    with pytest.raises(BufferError):
+        r.__dlpack__()
+    with pytest.raises(BufferError):
+        np.from_dlpack(tensor1d.tensor([True], dtype=tensor1d.bool_))
+
+def test_take_put():
+    index = [7, 0, 3, 7, 9]
+    torch_tensor = torch.arange(10, dtype=torch.float32)
+    tensor1d_tensor = tensor1d.arange(10)
+    assert_tensor_equal(torch_tensor.take(torch.tensor(index)), tensor1d_tensor.take(index))
+    torch_tensor.put_(torch.tensor(index), torch.tensor([1.0, 2.0, 3.0, 4.0, 5.0]), accumulate=True)
+    tensor1d_tensor.put_(index, [1.0, 2.0, 3.0, 4.0, 5.0], accumulate=True)
+    assert_tensor_equal(torch_tensor, tensor1d_tensor)
+    torch_tensor.put_(torch.tensor(index[1:]), torch.tensor([-2.0, -3.0, -4.0, -5.0]))
+    assert_tensor_equal(torch_tensor, tensor1d_tensor.put(index[1:], [-2.0, -3.0, -4.0, -5.0]))
+    with pytest.raises(IndexError):
+        tensor1d_tensor.take([10])
+    # item(i) reads one element as a Python scalar, without making a tensor for it
+    view = tensor1d_tensor[::-3]
+    assert [view.item(i) for i in range(-len(view), len(view))] == view.tolist() * 2
+    with pytest.raises(IndexError):
+        view.item(len(view))
+    ints = tensor1d.tensor([1, -2, 2**40], dtype=tensor1d.int64)
+    assert ints.item(2) == 2**40 and ints[::-1].tolist() == [2**40, -2, 1]
+    # lists are converted in one go, unless the values need converting one by one
+    assert tensor1d.tensor([1.5, 2], dtype=tensor1d.int32).tolist() == [1, 2]
+    assert tensor1d.tensor(range(3), dtype=tensor1d.int64).tolist() == [0, 1, 2]
+    assert tensor1d.tensor([True, 2.5]).tolist() == [1.0, 2.5]
+    assert tensor1d.empty(0).tolist() == []
+
+def test_inline_scalar():
+    t = tensor1d.arange(5)
+    # t[i] holds a copy of the element, not a view: t's Storage gains no view
+    s = t[3]
+    assert t.storage_stats()["num_views"] == 1 and s.storage_stats()["nbytes"] == 4
+    t[3] = 100.0
+    assert s.item() == 3.0 and str(s) == "[3.0]"
+    with pytest.raises(IndexError):
+        t[5]
+    # it's a tensor like any other: views of it outlive it, it can move into shared memory
+    v = s[0:1]
+    del s
+    assert v.item() == 3.0
+    s = t[-1].share_memory_()
+    assert s.is_shared() and s.item() == 4.0
+    # and it broadcasts as a plain float
+    torch_tensor = torch.tensor(t.tolist())
+    assert_tensor_equal(torch_tensor + torch_tensor[2], t + t[2])
+    assert_tensor_equal(torch_tensor[2] + torch_tensor, t[2] + t)
+    assert (t.to(tensor1d.int64) + t[1]).tolist() == [1.0, 2.0, 3.0, 101.0, 5.0]
+    assert tensor1d.tensor([2**40], dtype=tensor1d.int64)[0].item() == 2**40
+    # threads (which call in without the GIL) never get the same block, even when
+    # scalars made on one thread are freed on another
+    import threading
+    t = tensor1d.arange(100)
+    shared, errors = [], []
+    def read(k):
+        for _ in range(2000):
+            scalars = [t[k], t[k + 1]]
+            shared.append(t[k])
+            if [s.item() for s in scalars] != [k, k + 1]:
+                errors.append(k)
+            if len(shared) > 50:
+                shared.clear()
+    threads = [threading.Thread(target=read, args=(2 * i,)) for i in range(8)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    assert errors == []
+
+def test_foreach():
+    # contiguous, reversed and strided views (of bigger tensors) all update in place
+    sizes = [1, 5, 300, 1000]
+    strided = tensor1d.arange(600)
+    params = [tensor1d.arange(1), tensor1d.arange(5)[::-1], strided[::2], tensor1d.arange(1000)]
+    torch_params = [torch.tensor(p.tolist()) for p in params]
+    # the last one is added to its tensor by broadcasting
+    grads = [tensor1d.arange(n)[::-1] for n in sizes[:3]] + [tensor1d.tensor([3.0])]
+    torch_grads = [torch.tensor(g.tolist()) for g in grads]
+    tensor1d.foreach_add_(params, grads, alpha=-0.5)
+    torch_params = [p + g * -0.5 for p, g in zip(torch_params, torch_grads)]
+    tensor1d.foreach_mul_(params, 0.25)
+    tensor1d.foreach_add_(params, 1.0)
+    tensor1d.foreach_mul_(params, grads)
+    torch_params = [(p * 0.25 + 1.0) * g for p, g in zip(torch_params, torch_grads)]
+    for torch_param, param in zip(torch_params, params):
+        assert_tensor_equal(torch_param, param)
+    assert strided[1].item() == 1.0  # the elements in between are left alone
+    # an other that overlaps its tensor is read as it was before the update
+    t, u, v = tensor1d.arange(10), tensor1d.arange(10), tensor1d.arange(10)
+    tensor1d.foreach_add_([t[1:], u], [t[:-1], u[::-1]])
+    tensor1d.foreach_mul_([v[::2], v], [v[1::2], v])
+    assert t.tolist() == [0.0] + [2.0 * i - 1.0 for i in range(1, 10)]
+    assert u.tolist() == [9.0] * 10
+    assert v.tolist() == [float((i * (i + 1)) ** 2 if i % 2 == 0 else i * i) for i in range(10)]
+    # nothing is written unless the whole list is fine
+    ints = tensor1d.tensor([1, 2], dtype=tensor1d.int32)
+    before = params[0].tolist()
+    with pytest.raises(ValueError):
+        tensor1d.foreach_add_([params[0], ints], 1.0)
+    with pytest.raises(ValueError):
+        tensor1d.foreach_mul_(params[:2], [grads[1], grads[1]])
+    with pytest.raises(ValueError):
+        tensor1d.foreach_add_(params, grads[:2])
+    assert params[0].tolist() == before
+
+def _optim_setup():
+    # parameters of a few sizes (tails of SIMD lanes and of blocks), one of them strided
+    import random
+    rng = random.Random(0)
+    values = [[rng.uniform(-1, 1) for _ in range(n)] for n in [1, 7, 300]]
+    base = tensor1d.tensor([0.0] * 600)
+    base[::2] = tensor1d.tensor(values[2])
+    params = [tensor1d.tensor(values[0]), tensor1d.tensor(values[1])[::-1], base[::2]]
+    expected = [p.tolist() for p in params]
+    grads = [[[rng.uniform(-1, 1) for _ in p] for p in expected] for _ in range(3)]
+    return params, expected, grads
+
+@pytest.mark.parametrize("momentum,dampening,weight_decay,nesterov", [(0.0, 0.0, 0.0, False), (0.9, 0.1, 0.01, False), (0.9, 0.0, 0.0, True)])
+def test_sgd(momentum, dampening, weight_decay, nesterov):
+    params, expected, grads = _optim_setup()
+    opt = tensor1d.SGD(params, lr=0.1, momentum=momentum, dampening=dampening, weight_decay=weight_decay, nesterov=nesterov)
+    buffers = [None] * len(params)
+    for step_grads in grads:
+        opt.step([tensor1d.tensor(g) for g in step_grads])
+        # torch.optim.SGD, one element at a time
+        for k, (p, g) in enumerate(zip(expected, step_grads)):
+            d = [gi + weight_decay * pi for pi, gi in zip(p, g)]
+            if momentum != 0:
+                b = d if buffers[k] is None else [momentum * bi + (1 - dampening) * di for bi, di in zip(buffers[k], d)]
+                buffers[k] = b
+                d = [di + momentum * bi for di, bi in zip(d, b)] if nesterov else b
+            expected[k] = [pi - 0.1 * di for pi, di in zip(p, d)]
+    for p, e in zip(params, expected):
+        assert p.tolist() == pytest.approx(e, rel=1e-5, abs=1e-6)
+
+@pytest.mark.parametrize("cls", [tensor1d.Adam, tensor1d.AdamW])
+def test_adam(cls):
+    params, expected, grads = _optim_setup()
+    opt = cls(params, lr=0.01, weight_decay=0.1)
+    decoupled = cls is tensor1d.AdamW
+    m = [[0.0] * len(p) for p in expected]
+    v = [[0.0] * len(p) for p in expected]
+    for step, step_grads in enumerate(grads, 1):
+        opt.step([tensor1d.tensor(g) for g in step_grads])
+        # torch.optim.Adam / AdamW, one element at a time
+        for k, g in enumerate(step_grads):
+            for i in range(len(g)):
+                p = expected[k][i]
+                gi = g[i] if decoupled else g[i] + 0.1 * p
+                p = p * (1 - 0.01 * 0.1) if decoupled else p
+                m[k][i] = 0.9 * m[k][i] + 0.1 * gi
+                v[k][i] = 0.999 * v[k][i] + 0.001 * gi * gi
+                denom = (v[k][i] / (1 - 0.999 ** step)) ** 0.5 + 1e-8
+                expected[k][i] = p - 0.01 / (1 - 0.9 ** step) * m[k][i] / denom
+    for p, e in zip(params, expected):
+        assert p.tolist() == pytest.approx(e, rel=1e-4, abs=1e-6)
+    assert opt.exp_avgs[2].tolist() == pytest.approx(m[2], rel=1e-4, abs=1e-6)
+    with pytest.raises(ValueError):
+        opt.step([tensor1d.tensor([0.0])] * 3)